@@ -0,0 +1,97 @@
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include "io.h"
+
+#define MAX_RES 4
+#define MAX_OPS 64
+#define BATCH 32
+#define NUM_OPS 1000000
+
+/*
+ * Writes to /dev/null so that the cost of the operation
+ * itself is negligible and what's measured is the overhead
+ * of submitting and reaping it.
+ */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One submission and one wait per operation. This is
+// what io_send and io_wait used to do.
+static double run_single(struct io_context *ioc, io_handle file, char *buf)
+{
+    double start = now();
+    for (int i = 0; i < NUM_OPS; i++) {
+        struct io_event ev;
+        if (!io_send(ioc, NULL, file, buf, 64))
+            return -1;
+        io_submit(ioc);
+        io_wait(ioc, &ev);
+    }
+    return NUM_OPS / (now() - start);
+}
+
+// Operations are queued in batches and submitted with
+// the same system call that waits for the completions.
+static double run_batched(struct io_context *ioc, io_handle file, char *buf)
+{
+    double start = now();
+    for (int i = 0; i < NUM_OPS; i += BATCH) {
+        for (int j = 0; j < BATCH; j++)
+            if (!io_send(ioc, NULL, file, buf, 64))
+                return -1;
+        int done = 0;
+        while (done < BATCH) {
+            struct io_event evs[BATCH];
+            done += io_wait_many(ioc, evs, BATCH);
+        }
+    }
+    return NUM_OPS / (now() - start);
+}
+
+static bool run(const char *name, struct io_config config, bool batched)
+{
+    struct io_operation ops[MAX_OPS];
+    struct io_resource  res[MAX_RES];
+    struct io_context ioc;
+    if (!io_init_ex(&ioc, res, ops, MAX_RES, MAX_OPS, config)) {
+        fprintf(stderr, "%-8s :: Couldn't initialize I/O context\n", name);
+        return false;
+    }
+
+    io_handle file = io_open_file(&ioc, "/dev/null", IO_ACCESS_WR);
+    if (file == IO_INVALID) {
+        fprintf(stderr, "Couldn't open /dev/null\n");
+        io_free(&ioc);
+        return false;
+    }
+
+    char buf[64];
+    memset(buf, 'x', sizeof(buf));
+
+    double ops_per_sec;
+    if (batched)
+        ops_per_sec = run_batched(&ioc, file, buf);
+    else
+        ops_per_sec = run_single(&ioc, file, buf);
+
+    fprintf(stderr, "%-8s :: %.0f ops/sec\n", name, ops_per_sec);
+
+    io_free(&ioc);
+    return true;
+}
+
+int main(void)
+{
+    io_global_init();
+    run("single",  (struct io_config) {0}, false);
+    run("batched", (struct io_config) {0}, true);
+    run("sqpoll",  (struct io_config) {.sqpoll=true}, true);
+    io_global_free();
+    return 0;
+}
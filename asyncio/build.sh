@@ -1,2 +1,4 @@
 gcc example.c  io.c -o example  -Wall -Wextra -ggdb
 gcc example2.c io.c -o example2 -Wall -Wextra -ggdb
+gcc benchmark.c io.c -o benchmark -Wall -Wextra -O2
+gcc test_close.c io.c -o test_close -Wall -Wextra -ggdb
@@ -1,3 +1,7 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pipe2, F_SETPIPE_SZ
+#endif
+
 #include "io.h"
 
 #include <assert.h>
@@ -10,10 +14,13 @@
 #endif
 
 #if IO_PLATFORM_LINUX
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdatomic.h>
+#include <sys/uio.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
@@ -82,21 +89,59 @@ io_uring_enter(int ring_fd, unsigned int to_submit,
     return (int) syscall(SYS_io_uring_enter, ring_fd, to_submit, 
                          min_complete, flags, NULL, 0);
 }
+static int
+io_uring_register(int ring_fd, unsigned int opcode,
+                  void *arg, unsigned int nr_args)
+{
+    return (int) syscall(SYS_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
 #endif
 
 #if IO_PLATFORM_LINUX
-static bool io_init_linux(struct io_context *ioc)
+static bool io_init_linux(struct io_context *ioc,
+                          struct io_config config)
 {
     
     struct io_uring_params p;
     void *sq_ptr, *cq_ptr;
     /* See io_uring_setup(2) for io_uring_params.flags you can set */
     memset(&p, 0, sizeof(p));
-    int fd = io_uring_setup(32, &p);
+
+    unsigned int entries = config.entries ? config.entries : 32;
+    if (entries < 2)
+        entries = 2; // Room for an operation and its timeout
+
+    /*
+     * Unless told otherwise, make the completion queue big
+     * enough for a completion per operation structure so
+     * that it can't overflow. The kernel rounds the size up
+     * to a power of 2 and clamps it to its maximum.
+     */
+    unsigned int cq_entries = config.cq_entries;
+    if (cq_entries == 0) {
+        cq_entries = 2 * entries;
+        if (cq_entries < ioc->max_ops)
+            cq_entries = ioc->max_ops;
+    }
+    p.flags |= IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = cq_entries;
+
+    if (config.sqpoll) {
+        /*
+         * A kernel thread polls the submission queue, so
+         * operations start without any system call as long
+         * as the thread is awake.
+         */
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = config.sqpoll_idle_ms ? config.sqpoll_idle_ms : 1000;
+    }
+    int fd = io_uring_setup(entries, &p);
     if (fd < 0)
         return false;
 
     ioc->os_handle = fd;
+    ioc->sqpoll = config.sqpoll;
+    ioc->recv_buffers.ring = NULL;
 
     /*
      * io_uring communication happens via 2 shared kernel-user space ring
@@ -140,8 +185,11 @@ static bool io_init_linux(struct io_context *ioc)
     ioc->submissions.head = (_Atomic unsigned*) (sq_ptr + p.sq_off.head);
     ioc->submissions.tail = (_Atomic unsigned*) (sq_ptr + p.sq_off.tail);
     ioc->submissions.mask = (unsigned*) (sq_ptr + p.sq_off.ring_mask);
+    ioc->submissions.flags = (_Atomic unsigned*) (sq_ptr + p.sq_off.flags);
     ioc->submissions.array = sq_ptr + p.sq_off.array;
     ioc->submissions.limit = p.sq_entries;
+    ioc->submissions.unsubmitted = 0;
+    ioc->submissions.local_tail = atomic_load(ioc->submissions.tail);
 
     /* Map in the submission queue entries array */
     ioc->submissions.entries = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
@@ -166,30 +214,141 @@ static bool io_init_linux(struct io_context *ioc)
 static void io_free_linux(struct io_context *ioc)
 {
     close(ioc->os_handle);
+
+    if (ioc->recv_buffers.ring) {
+        size_t ring_size = ioc->recv_buffers.count * sizeof(struct io_uring_buf);
+        munmap(ioc->recv_buffers.ring, ring_size);
+    }
 }
 #endif
 
 #if IO_PLATFORM_LINUX
-static bool start_uring_op(struct io_context *ioc,
-                           struct io_uring_sqe sqe)
+/*
+ * Hands the queued submissions to the kernel and, if
+ * min_complete isn't zero, waits for that many
+ * completions. Both things are done with a single
+ * system call.
+ */
+static bool enter_linux(struct io_context *ioc,
+                        unsigned int min_complete)
 {
-    unsigned int mask = *ioc->submissions.mask;
-    unsigned int tail = atomic_load(ioc->submissions.tail);
-    unsigned int head = atomic_load(ioc->submissions.head);
+    unsigned int flags = 0;
+    unsigned int to_submit = ioc->submissions.unsubmitted;
+
+    /* --- write barrier --- */
+    atomic_store(ioc->submissions.tail, ioc->submissions.local_tail);
+
+    if (min_complete > 0)
+        flags |= IORING_ENTER_GETEVENTS;
+
+    if (ioc->sqpoll) {
+        // The kernel thread picks up the entries on its own
+        // but needs to be woken up if it went idle.
+        if (atomic_load(ioc->submissions.flags) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        ioc->submissions.unsubmitted = 0;
+        to_submit = 0;
+        if (flags == 0)
+            return true;
+    } else {
+        if (to_submit == 0 && min_complete == 0)
+            return true;
+    }
 
-    if (tail >= head + ioc->submissions.limit)
+    int ret = io_uring_enter(ioc->os_handle, to_submit, min_complete, flags);
+    if (ret < 0)
         return false;
 
+    if (!ioc->sqpoll)
+        ioc->submissions.unsubmitted -= ret;
+    return true;
+}
+#endif
+
+#if IO_PLATFORM_LINUX
+/*
+ * Submits the queued entries and, when the queue is
+ * polled by a kernel thread, waits for it to take them.
+ */
+static void flush_queue_linux(struct io_context *ioc)
+{
+    unsigned int tail = ioc->submissions.local_tail;
+    if (atomic_load(ioc->submissions.head) == tail)
+        return;
+
+    if (!enter_linux(ioc, 0))
+        return;
+
+    while (ioc->sqpoll && atomic_load(ioc->submissions.head) != tail)
+        sched_yield();
+}
+#endif
+
+#if IO_PLATFORM_LINUX
+/*
+ * Makes sure that at least num entries of the submission
+ * queue are free, flushing it if necessary.
+ */
+static bool reserve_sqes_linux(struct io_context *ioc,
+                               unsigned int num)
+{
+    unsigned int tail = ioc->submissions.local_tail;
+    unsigned int head = atomic_load(ioc->submissions.head);
+    unsigned int limit = ioc->submissions.limit - (num - 1);
+
+    while (tail - head >= limit) {
+
+        // The queue is full. Flush it and try again.
+        if (!enter_linux(ioc, 0))
+            return false;
+
+        head = atomic_load(ioc->submissions.head);
+        if (tail - head < limit)
+            break;
+
+        if (!ioc->sqpoll)
+            return false;
+
+        // The polling thread consumes the entries on its own
+        // time, so wait for it to make some room.
+        if (io_uring_enter(ioc->os_handle, 0, 0, IORING_ENTER_SQ_WAIT) < 0)
+            return false;
+        head = atomic_load(ioc->submissions.head);
+    }
+    return true;
+}
+#endif
+
+#if IO_PLATFORM_LINUX
+static void queue_sqe_linux(struct io_context *ioc,
+                            struct io_uring_sqe sqe)
+{
+    unsigned int mask = *ioc->submissions.mask;
+    unsigned int tail = ioc->submissions.local_tail;
     unsigned int index = tail & mask;
+
     ioc->submissions.entries[index] = sqe;
     ioc->submissions.array[index] = index;
 
-    atomic_store(ioc->submissions.tail, tail+1);
+    ioc->submissions.local_tail = tail+1;
+    ioc->submissions.unsubmitted++;
+}
+#endif
 
-    int ret = io_uring_enter(ioc->os_handle, 1, 0, 0);
-    if (ret < 0)
+#if IO_PLATFORM_LINUX
+/*
+ * Operations are only queued here. They are submitted
+ * in batch by io_submit or the next io_wait. The tail
+ * isn't made visible to the kernel until then, so that
+ * a queued entry can still be linked to the next one.
+ */
+static bool start_uring_op(struct io_context *ioc,
+                           struct io_uring_sqe sqe)
+{
+    if (!reserve_sqes_linux(ioc, 1))
         return false;
-    
+
+    queue_sqe_linux(ioc, sqe);
     return true;
 }
 #endif
@@ -198,6 +357,7 @@ static void clear_res(struct io_resource *res)
 {
     res->type = IO_RES_VOID;
     res->pending = 0;
+    res->closing = false;
     res->callback = NULL;
 
     #if IO_PLATFORM_WINDOWS
@@ -206,37 +366,123 @@ static void clear_res(struct io_resource *res)
 
     #if IO_PLATFORM_LINUX
     res->os_handle = -1;
+    res->pipe[0] = -1;
+    res->pipe[1] = -1;
+    res->pipe_size = 0;
     #endif
 }
 
+/*
+ * Unused operation and resource structures are kept in
+ * free lists. The find_unused_* functions return the head
+ * of the list without removing it, which is only done by
+ * take_* once the structure is actually used, so that
+ * callers can bail out without putting anything back.
+ */
+
+static struct io_operation*
+find_unused_op(struct io_context *ioc)
+{
+    return ioc->free_ops;
+}
+
+static void take_op(struct io_context *ioc,
+                    struct io_operation *op)
+{
+    assert(ioc->free_ops == op);
+    ioc->free_ops = op->next;
+    op->next = NULL;
+}
+
+static void release_op(struct io_context *ioc,
+                       struct io_operation *op)
+{
+    op->type = IO_VOID;
+    op->res  = NULL;
+    op->next = ioc->free_ops;
+    ioc->free_ops = op;
+}
+
+static struct io_resource*
+find_unused_res(struct io_context *ioc)
+{
+    return ioc->free_res;
+}
+
+static void take_res(struct io_context *ioc,
+                     struct io_resource *res)
+{
+    assert(ioc->free_res == res);
+    ioc->free_res = res->next;
+    res->next = NULL;
+}
+
+static void release_res(struct io_context *ioc,
+                        struct io_resource *res)
+{
+    clear_res(res);
+    res->next = ioc->free_res;
+    ioc->free_res = res;
+}
+
 bool io_init(struct io_context   *ioc,
              struct io_resource  *res,
              struct io_operation *ops,
-             uint16_t max_res,
-             uint16_t max_ops)
+             uint32_t max_res,
+             uint32_t max_ops)
 {
+    return io_init_ex(ioc, res, ops, max_res, max_ops, (struct io_config) {0});
+}
+
+bool io_init_ex(struct io_context   *ioc,
+                struct io_resource  *res,
+                struct io_operation *ops,
+                uint32_t max_res,
+                uint32_t max_ops,
+                struct io_config config)
+{
+    if (max_res > IO_MAX_RES)
+        return false;
+
     ioc->res = res;
     ioc->ops = ops;
     ioc->max_res = max_res;
     ioc->max_ops = max_ops;
+    ioc->free_res = NULL;
+    ioc->free_ops = NULL;
 
-    for (uint16_t i = 0; i < max_res; i++) {
-        res[i].gen = 0;
-        clear_res(&res[i]);
+    // Pushed in reverse so that lower indices are used first
+    for (uint32_t i = max_res; i > 0; i--) {
+        res[i-1].gen = 0;
+        release_res(ioc, &res[i-1]);
     }
     
-    for (uint16_t i = 0; i < max_ops; i++)
-        ops[i].type = IO_VOID;
+    for (uint32_t i = max_ops; i > 0; i--)
+        release_op(ioc, &ops[i-1]);
 
     #if IO_PLATFORM_WINDOWS
+    (void) config;
     return io_init_windows(ioc);
     #endif
 
     #if IO_PLATFORM_LINUX
-    return io_init_linux(ioc);
+    return io_init_linux(ioc, config);
     #endif
 }
 
+#if IO_PLATFORM_LINUX
+static void close_pipe_linux(struct io_resource *res)
+{
+    if (res->pipe[0] < 0)
+        return;
+    close(res->pipe[0]);
+    close(res->pipe[1]);
+    res->pipe[0] = -1;
+    res->pipe[1] = -1;
+    res->pipe_size = 0;
+}
+#endif
+
 static void
 close_internal(struct io_context  *ioc,
                struct io_resource *res)
@@ -247,24 +493,49 @@ close_internal(struct io_context  *ioc,
     else
         CloseHandle(res->os_handle);
     #elif IO_PLATFORM_LINUX
+    /*
+     * The ring holds its own reference to the file, so
+     * closing the descriptor doesn't stop the operations
+     * that are still pending. Sockets are shut down to
+     * make them complete. The resource and its operation
+     * structures are kept until all of them have been
+     * reaped by io_wait, which reports them as aborted
+     * with an invalid handle.
+     *
+     * That only holds for operations the kernel has seen.
+     * A queued entry refers to the descriptor by number,
+     * which could be reused by the time it's submitted,
+     * so the queue is flushed first.
+     */
+    flush_queue_linux(ioc);
+    if (res->type == IO_RES_SOCKET)
+        shutdown(res->os_handle, SHUT_RDWR);
     close(res->os_handle);
+    close_pipe_linux(res);
+
+    if (res->pending > 0) {
+        res->closing = true;
+        res->gen++;
+        if (res->gen == IO_HANDLE_GEN_MASK)
+            res->gen = 0;
+        return;
+    }
     #endif
 
     // Mark associated operation structures as unused
-    for (uint16_t i = 0, marked = 0; marked < res->pending; i++) {
+    for (uint32_t i = 0, marked = 0; marked < res->pending; i++) {
         struct io_operation *op;
         op = &ioc->ops[i];
         if (op->type != IO_VOID && op->res == res) {
-            op->type = IO_VOID;
-            op->res  = NULL;
+            release_op(ioc, op);
             marked++;
         }
     }
 
-    clear_res(res);
+    release_res(ioc, res);
 
     res->gen++;
-    if (res->gen == UINT16_MAX)
+    if (res->gen == IO_HANDLE_GEN_MASK)
         res->gen = 0;
 }
 
@@ -275,8 +546,8 @@ res_from_handle(struct io_context *ioc, io_handle handle)
         return NULL;
 
     static_assert(sizeof(uint32_t) == sizeof(io_handle));
-    uint16_t idx = handle & 0xFFFF;
-    uint16_t gen = handle >> 16;
+    uint32_t idx = handle & (IO_MAX_RES - 1);
+    uint32_t gen = handle >> IO_HANDLE_INDEX_BITS;
     if (idx >= ioc->max_res)
         return NULL;
 
@@ -295,9 +566,9 @@ static io_handle handle_from_res(struct io_context  *ioc,
 
     uint32_t idx = res - ioc->res;
     uint32_t gen = res->gen;
-    handle = idx | (gen << 16);
+    handle = idx | (gen << IO_HANDLE_INDEX_BITS);
 
-    assert(gen != UINT16_MAX);
+    assert(gen != IO_HANDLE_GEN_MASK);
     assert(handle != IO_INVALID);
 
     return handle;
@@ -315,10 +586,68 @@ void io_close(struct io_context *ioc,
     close_internal(ioc, res);
 }
 
+/*
+ * Like io_close, but the descriptor is closed by the
+ * kernel in the background. The handle is invalid as
+ * soon as this returns, so the completion event has
+ * an invalid handle and is never passed to callbacks.
+ * Other operations still pending on the handle are
+ * aborted as with io_close.
+ *
+ * Not supported on Windows.
+ */
+bool io_close_async(struct io_context *ioc,
+                    void *user, io_handle handle)
+{
+    #if IO_PLATFORM_WINDOWS
+    (void) ioc;
+    (void) user;
+    (void) handle;
+    return false;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    struct io_operation *op;
+    struct io_resource *res;
+
+    res = res_from_handle(ioc, handle);
+    if (res == NULL)
+        return false;
+
+    op = find_unused_op(ioc);
+    if (op == NULL)
+        return false;
+
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_CLOSE;
+    sqe.fd = res->os_handle;
+    sqe.user_data = (uint64_t) op;
+    if (!start_uring_op(ioc, sqe))
+        return false;
+
+    take_op(ioc, op);
+    res->pending++;
+    op->res = res;
+    op->type = IO_CLOSE;
+    op->user = user;
+
+    if (res->type == IO_RES_SOCKET)
+        shutdown(res->os_handle, SHUT_RDWR);
+    close_pipe_linux(res);
+
+    res->closing = true;
+    res->gen++;
+    if (res->gen == IO_HANDLE_GEN_MASK)
+        res->gen = 0;
+    return true;
+    #endif
+}
+
 void io_free(struct io_context *ioc)
 {
-    for (uint16_t i = 0; i < ioc->max_res; i++)
-        if (ioc->res[i].type != IO_RES_VOID)
+    for (uint32_t i = 0; i < ioc->max_res; i++)
+        if (ioc->res[i].type != IO_RES_VOID && !ioc->res[i].closing)
             close_internal(ioc, &ioc->res[i]);
 
     #if IO_PLATFORM_WINDOWS
@@ -330,17 +659,6 @@ void io_free(struct io_context *ioc)
     #endif
 }
 
-static struct io_operation*
-find_unused_op(struct io_context *ioc)
-{
-    for (uint16_t i = 0; i < ioc->max_ops; i++) {
-        struct io_operation *op = &ioc->ops[i];
-        if (op->type == IO_VOID)
-            return op;
-    }
-    return NULL;
-}
-
 #if IO_PLATFORM_LINUX
 static bool io_recv_linux(struct io_context   *ioc,
                           struct io_resource  *res,
@@ -488,6 +806,7 @@ bool io_recv(struct io_context *ioc,
         return false;
     #endif
 
+    take_op(ioc, op);
     res->pending++;
     op->res = res;
     op->type = type;
@@ -522,6 +841,7 @@ bool io_send(struct io_context *ioc,
         return false;
     #endif
 
+    take_op(ioc, op);
     res->pending++;
     op->res = res;
     op->type = type;
@@ -529,8 +849,11 @@ bool io_send(struct io_context *ioc,
     return true;
 }
 
-bool io_accept(struct io_context *ioc,
-               void *user, io_handle handle)
+#if IO_PLATFORM_LINUX
+static bool start_op_linux(struct io_context *ioc,
+                           void *user, io_handle handle,
+                           enum io_optype type,
+                           struct io_uring_sqe sqe)
 {
     struct io_operation *op;
     struct io_resource *res;
@@ -543,118 +866,744 @@ bool io_accept(struct io_context *ioc,
     if (op == NULL)
         return false;
 
-    enum io_optype type = IO_ACCEPT;
-
-    #if IO_PLATFORM_LINUX
-    if (!io_accept_linux(ioc, res, op, res->os_handle))
-        return false;
-    #endif
-
-    #if IO_PLATFORM_WINDOWS
-    if (!io_accept_windows(ioc, res, op, res->os_handle))
+    sqe.fd = (int) res->os_handle;
+    sqe.user_data = (uint64_t) op;
+    if (!start_uring_op(ioc, sqe))
         return false;
-    #endif
 
+    take_op(ioc, op);
     res->pending++;
     op->res = res;
     op->type = type;
     op->user = user;
     return true;
 }
+#endif
 
-static struct io_resource*
-find_unused_res(struct io_context *ioc)
+/*
+ * Sets up a pool of count buffers of the given size,
+ * stored contiguously in mem, from which the kernel picks
+ * a buffer when an io_recv_any completes. This way the
+ * memory used for receiving grows with the amount of data
+ * in flight instead of the number of sockets. The count
+ * must be a power of 2.
+ *
+ * Only supported on Linux 5.19 or later.
+ */
+bool io_setup_recv_buffers(struct io_context *ioc,
+                           void *mem, uint32_t size,
+                           uint16_t count)
 {
-    for (uint16_t i = 0; i < ioc->max_res; i++) {
-        struct io_resource *res = &ioc->res[i];
-        if (res->type == IO_RES_VOID)
-            return res;
+    #if IO_PLATFORM_WINDOWS
+    (void) ioc;
+    (void) mem;
+    (void) size;
+    (void) count;
+    return false;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    if (ioc->recv_buffers.ring || count == 0 || (count & (count - 1)))
+        return false;
+
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    struct io_uring_buf_ring *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED)
+        return false;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) ring;
+    reg.ring_entries = count;
+    reg.bgid = IO_RECV_BUFFER_GROUP;
+    if (io_uring_register(ioc->os_handle, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        munmap(ring, ring_size);
+        return false;
     }
-    return NULL;
+
+    ioc->recv_buffers.ring  = ring;
+    ioc->recv_buffers.mem   = mem;
+    ioc->recv_buffers.size  = size;
+    ioc->recv_buffers.count = count;
+    ioc->recv_buffers.tail  = 0;
+
+    for (uint16_t i = 0; i < count; i++)
+        io_release_recv_buffer(ioc, i);
+    return true;
+    #endif
 }
 
-#if IO_PLATFORM_WINDOWS
-static io_os_handle
-io_open_file_windows(struct io_context *ioc,
-                     const char *file, int flags)
+/*
+ * Gives a buffer back to the pool after the data received
+ * in it by an io_recv_any was consumed.
+ */
+void io_release_recv_buffer(struct io_context *ioc, uint16_t id)
 {
-    unsigned long access = 0;
-	if (flags & IO_ACCESS_RD) access |= GENERIC_READ;
-	if (flags & IO_ACCESS_WR) access |= GENERIC_WRITE;
+    #if IO_PLATFORM_WINDOWS
+    (void) ioc;
+    (void) id;
+    #endif
 
-	io_os_handle os_handle = CreateFileA(file, access, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
-	if (os_handle == INVALID_HANDLE_VALUE)
-		return INVALID_HANDLE_VALUE;
+    #if IO_PLATFORM_LINUX
+    struct io_recv_buffers *rb = &ioc->recv_buffers;
+    assert(rb->ring && id < rb->count);
 
-    if (CreateIoCompletionPort(os_handle, ioc->os_handle, 0, 0) == NULL) {
-		CloseHandle(os_handle);
-		return INVALID_HANDLE_VALUE;
-	}
+    struct io_uring_buf *buf = &rb->ring->bufs[rb->tail & (rb->count - 1)];
+    buf->addr = (uint64_t) (rb->mem + (size_t) id * rb->size);
+    buf->len  = rb->size;
+    buf->bid  = id;
+    rb->tail++;
 
-    return os_handle;
+    /* --- write barrier --- */
+    atomic_store_explicit((_Atomic uint16_t*) &rb->ring->tail, rb->tail, memory_order_release);
+    #endif
 }
-#endif
 
-#if IO_PLATFORM_LINUX
-static io_os_handle
-io_open_file_linux(struct io_context *ioc,
-                   const char *file, int flags)
+/*
+ * Like io_recv but the destination buffer is chosen by the
+ * kernel from the pool set up with io_setup_recv_buffers
+ * when data arrives. The completion event's buffer and
+ * buffer_id fields refer to it and it must be released
+ * with io_release_recv_buffer. If the pool is empty the
+ * operation is aborted.
+ */
+bool io_recv_any(struct io_context *ioc,
+                 void *user, io_handle handle)
 {
+    #if IO_PLATFORM_WINDOWS
     (void) ioc;
+    (void) user;
+    (void) handle;
+    return false;
+    #endif
 
-    int flags2 = 0;
-	if (flags & IO_ACCESS_RD) flags2 |= O_RDONLY;
-	if (flags & IO_ACCESS_WR) flags2 |= O_WRONLY;
+    #if IO_PLATFORM_LINUX
+    if (ioc->recv_buffers.ring == NULL)
+        return false;
 
-	return open(file, flags2);
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_RECV;
+    sqe.flags  = IOSQE_BUFFER_SELECT;
+    sqe.buf_group = IO_RECV_BUFFER_GROUP;
+    sqe.len = ioc->recv_buffers.size;
+    return start_op_linux(ioc, user, handle, IO_RECV, sqe);
+    #endif
 }
-#endif
 
-io_handle io_open_file(struct io_context *ioc,
-                       const char *file, int flags)
+/*
+ * Like io_recv_any but the operation isn't consumed by
+ * the completion. It keeps receiving into buffers of the
+ * pool until an event without the "more" flag, which
+ * happens when the peer disconnects, an error occurs or
+ * the pool runs out of buffers.
+ */
+bool io_recv_multishot(struct io_context *ioc,
+                       void *user, io_handle handle)
 {
-    io_os_handle os_handle;
-    struct io_resource *res;
-
-    res = find_unused_res(ioc);
-    if (res == NULL)
-        return IO_INVALID;
-
     #if IO_PLATFORM_WINDOWS
-    os_handle = io_open_file_windows(ioc, file, flags);
-    if (os_handle == INVALID_HANDLE_VALUE)
-        return IO_INVALID;
+    (void) ioc;
+    (void) user;
+    (void) handle;
+    return false;
     #endif
 
     #if IO_PLATFORM_LINUX
-    os_handle = io_open_file_linux(ioc, file, flags);
-    if (os_handle < 0)
-        return IO_INVALID;
-    #endif
+    if (ioc->recv_buffers.ring == NULL)
+        return false;
 
-    res->type = IO_RES_FILE;
-    res->pending = 0;
-    res->os_handle = os_handle;
-    return handle_from_res(ioc, res);
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_RECV;
+    sqe.flags  = IOSQE_BUFFER_SELECT;
+    sqe.ioprio = IORING_RECV_MULTISHOT;
+    sqe.buf_group = IO_RECV_BUFFER_GROUP;
+    sqe.len = 0;
+    return start_op_linux(ioc, user, handle, IO_RECV, sqe);
+    #endif
 }
 
-#if IO_PLATFORM_WINDOWS
-static io_os_handle
-io_create_file_windows(struct io_context *ioc,
-                       const char *file, int flags)
+/*
+ * Registers buffers with the kernel so that their pages
+ * are pinned once instead of at every operation. They
+ * can then be sent from with io_send_fixed.
+ */
+bool io_register_buffers(struct io_context *ioc,
+                         struct io_buffer *bufs,
+                         uint16_t count)
 {
-    unsigned long flags2 = 0;
+    #if IO_PLATFORM_WINDOWS
+    (void) ioc;
+    (void) bufs;
+    (void) count;
+    return false;
+    #endif
 
-	if (flags & IO_CREATE_CANTEXIST)
-		flags2 = CREATE_NEW;
-	else {
+    #if IO_PLATFORM_LINUX
+    struct iovec vecs[IO_MAX_REGISTERED_BUFFERS];
+    if (count > IO_MAX_REGISTERED_BUFFERS)
+        return false;
+
+    for (uint16_t i = 0; i < count; i++) {
+        vecs[i].iov_base = bufs[i].data;
+        vecs[i].iov_len  = bufs[i].size;
+    }
+
+    return io_uring_register(ioc->os_handle, IORING_REGISTER_BUFFERS, vecs, count) == 0;
+    #endif
+}
+
+/*
+ * Like io_send but the source must lie inside the
+ * registered buffer with the given index.
+ */
+bool io_send_fixed(struct io_context *ioc,
+                   void *user, io_handle handle,
+                   uint16_t index, void *src,
+                   uint32_t num)
+{
+    #if IO_PLATFORM_WINDOWS
+    (void) index;
+    return io_send(ioc, user, handle, src, num);
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_WRITE_FIXED;
+    sqe.addr = (uint64_t) src;
+    sqe.len  = num;
+    sqe.buf_index = index;
+    return start_op_linux(ioc, user, handle, IO_SEND, sqe);
+    #endif
+}
+
+#if IO_PLATFORM_WINDOWS
+static bool start_rw_windows(struct io_context *ioc,
+                             void *user, io_handle handle,
+                             enum io_optype type, void *ptr,
+                             uint32_t num, uint64_t offset)
+{
+    struct io_operation *op;
+    struct io_resource *res;
+
+    res = res_from_handle(ioc, handle);
+    if (res == NULL)
+        return false;
+
+    op = find_unused_op(ioc);
+    if (op == NULL)
+        return false;
+
+    memset(&op->ov, 0, sizeof(struct io_os_overlap));
+    op->ov.offset      = (unsigned long) offset;
+    op->ov.offset_high = (unsigned long) (offset >> 32);
+
+    int ok;
+    if (type == IO_READ)
+        ok = ReadFile(res->os_handle, ptr, num, NULL, (OVERLAPPED*) &op->ov);
+    else
+        ok = WriteFile(res->os_handle, ptr, num, NULL, (OVERLAPPED*) &op->ov);
+	if (!ok && GetLastError() != ERROR_IO_PENDING)
+		return false;
+
+    take_op(ioc, op);
+    res->pending++;
+    op->res = res;
+    op->type = type;
+    op->user = user;
+    return true;
+}
+#endif
+
+/*
+ * Reads up to max bytes of a file starting from the
+ * given offset. The file position isn't used or moved,
+ * so any number of reads on the same file can be in
+ * flight at the same time.
+ */
+bool io_read(struct io_context *ioc,
+             void *user, io_handle handle,
+             void *dst, uint32_t max,
+             uint64_t offset)
+{
+    #if IO_PLATFORM_WINDOWS
+    return start_rw_windows(ioc, user, handle, IO_READ, dst, max, offset);
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.addr = (uint64_t) dst;
+    sqe.len  = max;
+    sqe.off  = offset;
+    return start_op_linux(ioc, user, handle, IO_READ, sqe);
+    #endif
+}
+
+/*
+ * Like io_read, but writes num bytes to the file.
+ */
+bool io_write(struct io_context *ioc,
+              void *user, io_handle handle,
+              void *src, uint32_t num,
+              uint64_t offset)
+{
+    #if IO_PLATFORM_WINDOWS
+    return start_rw_windows(ioc, user, handle, IO_WRITE, src, num, offset);
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.addr = (uint64_t) src;
+    sqe.len  = num;
+    sqe.off  = offset;
+    return start_op_linux(ioc, user, handle, IO_WRITE, sqe);
+    #endif
+}
+
+#if IO_PLATFORM_LINUX
+/*
+ * Creates the pipe through which io_sendfile moves data
+ * from files to the socket. It's created the first time
+ * it's needed and lives as long as the socket.
+ */
+static bool open_pipe_linux(struct io_resource *res)
+{
+    if (res->pipe[0] >= 0)
+        return true;
+
+    if (pipe2(res->pipe, O_CLOEXEC))
+        return false;
+
+    // A bigger pipe means fewer round trips per file. If
+    // the system doesn't allow it, go with the default.
+    fcntl(res->pipe[1], F_SETPIPE_SZ, IO_SENDFILE_PIPE_SIZE);
+
+    int size = fcntl(res->pipe[1], F_GETPIPE_SZ);
+    if (size <= 0) {
+        close_pipe_linux(res);
+        return false;
+    }
+    res->pipe_size = size;
+    return true;
+}
+#endif
+
+#if IO_PLATFORM_LINUX
+static void
+splice_sqe_linux(struct io_uring_sqe *sqe,
+                 int fd_in, int64_t off_in,
+                 int fd_out, uint32_t num)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd  = fd_out;
+    sqe->off = (uint64_t) -1;
+    sqe->splice_fd_in  = fd_in;
+    sqe->splice_off_in = (uint64_t) off_in;
+    sqe->len = num;
+}
+#endif
+
+/*
+ * Sends up to num bytes of a file, starting from the
+ * given offset, over the socket. The data goes from the
+ * page cache to the socket without being copied in user
+ * space. On Linux it's spliced into a pipe owned by the
+ * socket and from there to the socket, so at most one
+ * io_sendfile per socket can be pending and a single
+ * operation moves at most IO_SENDFILE_PIPE_SIZE bytes.
+ * As with io_send, the number of bytes sent is reported
+ * by the event and may be smaller than num, in which
+ * case the caller should start a new operation for the
+ * rest.
+ *
+ * Not supported on Windows.
+ */
+bool io_sendfile(struct io_context *ioc,
+                 void *user, io_handle handle,
+                 io_handle file, uint64_t offset,
+                 uint32_t num)
+{
+    #if IO_PLATFORM_WINDOWS
+    (void) ioc;
+    (void) user;
+    (void) handle;
+    (void) file;
+    (void) offset;
+    (void) num;
+    return false;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    struct io_operation *op;
+    struct io_resource *res;
+    struct io_resource *src;
+
+    res = res_from_handle(ioc, handle);
+    src = res_from_handle(ioc, file);
+    if (res == NULL || src == NULL || res->type != IO_RES_SOCKET)
+        return false;
+
+    op = find_unused_op(ioc);
+    if (op == NULL)
+        return false;
+
+    if (!open_pipe_linux(res))
+        return false;
+
+    if (num > res->pipe_size)
+        num = res->pipe_size;
+
+    // The first half moves the file into the pipe. The
+    // second one is started by event_from_cqe once the
+    // amount of bytes in the pipe is known.
+    struct io_uring_sqe sqe;
+    splice_sqe_linux(&sqe, src->os_handle, offset, res->pipe[1], num);
+    sqe.user_data = (uint64_t) op;
+    if (!start_uring_op(ioc, sqe))
+        return false;
+
+    take_op(ioc, op);
+    res->pending++;
+    op->res = res;
+    op->type = IO_SENDFILE;
+    op->user = user;
+    op->spliced = 0;
+    return true;
+    #endif
+}
+
+/*
+ * Flushes the file's data to the storage device. If
+ * datasync is set, metadata that isn't needed to read
+ * the data back (like the modification time) may not
+ * be flushed.
+ *
+ * Not supported on Windows.
+ */
+bool io_fsync(struct io_context *ioc,
+              void *user, io_handle handle,
+              bool datasync)
+{
+    #if IO_PLATFORM_WINDOWS
+    (void) ioc;
+    (void) user;
+    (void) handle;
+    (void) datasync;
+    return false;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_FSYNC;
+    sqe.fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+    return start_op_linux(ioc, user, handle, IO_FSYNC, sqe);
+    #endif
+}
+
+#if IO_PLATFORM_LINUX
+static void set_timespec_linux(struct io_operation *op, uint32_t ms)
+{
+    static_assert(sizeof(op->timespec) == sizeof(struct __kernel_timespec));
+    op->timespec[0] = ms / 1000;
+    op->timespec[1] = (int64_t) (ms % 1000) * 1000000;
+}
+#endif
+
+/*
+ * Gives the operation started by the last call a deadline.
+ * If it doesn't complete within ms milliseconds, it's
+ * aborted. This must be called right after the function
+ * that started the operation, before any io_submit or
+ * io_wait. Multishot operations and io_sendfile can't
+ * be given a deadline.
+ *
+ * Not supported on Windows.
+ */
+bool io_link_timeout(struct io_context *ioc, uint32_t ms)
+{
+    #if IO_PLATFORM_WINDOWS
+    (void) ioc;
+    (void) ms;
+    return false;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    unsigned int mask = *ioc->submissions.mask;
+    unsigned int tail = ioc->submissions.local_tail;
+
+    if (tail == atomic_load(ioc->submissions.tail))
+        return false; // Nothing queued since the last flush
+
+    struct io_uring_sqe *prev = &ioc->submissions.entries[(tail-1) & mask];
+    struct io_operation *op = (void*) prev->user_data;
+    if (op == NULL || op->type == IO_SENDFILE || op->type == IO_TIMER)
+        return false;
+    if (prev->flags & IOSQE_IO_LINK)
+        return false;
+    if ((prev->opcode == IORING_OP_RECV   && (prev->ioprio & IORING_RECV_MULTISHOT)) ||
+        (prev->opcode == IORING_OP_ACCEPT && (prev->ioprio & IORING_ACCEPT_MULTISHOT)))
+        return false;
+
+    set_timespec_linux(op, ms);
+
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_LINK_TIMEOUT;
+    sqe.fd   = -1;
+    sqe.addr = (uint64_t) op->timespec;
+    sqe.len  = 1;
+    sqe.user_data = 0;
+
+    // The operation and its timeout must be submitted
+    // together. If there is no room for the timeout, take
+    // the operation back out of the queue and flush what
+    // was before it.
+    struct io_uring_sqe saved = *prev;
+    ioc->submissions.local_tail--;
+    ioc->submissions.unsubmitted--;
+
+    if (!reserve_sqes_linux(ioc, 2)) {
+        queue_sqe_linux(ioc, saved); // Start it without a deadline
+        return false;
+    }
+    saved.flags |= IOSQE_IO_LINK;
+    queue_sqe_linux(ioc, saved);
+    queue_sqe_linux(ioc, sqe);
+    return true;
+    #endif
+}
+
+/*
+ * Aborts all pending operations on the handle. The
+ * handle stays valid. The aborted operations still
+ * produce their events.
+ */
+bool io_cancel(struct io_context *ioc,
+               io_handle handle)
+{
+    struct io_resource *res;
+
+    res = res_from_handle(ioc, handle);
+    if (res == NULL)
+        return false;
+
+    if (res->pending == 0)
+        return true;
+
+    #if IO_PLATFORM_WINDOWS
+    return CancelIoEx(res->os_handle, NULL) || GetLastError() == ERROR_NOT_FOUND;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = res->os_handle;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe.user_data = 0;
+    return start_uring_op(ioc, sqe);
+    #endif
+}
+
+/*
+ * Generates an event with the given user pointer after
+ * ms milliseconds. It can be used to run periodic work,
+ * like dropping idle connections, from the event loop.
+ * The event's handle is invalid, so it's always returned
+ * by io_wait instead of being passed to a callback.
+ *
+ * Not supported on Windows.
+ */
+bool io_timer(struct io_context *ioc,
+              void *user, uint32_t ms)
+{
+    #if IO_PLATFORM_WINDOWS
+    (void) ioc;
+    (void) user;
+    (void) ms;
+    return false;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    struct io_operation *op;
+
+    op = find_unused_op(ioc);
+    if (op == NULL)
+        return false;
+
+    set_timespec_linux(op, ms);
+
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_TIMEOUT;
+    sqe.fd   = -1;
+    sqe.addr = (uint64_t) op->timespec;
+    sqe.len  = 1;
+    sqe.off  = 0; // Not bound to a number of completions
+    sqe.user_data = (uint64_t) op;
+    if (!start_uring_op(ioc, sqe))
+        return false;
+
+    take_op(ioc, op);
+    op->res  = NULL;
+    op->type = IO_TIMER;
+    op->user = user;
+    return true;
+    #endif
+}
+
+bool io_accept(struct io_context *ioc,
+               void *user, io_handle handle)
+{
+
+    struct io_operation *op;
+    struct io_resource *res;
+
+    res = res_from_handle(ioc, handle);
+    if (res == NULL)
+        return false;
+    
+    op = find_unused_op(ioc);
+    if (op == NULL)
+        return false;
+
+    enum io_optype type = IO_ACCEPT;
+
+    #if IO_PLATFORM_LINUX
+    if (!io_accept_linux(ioc, res, op, res->os_handle))
+        return false;
+    #endif
+
+    #if IO_PLATFORM_WINDOWS
+    if (!io_accept_windows(ioc, res, op, res->os_handle))
+        return false;
+    #endif
+
+    take_op(ioc, op);
+    res->pending++;
+    op->res = res;
+    op->type = type;
+    op->user = user;
+    return true;
+}
+
+/*
+ * Like io_accept but an event is generated for every
+ * accepted connection until one without the "more" flag
+ * arrives. Where multishot accepts aren't supported, this
+ * is a normal accept, so the caller should always start a
+ * new accept when "more" isn't set.
+ */
+bool io_accept_multishot(struct io_context *ioc,
+                         void *user, io_handle handle)
+{
+    #if IO_PLATFORM_WINDOWS
+    return io_accept(ioc, user, handle);
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ACCEPT;
+    sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+    return start_op_linux(ioc, user, handle, IO_ACCEPT, sqe);
+    #endif
+}
+
+#if IO_PLATFORM_WINDOWS
+static io_os_handle
+io_open_file_windows(struct io_context *ioc,
+                     const char *file, int flags)
+{
+    unsigned long access = 0;
+	if (flags & IO_ACCESS_RD) access |= GENERIC_READ;
+	if (flags & IO_ACCESS_WR) access |= GENERIC_WRITE;
+
+	io_os_handle os_handle = CreateFileA(file, access, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (os_handle == INVALID_HANDLE_VALUE)
+		return INVALID_HANDLE_VALUE;
+
+    if (CreateIoCompletionPort(os_handle, ioc->os_handle, 0, 0) == NULL) {
+		CloseHandle(os_handle);
+		return INVALID_HANDLE_VALUE;
+	}
+
+    return os_handle;
+}
+#endif
+
+#if IO_PLATFORM_LINUX
+static io_os_handle
+io_open_file_linux(struct io_context *ioc,
+                   const char *file, int flags)
+{
+    (void) ioc;
+
+    int flags2 = 0;
+	if (flags & IO_ACCESS_RD) flags2 |= O_RDONLY;
+	if (flags & IO_ACCESS_WR) flags2 |= O_WRONLY;
+
+	return open(file, flags2);
+}
+#endif
+
+io_handle io_open_file(struct io_context *ioc,
+                       const char *file, int flags)
+{
+    io_os_handle os_handle;
+    struct io_resource *res;
+
+    res = find_unused_res(ioc);
+    if (res == NULL)
+        return IO_INVALID;
+
+    #if IO_PLATFORM_WINDOWS
+    os_handle = io_open_file_windows(ioc, file, flags);
+    if (os_handle == INVALID_HANDLE_VALUE)
+        return IO_INVALID;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    os_handle = io_open_file_linux(ioc, file, flags);
+    if (os_handle < 0)
+        return IO_INVALID;
+    #endif
+
+    take_res(ioc, res);
+    res->type = IO_RES_FILE;
+    res->pending = 0;
+    res->os_handle = os_handle;
+    return handle_from_res(ioc, res);
+}
+
+#if IO_PLATFORM_WINDOWS
+static io_os_handle
+io_create_file_windows(struct io_context *ioc,
+                       const char *file, int flags)
+{
+    unsigned long flags2 = 0;
+
+	if (flags & IO_CREATE_CANTEXIST)
+		flags2 = CREATE_NEW;
+	else {
 		if (flags & IO_CREATE_OVERWRITE)
 			flags2 = CREATE_ALWAYS;
 		else
 			flags2 = OPEN_ALWAYS;
 	}
 
-	io_os_handle os_handle = CreateFileA(file, GENERIC_WRITE, 0, NULL, flags2, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+    unsigned long access = GENERIC_WRITE;
+	if (flags & IO_ACCESS_RD) access |= GENERIC_READ;
+
+	io_os_handle os_handle = CreateFileA(file, access, 0, NULL, flags2, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
 	if (os_handle == INVALID_HANDLE_VALUE)
         return INVALID_HANDLE_VALUE;
 
@@ -674,7 +1623,7 @@ io_create_file_linux(struct io_context *ioc,
 {
     (void) ioc;
 
-    int flags2 = O_CREAT | O_WRONLY;
+    int flags2 = O_CREAT | ((flags & IO_ACCESS_RD) ? O_RDWR : O_WRONLY);
 
 	if (flags & IO_CREATE_CANTEXIST)
 		flags2 |= O_EXCL;
@@ -710,6 +1659,35 @@ io_handle io_create_file(struct io_context *ioc,
         return IO_INVALID;
     #endif
 
+    take_res(ioc, res);
+    res->type = IO_RES_FILE;
+    res->pending = 0;
+    res->os_handle = os_handle;
+    return handle_from_res(ioc, res);
+}
+
+/*
+ * Creates a handle for a file that was opened by the
+ * caller, so that it can be used with io_read, io_write
+ * and io_sendfile. The handle owns the descriptor from
+ * then on and closes it with io_close. On Windows it must
+ * have been opened with FILE_FLAG_OVERLAPPED.
+ */
+io_handle io_attach_file(struct io_context *ioc,
+                         io_os_handle os_handle)
+{
+    struct io_resource *res;
+
+    res = find_unused_res(ioc);
+    if (res == NULL)
+        return IO_INVALID;
+
+    #if IO_PLATFORM_WINDOWS
+    if (CreateIoCompletionPort(os_handle, ioc->os_handle, 0, 0) == NULL)
+        return IO_INVALID;
+    #endif
+
+    take_res(ioc, res);
     res->type = IO_RES_FILE;
     res->pending = 0;
     res->os_handle = os_handle;
@@ -803,6 +1781,7 @@ io_handle io_start_server(struct io_context *ioc,
     res->acceptfn = lpfnAcceptEx;
     #endif
 
+    take_res(ioc, res);
     res->type = IO_RES_SOCKET;
     res->pending = 0;
     res->os_handle = (io_os_handle) fd;
@@ -830,6 +1809,11 @@ io_wait_internal_windows(struct io_context *ioc,
     else
         timeout2 = timeout;
 
+    ev->buffer = NULL;
+    ev->buffer_id = 0;
+    ev->more = false;
+    ev->error = 0;
+
     unsigned long long unused;
 	struct io_os_overlap *ov;
     unsigned long num;
@@ -847,6 +1831,7 @@ io_wait_internal_windows(struct io_context *ioc,
             ev->optype = IO_VOID;
             ev->handle = IO_INVALID;
             ev->user   = NULL;
+            ev->error  = GetLastError();
 
         } else {
 
@@ -858,6 +1843,7 @@ io_wait_internal_windows(struct io_context *ioc,
             struct io_resource *res = op->res;
 
             ev->evtype = IO_ABORT;
+            ev->error  = GetLastError();
             ev->optype = op->type;
             ev->handle = handle_from_res(ioc, res);
             ev->user   = op->user;
@@ -865,7 +1851,7 @@ io_wait_internal_windows(struct io_context *ioc,
             if (op->type == IO_ACCEPT)
                 closesocket((SOCKET) op->accepted);
 
-            op->type = IO_VOID; // Mark unused
+            release_op(ioc, op); // Mark unused
 
             assert(res->pending > 0);
             res->pending--;
@@ -885,6 +1871,8 @@ io_wait_internal_windows(struct io_context *ioc,
 
         case IO_RECV:
         case IO_SEND:
+        case IO_READ:
+        case IO_WRITE:
         ev->num = num;
         break;
 
@@ -901,13 +1889,15 @@ io_wait_internal_windows(struct io_context *ioc,
                 ev->optype = IO_ACCEPT;
                 ev->handle = handle_from_res(ioc, res);
                 ev->user   = op->user;
+                ev->error  = ERROR_TOO_MANY_OPEN_FILES;
     
                 assert(res->pending > 0);
                 res->pending--;
-                op->type = IO_VOID;
+                release_op(ioc, op);
                 return;
             }
 
+            take_res(ioc, res2);
             res2->type = IO_RES_SOCKET;
             res2->pending = 0;
             res2->os_handle = op->accepted;
@@ -923,65 +1913,231 @@ io_wait_internal_windows(struct io_context *ioc,
     assert(res->pending > 0);
     res->pending--;
 
-    op->type = IO_VOID; // Mark unused
+    release_op(ioc, op); // Mark unused
 }
 #endif
 
 #if IO_PLATFORM_LINUX
-static void
-io_wait_internal_linux(struct io_context *ioc,
-                       struct io_event *ev)
+/*
+ * Fills ev with the event for the completion. Returns
+ * false if the completion was only an intermediate step
+ * of an operation and there is no event to report.
+ */
+static bool
+event_from_cqe(struct io_context *ioc,
+               struct io_uring_cqe *cqe,
+               struct io_event *ev)
 {
-    /* --- Read barrier --- */
-    unsigned int head = atomic_load(ioc->completions.head);
-    unsigned int tail = atomic_load(ioc->completions.tail);
-
-    if (head == tail) {
-        
-        /*
-         * Completion queue is empty. Wait for some operations to complete.
-         */
-        int ret = io_uring_enter(ioc->os_handle, 0, 1, IORING_ENTER_GETEVENTS);
-        if (ret < 0) {
-            ev->evtype = IO_ERROR;
-            ev->optype = IO_VOID;
-            ev->handle = IO_INVALID;
-            ev->user   = NULL;
-            return;
-        }
-    }
-
-    struct io_uring_cqe *cqe;
     struct io_operation *op;
     struct io_resource *res;
 
-    cqe = &ioc->completions.entries[head & (*ioc->completions.mask)];
+    // Completions of io_link_timeout and io_cancel
+    // aren't reported. The operations they affected
+    // complete as aborted.
+    if (cqe->user_data == 0)
+        return false;
 
     op = (void*) cqe->user_data;
     res = op->res;
 
+    if (op->type == IO_TIMER) {
+        // Timers aren't bound to a resource. Expiring
+        // is how they complete successfully.
+        ev->evtype = (cqe->res == -ETIME) ? IO_COMPLETE : IO_ABORT;
+        ev->optype = IO_TIMER;
+        ev->handle = IO_INVALID;
+        ev->user   = op->user;
+        ev->num    = 0;
+        ev->buffer = NULL;
+        ev->buffer_id = 0;
+        ev->more = false;
+        ev->error = (cqe->res == -ETIME) ? 0 : -cqe->res;
+        release_op(ioc, op);
+        return true;
+    }
+
     ev->user = op->user;
     ev->handle = handle_from_res(ioc, op->res);
     ev->optype = op->type;
+    ev->buffer = NULL;
+    ev->buffer_id = 0;
+    ev->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    ev->error = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res->closing)
+            io_release_recv_buffer(ioc, id);
+        else {
+            ev->buffer = ioc->recv_buffers.mem + (size_t) id * ioc->recv_buffers.size;
+            ev->buffer_id = id;
+        }
+    }
+
+    if (res->closing) {
+
+        /*
+         * The resource was closed while this operation was
+         * pending. If it was an accept, the new socket must
+         * be dropped.
+         */
+        if (op->type == IO_ACCEPT && cqe->res >= 0)
+            close(cqe->res);
 
-    if (cqe->res < 0)
         ev->evtype = IO_ABORT;
-    else {
+        ev->handle = IO_INVALID;
+        ev->error = ECANCELED;
+
+        // The close itself went through
+        if (op->type == IO_CLOSE && cqe->res >= 0) {
+            ev->evtype = IO_COMPLETE;
+            ev->num = 0;
+            ev->error = 0;
+        }
+
+    } else if (op->type == IO_SENDFILE && op->spliced == 0 && cqe->res > 0) {
+
+        /*
+         * The file's data is in the pipe. Move it to the
+         * socket. The event is reported when that's done.
+         */
+        struct io_uring_sqe sqe;
+        splice_sqe_linux(&sqe, res->pipe[0], -1, res->os_handle, cqe->res);
+        sqe.user_data = (uint64_t) op;
+        op->spliced = cqe->res;
+        if (start_uring_op(ioc, sqe))
+            return false;
+
+        close_pipe_linux(res); // Drop what was left in it
+        ev->evtype = IO_ABORT;
+
+    } else if (cqe->res < 0) {
+        ev->evtype = IO_ABORT;
+        ev->error = -cqe->res;
+        if (op->type == IO_SENDFILE)
+            close_pipe_linux(res);
+    } else {
         ev->evtype = IO_COMPLETE;
         switch (op->type) {
             case IO_RECV: ev->num = cqe->res; break;
             case IO_SEND: ev->num = cqe->res; break;
-            case IO_ACCEPT: ev->accepted = cqe->res; break;
+            case IO_READ: ev->num = cqe->res; break;
+            case IO_WRITE: ev->num = cqe->res; break;
+            case IO_SENDFILE:
+            // Data that didn't make it to the socket would
+            // be sent by the next io_sendfile otherwise.
+            if ((uint32_t) cqe->res < op->spliced)
+                close_pipe_linux(res);
+            ev->num = cqe->res;
+            break;
+            case IO_FSYNC: ev->num = 0; break;
+            case IO_ACCEPT:
+            {
+                struct io_resource *res2;
+
+                res2 = find_unused_res(ioc);
+                if (res2 == NULL) {
+                    close(cqe->res);
+                    ev->evtype = IO_ABORT;
+                    ev->error = EMFILE;
+                    break;
+                }
+
+                take_res(ioc, res2);
+                res2->type = IO_RES_SOCKET;
+                res2->pending = 0;
+                res2->os_handle = cqe->res;
+
+                ev->accepted = handle_from_res(ioc, res2);
+            }
+            break;
             default:break;
         }
     }
 
+    // Multishot operations stay pending until
+    // a completion without the "more" flag.
+    if (ev->more)
+        return true;
+
     assert(res->pending > 0);
     res->pending--;
-    op->type = IO_VOID; // Mark unused
+    release_op(ioc, op); // Mark unused
+
+    if (res->closing && res->pending == 0)
+        release_res(ioc, res);
+    return true;
+}
+#endif
+
+#if IO_PLATFORM_LINUX
+static void
+io_wait_internal_linux(struct io_context *ioc,
+                       struct io_event *ev)
+{
+    bool done;
+    do {
+        /* --- Read barrier --- */
+        unsigned int head = atomic_load(ioc->completions.head);
+        unsigned int tail = atomic_load(ioc->completions.tail);
+
+        /*
+         * Submit what was queued since the last call and, if
+         * the completion queue is empty, wait for some operations
+         * to complete.
+         */
+        if (!enter_linux(ioc, head == tail ? 1 : 0)) {
+            ev->evtype = IO_ERROR;
+            ev->optype = IO_VOID;
+            ev->handle = IO_INVALID;
+            ev->user   = NULL;
+            ev->error  = errno;
+            return;
+        }
+
+        struct io_uring_cqe *cqe;
+        cqe = &ioc->completions.entries[head & (*ioc->completions.mask)];
+        done = event_from_cqe(ioc, cqe, ev);
+
+        /* --- write barrier --- */
+        atomic_store(ioc->completions.head, head+1);
+    } while (!done);
+}
+#endif
+
+#if IO_PLATFORM_LINUX
+static int
+io_wait_many_internal_linux(struct io_context *ioc,
+                            struct io_event *evs,
+                            int max)
+{
+    /* --- Read barrier --- */
+    unsigned int head = atomic_load(ioc->completions.head);
+    unsigned int tail = atomic_load(ioc->completions.tail);
+
+    if (!enter_linux(ioc, head == tail ? 1 : 0)) {
+        evs[0].evtype = IO_ERROR;
+        evs[0].optype = IO_VOID;
+        evs[0].handle = IO_INVALID;
+        evs[0].user   = NULL;
+        evs[0].error  = errno;
+        return 1;
+    }
+
+    tail = atomic_load(ioc->completions.tail);
+
+    int num = 0;
+    while (head != tail && num < max) {
+        struct io_uring_cqe *cqe;
+        cqe = &ioc->completions.entries[head & (*ioc->completions.mask)];
+        if (event_from_cqe(ioc, cqe, &evs[num]))
+            num++;
+        head++;
+    }
 
     /* --- write barrier --- */
-    atomic_store(ioc->completions.head, head+1);
+    atomic_store(ioc->completions.head, head);
+    return num;
 }
 #endif
 
@@ -1021,6 +2177,75 @@ void io_wait(struct io_context *ioc,
     }
 }
 
+static int
+io_wait_many_internal(struct io_context *ioc,
+                      struct io_event *evs,
+                      int max)
+{
+    #if IO_PLATFORM_WINDOWS
+    (void) max;
+    io_wait_internal_windows(ioc, &evs[0]);
+    return 1;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    return io_wait_many_internal_linux(ioc, evs, max);
+    #endif
+}
+
+/*
+ * Like io_wait but returns all the events that are
+ * ready (up to max) instead of one at the time. Events
+ * of resources with a callback are dispatched and not
+ * returned. Blocks until at least one event is returned.
+ */
+int io_wait_many(struct io_context *ioc,
+                 struct io_event *evs,
+                 int max)
+{
+    assert(max > 0);
+    for (;;) {
+
+        int num = io_wait_many_internal(ioc, evs, max);
+
+        int kept = 0;
+        for (int i = 0; i < num; i++) {
+
+            struct io_event ev = evs[i];
+
+            if (ev.handle != IO_INVALID) {
+                struct io_resource *res;
+                res = res_from_handle(ioc, ev.handle);
+                if (res && res->callback) {
+                    res->callback(ioc, ev);
+                    continue;
+                }
+            }
+
+            evs[kept++] = ev;
+        }
+
+        if (kept > 0)
+            return kept;
+    }
+}
+
+/*
+ * Starts the operations that were queued since the
+ * last call to io_submit, io_wait or io_wait_many.
+ */
+bool io_submit(struct io_context *ioc)
+{
+    #if IO_PLATFORM_WINDOWS
+    (void) ioc;
+    return true;
+    #endif
+
+    #if IO_PLATFORM_LINUX
+    return enter_linux(ioc, 0);
+    #endif
+}
+
 void io_set_callback(struct io_context *ioc,
                      io_handle handle,
                      io_callback callback)
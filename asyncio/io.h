@@ -29,6 +29,13 @@ typedef int io_os_handle;
 typedef uint32_t io_handle;
 #define IO_INVALID ((uint32_t) -1)
 
+// Handles hold the index of the resource in the low bits
+// and its generation in the others, which bounds how many
+// resources a context can have.
+#define IO_HANDLE_INDEX_BITS 20
+#define IO_HANDLE_GEN_MASK ((1 << (32 - IO_HANDLE_INDEX_BITS)) - 1)
+#define IO_MAX_RES (1 << IO_HANDLE_INDEX_BITS)
+
 struct io_os_overlap {
     unsigned long *internal;
     unsigned long *internal_high;
@@ -47,6 +54,12 @@ enum io_optype {
     IO_RECV,
     IO_SEND,
     IO_ACCEPT,
+    IO_READ,
+    IO_WRITE,
+    IO_SENDFILE,
+    IO_FSYNC,
+    IO_CLOSE,
+    IO_TIMER,
 };
 
 #define IO_SOCKADDR_IN_SIZE 16
@@ -56,6 +69,12 @@ struct io_operation {
     enum io_optype type;
     struct io_resource *res;
     void *user;
+    struct io_operation *next; // Free list
+
+    #if IO_PLATFORM_LINUX
+    uint32_t spliced; // Bytes moved into the pipe by an io_sendfile
+    int64_t  timespec[2]; // Read by the kernel when submitted
+    #endif
 
     #if IO_PLATFORM_WINDOWS
     io_os_handle accepted;
@@ -79,6 +98,21 @@ struct io_event {
         uint32_t num;
         io_handle accepted;
     };
+
+    // Buffer picked by the kernel for an io_recv_any,
+    // or NULL.
+    void    *buffer;
+    uint16_t buffer_id;
+
+    // Set when the operation is multishot and will
+    // produce more events.
+    bool more;
+
+    // Error code (errno, or GetLastError on Windows) of an
+    // IO_ABORT or IO_ERROR event, or 0 if there is none.
+    // A multishot io_recv_any that ends with ENOBUFS ran
+    // out of provided buffers, not into a socket error.
+    int error;
 };
 
 struct io_context;
@@ -94,10 +128,17 @@ enum io_restype {
 struct io_resource {
     enum io_restype type;
     io_os_handle os_handle;
-    uint16_t pending;
+    uint32_t pending;
     uint16_t gen;
+    bool closing;
 
     io_callback callback;
+    struct io_resource *next; // Free list
+
+    #if IO_PLATFORM_LINUX
+    int pipe[2];        // Used by io_sendfile, or -1
+    uint32_t pipe_size;
+    #endif
 
     #if IO_PLATFORM_WINDOWS
     void *acceptfn;
@@ -112,13 +153,31 @@ struct io_resource {
 struct io_submission_queue {
     _Atomic unsigned int *head;
     _Atomic unsigned int *tail;
+    _Atomic unsigned int *flags;
     unsigned int *mask;
     unsigned int *array;
     unsigned int limit;
+    unsigned int unsubmitted;
+    unsigned int local_tail; // Published by enter_linux
     struct io_uring_sqe *entries;
 };
 #endif
 
+/*
+ * Pool of buffers the kernel picks from when an
+ * io_recv_any completes (provided buffer ring)
+ */
+#if IO_PLATFORM_LINUX
+#define IO_RECV_BUFFER_GROUP 0
+struct io_recv_buffers {
+    struct io_uring_buf_ring *ring;
+    char    *mem;
+    uint32_t size;
+    uint16_t count;
+    uint16_t tail;
+};
+#endif
+
 /*
  * io_uring's output queue
  */
@@ -134,31 +193,71 @@ struct io_completion_queue {
 
 struct io_context {
     io_os_handle os_handle;
-    uint16_t max_res;
-    uint16_t max_ops;
+    uint32_t max_res; // At most IO_MAX_RES
+    uint32_t max_ops;
     struct io_resource *res;
     struct io_operation *ops;
+    struct io_resource  *free_res;
+    struct io_operation *free_ops;
 
     #if IO_PLATFORM_LINUX
+    bool sqpoll;
     struct io_submission_queue submissions;
     struct io_completion_queue completions;
+    struct io_recv_buffers     recv_buffers;
     #endif
 };
 
+struct io_buffer {
+    void    *data;
+    uint32_t size;
+};
+
+#ifndef IO_SENDFILE_PIPE_SIZE
+#define IO_SENDFILE_PIPE_SIZE (1 << 20)
+#endif
+
+#ifndef IO_MAX_REGISTERED_BUFFERS
+#define IO_MAX_REGISTERED_BUFFERS 64
+#endif
+
+/*
+ * Zero means default for all fields
+ */
+struct io_config {
+    uint32_t entries;        // Submission queue size (Linux only)
+    uint32_t cq_entries;     // Completion queue size (Linux only)
+    bool     sqpoll;         // Linux only
+    uint32_t sqpoll_idle_ms;
+};
+
 bool io_global_init(void);
 void io_global_free(void);
 
 bool io_init(struct io_context   *ioc,
              struct io_resource  *res,
              struct io_operation *ops,
-             uint16_t max_res,
-             uint16_t max_ops);
+             uint32_t max_res,
+             uint32_t max_ops);
+
+bool io_init_ex(struct io_context   *ioc,
+                struct io_resource  *res,
+                struct io_operation *ops,
+                uint32_t max_res,
+                uint32_t max_ops,
+                struct io_config config);
 
 void io_free(struct io_context *ioc);
 
 void io_wait(struct io_context *ioc,
              struct io_event *ev);
 
+int io_wait_many(struct io_context *ioc,
+                 struct io_event *evs,
+                 int max);
+
+bool io_submit(struct io_context *ioc);
+
 bool io_recv(struct io_context *ioc,
              void *user, io_handle handle,
              void *dsc, uint32_t max);
@@ -167,12 +266,68 @@ bool io_send(struct io_context *ioc,
              void *user, io_handle handle,
              void *src, uint32_t num);
 
+bool io_read(struct io_context *ioc,
+             void *user, io_handle handle,
+             void *dst, uint32_t max,
+             uint64_t offset);
+
+bool io_write(struct io_context *ioc,
+              void *user, io_handle handle,
+              void *src, uint32_t num,
+              uint64_t offset);
+
+bool io_sendfile(struct io_context *ioc,
+                 void *user, io_handle handle,
+                 io_handle file, uint64_t offset,
+                 uint32_t num);
+
+bool io_fsync(struct io_context *ioc,
+              void *user, io_handle handle,
+              bool datasync);
+
+bool io_link_timeout(struct io_context *ioc,
+                     uint32_t ms);
+
+bool io_cancel(struct io_context *ioc,
+               io_handle handle);
+
+bool io_timer(struct io_context *ioc,
+              void *user, uint32_t ms);
+
 bool io_accept(struct io_context *ioc,
                void *user, io_handle handle);
 
+bool io_accept_multishot(struct io_context *ioc,
+                         void *user, io_handle handle);
+
+bool io_setup_recv_buffers(struct io_context *ioc,
+                           void *mem, uint32_t size,
+                           uint16_t count);
+
+void io_release_recv_buffer(struct io_context *ioc,
+                            uint16_t id);
+
+bool io_recv_any(struct io_context *ioc,
+                 void *user, io_handle handle);
+
+bool io_recv_multishot(struct io_context *ioc,
+                       void *user, io_handle handle);
+
+bool io_register_buffers(struct io_context *ioc,
+                         struct io_buffer *bufs,
+                         uint16_t count);
+
+bool io_send_fixed(struct io_context *ioc,
+                   void *user, io_handle handle,
+                   uint16_t index, void *src,
+                   uint32_t num);
+
 void io_close(struct io_context *ioc,
               io_handle handle);
 
+bool io_close_async(struct io_context *ioc,
+                    void *user, io_handle handle);
+
 /*
  * Flags for io_open_file and io_create_file
  */
@@ -189,6 +344,9 @@ io_handle io_open_file(struct io_context *ioc,
 io_handle io_create_file(struct io_context *ioc,
                          const char *file, int flags);
 
+io_handle io_attach_file(struct io_context *ioc,
+                         io_os_handle os_handle);
+
 io_handle io_start_server(struct io_context *ioc,
                           const char *addr, int port);
 
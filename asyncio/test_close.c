@@ -0,0 +1,76 @@
+/*
+ * Checks that closing a handle with an operation still in
+ * the submission queue doesn't let that operation reach
+ * whatever file reuses the descriptor number.
+ *
+ *   gcc test_close.c io.c -o test_close -Wall -Wextra -ggdb
+ *   ./test_close
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "io.h"
+
+#define MAX_RES 8
+#define MAX_OPS 8
+
+static struct io_resource res[MAX_RES];
+static struct io_operation ops[MAX_OPS];
+
+int main(void)
+{
+    struct io_context ioc;
+    if (!io_init(&ioc, res, ops, MAX_RES, MAX_OPS)) {
+        fprintf(stderr, "Couldn't initialize the I/O context\n");
+        return -1;
+    }
+
+    int a[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, a)) {
+        fprintf(stderr, "Couldn't create sockets\n");
+        return -1;
+    }
+
+    io_handle h = io_attach_file(&ioc, a[0]);
+    if (h == IO_INVALID) {
+        fprintf(stderr, "Couldn't attach socket\n");
+        return -1;
+    }
+
+    static char msg[] = "stale";
+    if (!io_send(&ioc, NULL, h, msg, sizeof(msg)-1)) {
+        fprintf(stderr, "Couldn't start send\n");
+        return -1;
+    }
+    io_close(&ioc, h);
+
+    // The lowest free descriptor is the one just closed
+    int b[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, b)) {
+        fprintf(stderr, "Couldn't create sockets\n");
+        return -1;
+    }
+    if (b[0] != a[0])
+        fprintf(stderr, "Descriptor %d wasn't reused\n", a[0]);
+
+    struct io_event ev;
+    io_wait(&ioc, &ev);
+    if (ev.optype != IO_SEND || ev.handle != IO_INVALID) {
+        fprintf(stderr, "FAILED (unexpected event)\n");
+        abort();
+    }
+
+    char buf[16];
+    if (recv(b[1], buf, sizeof(buf), 0) > 0) {
+        fprintf(stderr, "FAILED (the send reached the new socket)\n");
+        abort();
+    }
+
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+    io_free(&ioc);
+    fprintf(stderr, "PASSED\n");
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Measures the per-request latency of a few hot keep-alive
+ * clients while many other connections sit idle. With the
+ * poll backend the latency grows with the number of idle
+ * connections, with epoll it should stay flat. The heap
+ * memory the server uses for each idle connection is also
+ * reported.
+ *
+ *   gcc bench_idle.c server.c parse.c ../thread/thread.c ../time/clock.c \
+ *       -o bench_idle -O2 -DNDEBUG -lpthread
+ *   ./bench_idle epoll 50000
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "server.h"
+#include "../time/clock.h"
+#include "../thread/thread.h"
+
+#define PORT 8090
+#define NUM_HOT 4
+#define NUM_REQUESTS 20000
+
+static struct server server;
+
+static os_threadreturn server_routine(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        struct request r;
+        uint32_t h = http_server_wait_request(&server, &r);
+        http_server_set_status(&server, h, 200);
+        http_server_append_content_string(&server, h, "Hello, world!\n");
+        http_server_send_response(&server, h);
+    }
+    return 0;
+}
+
+static int connect_to_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends a request and reads the response. Returns
+// false when the connection needs to be reopened.
+static bool roundtrip(int fd)
+{
+    static const char req[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (send(fd, req, sizeof(req)-1, 0) != sizeof(req)-1)
+        return false;
+
+    char buf[1<<10];
+    size_t used = 0;
+    for (;;) {
+        int n = recv(fd, buf + used, sizeof(buf) - used - 1, 0);
+        if (n <= 0)
+            return false;
+        used += n;
+        buf[used] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        if (end && (size_t) (end - buf) + 4 + 14 <= used)
+            break;
+    }
+    return strstr(buf, "Connection: Close") == NULL;
+}
+
+// Bytes allocated in all arenas, including the mapped ones
+static size_t heap_in_use(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t*) a;
+    uint64_t y = *(uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    int backend = HTTP_BACKEND_EPOLL;
+    int num_idle = 10000;
+    if (argc > 1 && !strcmp(argv[1], "poll"))
+        backend = HTTP_BACKEND_POLL;
+    if (argc > 2)
+        num_idle = atoi(argv[2]);
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    // Keep-alive stays enabled for the hot clients and the
+    // idle ones are never dropped
+    struct server_config config = {
+        .backend = backend,
+        .max_clients = num_idle + NUM_HOT + 1,
+        .keepalive_limit = num_idle + NUM_HOT + 1,
+        .backlog = 4096,
+        .keepalive_timeout_ms = -1,
+    };
+    size_t heap_before = heap_in_use();
+    if (!http_server_init_ex(&server, "127.0.0.1", PORT, config)) {
+        fprintf(stderr, "Couldn't start the server\n");
+        return -1;
+    }
+
+    os_thread thread;
+    os_thread_create(&thread, NULL, server_routine);
+
+    int opened = 0;
+    for (int i = 0; i < num_idle; i++) {
+        if (connect_to_server() < 0) {
+            fprintf(stderr, "Couldn't open idle connection %d (%s)\n", i, strerror(errno));
+            break;
+        }
+        opened++;
+    }
+
+    int hot[NUM_HOT];
+    for (int i = 0; i < NUM_HOT; i++)
+        hot[i] = connect_to_server();
+
+    static uint64_t samples[NUM_REQUESTS];
+    uint64_t start = get_relative_time_ns();
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        int k = i % NUM_HOT;
+        uint64_t t = get_relative_time_ns();
+        bool keep = roundtrip(hot[k]);
+        samples[i] = get_relative_time_ns() - t;
+        if (!keep) {
+            close(hot[k]);
+            hot[k] = connect_to_server();
+        }
+    }
+    uint64_t elapsed = get_relative_time_ns() - start;
+
+    // The hot clients connected last, so by now the idle
+    // ones were accepted.
+    size_t heap_after = heap_in_use();
+
+    qsort(samples, NUM_REQUESTS, sizeof(samples[0]), compare_u64);
+
+    fprintf(stderr, "backend=%s idle=%d requests=%d\n",
+            backend == HTTP_BACKEND_POLL ? "poll" : "epoll", opened, NUM_REQUESTS);
+    fprintf(stderr, "  avg %llu ns, p50 %llu ns, p99 %llu ns\n",
+            (unsigned long long) (elapsed / NUM_REQUESTS),
+            (unsigned long long) samples[NUM_REQUESTS / 2],
+            (unsigned long long) samples[NUM_REQUESTS * 99 / 100]);
+    if (opened > 0)
+        fprintf(stderr, "  %zu bytes of heap per idle connection (struct client is %zu)\n",
+                (heap_after - heap_before) / opened, sizeof(struct client));
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Measures the throughput of pipelined GET requests over
+ * loopback. A few connections each keep a fixed number
+ * of requests in flight by writing them back to back and
+ * counting the responses as they arrive.
+ *
+ *   gcc bench_pipeline.c server.c parse.c ../thread/thread.c ../time/clock.c \
+ *       -o bench_pipeline -O2 -DNDEBUG -DKEEPALIVE_MAX_REQUESTS=1000000000 -lpthread
+ *   ./bench_pipeline epoll 16
+ *
+ * Adding -DHTTP_NO_METRICS measures the server without
+ * recording metrics.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "server.h"
+#include "../time/clock.h"
+#include "../thread/thread.h"
+
+#define PORT 8090
+#define NUM_CONNS 4
+#define NUM_REQUESTS 1000000
+
+static const char req[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+static const char body[] = "Hello, world!\n";
+
+static struct server server;
+
+static os_threadreturn server_routine(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        struct request r;
+        uint32_t h = http_server_wait_request(&server, &r);
+        http_server_set_status(&server, h, 200);
+        http_server_append_content_string(&server, h, (char*) body);
+        http_server_send_response(&server, h);
+    }
+    return 0;
+}
+
+static int connect_to_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct conn {
+    int fd;
+    int sent;
+    int received;
+    int target;
+    size_t used;
+    char buf[1<<16];
+};
+
+static bool send_requests(struct conn *c, int num)
+{
+    static char batch[(sizeof(req)-1) * 256];
+    if (num > 256)
+        num = 256;
+    for (int i = 0; i < num; i++)
+        memcpy(batch + i * (sizeof(req)-1), req, sizeof(req)-1);
+
+    size_t len = num * (sizeof(req)-1);
+    size_t done = 0;
+    while (done < len) {
+        int n = send(c->fd, batch + done, len - done, 0);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    c->sent += num;
+    return true;
+}
+
+// Counts the complete responses in the buffer. All
+// responses have the same length since they have the
+// same headers and content.
+static bool recv_responses(struct conn *c, size_t response_len)
+{
+    int n = recv(c->fd, c->buf + c->used, sizeof(c->buf) - c->used, 0);
+    if (n <= 0)
+        return false;
+    c->used += n;
+
+    size_t num = c->used / response_len;
+    c->received += num;
+    c->used -= num * response_len;
+    memmove(c->buf, c->buf + num * response_len, c->used);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int backend = HTTP_BACKEND_EPOLL;
+    int depth = 16;
+    if (argc > 1 && !strcmp(argv[1], "poll"))
+        backend = HTTP_BACKEND_POLL;
+#ifdef HTTP_ASYNCIO
+    if (argc > 1 && !strcmp(argv[1], "asyncio"))
+        backend = HTTP_BACKEND_ASYNCIO;
+#endif
+    if (argc > 2)
+        depth = atoi(argv[2]);
+    if (depth < 1)
+        depth = 1;
+
+    if (!http_server_init_ex(&server, "127.0.0.1", PORT, (struct server_config) {.backend=backend})) {
+        fprintf(stderr, "Couldn't start the server\n");
+        return -1;
+    }
+
+    os_thread thread;
+    os_thread_create(&thread, NULL, server_routine);
+
+    // Learn the length of a response
+    size_t response_len;
+    {
+        int fd = connect_to_server();
+        if (fd < 0 || send(fd, req, sizeof(req)-1, 0) != sizeof(req)-1) {
+            fprintf(stderr, "Couldn't connect (%s)\n", strerror(errno));
+            return -1;
+        }
+        char buf[1<<10];
+        size_t used = 0;
+        char *end = NULL;
+        while (end == NULL || (size_t) (end - buf) + 4 + sizeof(body)-1 > used) {
+            int n = recv(fd, buf + used, sizeof(buf) - used - 1, 0);
+            if (n <= 0) {
+                fprintf(stderr, "Couldn't read the response\n");
+                return -1;
+            }
+            used += n;
+            buf[used] = '\0';
+            end = strstr(buf, "\r\n\r\n");
+        }
+        response_len = used;
+        close(fd);
+    }
+
+    struct conn *conns = malloc(NUM_CONNS * sizeof(struct conn));
+    if (conns == NULL)
+        return -1;
+
+    for (int i = 0; i < NUM_CONNS; i++) {
+        conns[i].fd = connect_to_server();
+        conns[i].sent = 0;
+        conns[i].received = 0;
+        conns[i].target = NUM_REQUESTS / NUM_CONNS;
+        conns[i].used = 0;
+        if (conns[i].fd < 0) {
+            fprintf(stderr, "Couldn't connect (%s)\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    uint64_t start = get_relative_time_ns();
+    int pending = NUM_CONNS;
+    while (pending > 0) {
+        pending = 0;
+        for (int i = 0; i < NUM_CONNS; i++) {
+            struct conn *c = &conns[i];
+            if (c->received == c->target)
+                continue;
+            pending++;
+
+            int in_flight = c->sent - c->received;
+            int missing = c->target - c->sent;
+            int num = depth - in_flight;
+            if (num > missing)
+                num = missing;
+            if (num > 0 && !send_requests(c, num)) {
+                fprintf(stderr, "Couldn't send (%s)\n", strerror(errno));
+                return -1;
+            }
+            if (!recv_responses(c, response_len)) {
+                fprintf(stderr, "Connection closed by the server\n");
+                return -1;
+            }
+        }
+    }
+    uint64_t elapsed = get_relative_time_ns() - start;
+
+    int total = NUM_CONNS * (NUM_REQUESTS / NUM_CONNS);
+    fprintf(stderr, "depth=%d connections=%d requests=%d\n", depth, NUM_CONNS, total);
+    fprintf(stderr, "  %.0f requests/sec\n", total / (elapsed / 1e9));
+    return 0;
+}
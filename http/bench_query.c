@@ -0,0 +1,65 @@
+/*
+ * Measures a handler reading ten parameters of a typical
+ * query string, scanning it once per parameter with
+ * get_query_string_param and indexing it once to look
+ * them up with find_param.
+ *
+ *   gcc bench_query.c query_string.c ../time/clock.c -o bench_query -O2
+ *   gcc bench_query.c query_string.c ../time/clock.c -o bench_query -O2 -mavx2
+ *   gcc bench_query.c query_string.c ../time/clock.c -o bench_query -O2 -DHTTP_NO_SIMD
+ *   ./bench_query
+ */
+#include <stdio.h>
+#include <string.h>
+#include "query_string.h"
+#include "../time/clock.h"
+
+#define NUM_ROUNDS 200000
+
+static char query[] =
+    "?q=http+server+in+c&lang=en-US&page=3&per_page=50"
+    "&sort=updated&order=desc&utm_source=newsletter"
+    "&utm_medium=email&utm_campaign=spring%20launch"
+    "&ref=https%3A%2F%2Fexample.com%2Fblog&session_hint=8f2a1c9e4b7d"
+    "&filter=stars%3A%3E100&type=repositories";
+
+static char *keys[] = {
+    "q", "lang", "page", "per_page", "sort",
+    "order", "ref", "filter", "type", "missing",
+};
+
+#define NUM_KEYS (int) (sizeof(keys) / sizeof(keys[0]))
+
+static volatile size_t sink;
+
+int main(void)
+{
+    size_t len = strlen(query);
+    char buf[256];
+    struct slice v;
+
+    uint64_t start = get_relative_time_ns();
+    for (int k = 0; k < NUM_ROUNDS; k++)
+        for (int i = 0; i < NUM_KEYS; i++)
+            if (get_query_string_param(query, len, keys[i], buf, sizeof(buf), &v))
+                sink += v.size;
+    uint64_t scan_ns = get_relative_time_ns() - start;
+
+    start = get_relative_time_ns();
+    for (int k = 0; k < NUM_ROUNDS; k++) {
+        struct param_index idx;
+        if (!index_query_string(query, len, &idx)) {
+            fprintf(stderr, "Couldn't index the query string\n");
+            return -1;
+        }
+        for (int i = 0; i < NUM_KEYS; i++)
+            if (find_param(&idx, keys[i], buf, sizeof(buf), &v))
+                sink += v.size;
+    }
+    uint64_t index_ns = get_relative_time_ns() - start;
+
+    fprintf(stderr, "%d lookups per request\n", NUM_KEYS);
+    fprintf(stderr, "scan  :: %6.1f ns/request\n", (double) scan_ns / NUM_ROUNDS);
+    fprintf(stderr, "index :: %6.1f ns/request\n", (double) index_ns / NUM_ROUNDS);
+    return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Compares dispatching requests by trying the routes one by
+ * one with match_path_format with the compiled router, over
+ * the routes of a typical REST API and paths that hit all of
+ * them plus some that don't match any.
+ *
+ *   gcc bench_route.c router.c path.c ../time/clock.c -o bench_route -O2
+ *   ./bench_route
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "path.h"
+#include "router.h"
+#include "../time/clock.h"
+
+#define NUM_ROUNDS 2000
+
+static char *routes[] = {
+    "/",
+    "/login",
+    "/logout",
+    "/signup",
+    "/search",
+    "/about",
+    "/pricing",
+    "/feed",
+    "/notifications",
+    "/notifications/:n",
+    "/notifications/:n/read",
+    "/settings",
+    "/settings/profile",
+    "/settings/account",
+    "/settings/emails",
+    "/settings/keys",
+    "/settings/keys/:n",
+    "/settings/tokens",
+    "/settings/tokens/:n",
+    "/settings/billing",
+    "/settings/security",
+    "/settings/sessions",
+    "/settings/sessions/:n",
+    "/users",
+    "/users/:l",
+    "/users/:l/followers",
+    "/users/:l/following",
+    "/users/:l/repos",
+    "/users/:l/starred",
+    "/users/:l/gists",
+    "/users/:l/orgs",
+    "/users/:l/events",
+    "/users/:l/keys",
+    "/orgs",
+    "/orgs/:l",
+    "/orgs/:l/members",
+    "/orgs/:l/members/:l",
+    "/orgs/:l/repos",
+    "/orgs/:l/teams",
+    "/orgs/:l/teams/:l",
+    "/orgs/:l/teams/:l/members",
+    "/orgs/:l/teams/:l/repos",
+    "/orgs/:l/settings",
+    "/orgs/:l/billing",
+    "/orgs/:l/events",
+    "/repos/:l/:l",
+    "/repos/:l/:l/issues",
+    "/repos/:l/:l/issues/new",
+    "/repos/:l/:l/issues/:n",
+    "/repos/:l/:l/issues/:n/comments",
+    "/repos/:l/:l/issues/:n/comments/:n",
+    "/repos/:l/:l/issues/:n/labels",
+    "/repos/:l/:l/issues/:n/events",
+    "/repos/:l/:l/pulls",
+    "/repos/:l/:l/pulls/new",
+    "/repos/:l/:l/pulls/:n",
+    "/repos/:l/:l/pulls/:n/commits",
+    "/repos/:l/:l/pulls/:n/files",
+    "/repos/:l/:l/pulls/:n/reviews",
+    "/repos/:l/:l/pulls/:n/reviews/:n",
+    "/repos/:l/:l/pulls/:n/merge",
+    "/repos/:l/:l/commits",
+    "/repos/:l/:l/commits/:l",
+    "/repos/:l/:l/commits/:l/comments",
+    "/repos/:l/:l/branches",
+    "/repos/:l/:l/branches/:l",
+    "/repos/:l/:l/branches/:l/protection",
+    "/repos/:l/:l/tags",
+    "/repos/:l/:l/releases",
+    "/repos/:l/:l/releases/latest",
+    "/repos/:l/:l/releases/:n",
+    "/repos/:l/:l/releases/:n/assets",
+    "/repos/:l/:l/contributors",
+    "/repos/:l/:l/languages",
+    "/repos/:l/:l/stargazers",
+    "/repos/:l/:l/forks",
+    "/repos/:l/:l/hooks",
+    "/repos/:l/:l/hooks/:n",
+    "/repos/:l/:l/hooks/:n/deliveries",
+    "/repos/:l/:l/labels",
+    "/repos/:l/:l/labels/:l",
+    "/repos/:l/:l/milestones",
+    "/repos/:l/:l/milestones/:n",
+    "/repos/:l/:l/actions",
+    "/repos/:l/:l/actions/runs",
+    "/repos/:l/:l/actions/runs/:n",
+    "/repos/:l/:l/actions/runs/:n/logs",
+    "/repos/:l/:l/actions/runs/:n/jobs",
+    "/repos/:l/:l/actions/workflows",
+    "/repos/:l/:l/actions/workflows/:l",
+    "/repos/:l/:l/settings",
+    "/repos/:l/:l/settings/collaborators",
+    "/repos/:l/:l/settings/branches",
+    "/repos/:l/:l/wiki",
+    "/repos/:l/:l/wiki/:l",
+    "/repos/:l/:l/projects",
+    "/repos/:l/:l/projects/:n",
+    "/repos/:l/:l/security",
+    "/repos/:l/:l/insights",
+    "/gists",
+    "/gists/public",
+    "/gists/starred",
+    "/gists/:l",
+    "/gists/:l/comments",
+    "/gists/:l/comments/:n",
+    "/gists/:l/forks",
+    "/gists/:l/star",
+    "/topics",
+    "/topics/:l",
+    "/marketplace",
+    "/marketplace/:l",
+    "/sponsors/:l",
+    "/explore",
+    "/trending",
+    "/trending/:l",
+    "/api/v1/status",
+    "/api/v1/rate_limit",
+    "/api/v1/meta",
+    "/api/v1/emojis",
+};
+
+#define NUM_ROUTES (int) (sizeof(routes) / sizeof(routes[0]))
+
+static char *misses[] = {
+    "/nope",
+    "/users/octocat/nope",
+    "/repos/octocat/hello-world/issues/abc",
+    "/repos/octocat/hello-world/pulls/12/nope",
+    "/settings/keys/abc",
+    "/api/v2/status",
+};
+
+#define NUM_MISSES (int) (sizeof(misses) / sizeof(misses[0]))
+
+static volatile size_t sink;
+
+// Replaces the captures of a format with typical values
+static char *instantiate(char *fmt)
+{
+    char buf[1<<10];
+    size_t len = 0;
+    for (char *p = fmt; *p; p++) {
+        if (p[0] == ':' && p[1] == 'l') {
+            len += sprintf(buf + len, "hello-world");
+            p++;
+        } else if (p[0] == ':' && p[1] == 'n') {
+            len += sprintf(buf + len, "1347");
+            p++;
+        } else
+            buf[len++] = *p;
+    }
+    buf[len] = '\0';
+    return strdup(buf);
+}
+
+/*
+ * How requests are dispatched without the router. The
+ * captures are written through pointers of either type,
+ * so they all point to storage that fits both.
+ */
+static int linear_match(struct slice path)
+{
+    union { struct slice l; uint32_t n; } caps[ROUTER_MAX_CAPTURES];
+    for (int i = 0; i < NUM_ROUTES; i++)
+        if (match_path_format(path, routes[i],
+                &caps[0], &caps[1], &caps[2], &caps[3],
+                &caps[4], &caps[5], &caps[6], &caps[7]) == 0)
+            return i;
+    return -1;
+}
+
+int main(void)
+{
+    struct router rt;
+    if (!router_init(&rt))
+        return -1;
+    for (int i = 0; i < NUM_ROUTES; i++)
+        if (!router_add(&rt, routes[i], i)) {
+            fprintf(stderr, "Couldn't add %s\n", routes[i]);
+            return -1;
+        }
+
+    int num_paths = NUM_ROUTES + NUM_MISSES;
+    struct slice *paths = malloc(num_paths * sizeof(struct slice));
+    int *expect = malloc(num_paths * sizeof(int));
+    for (int i = 0; i < NUM_ROUTES; i++) {
+        char *p = instantiate(routes[i]);
+        paths[i] = (struct slice) {.data=p, .size=strlen(p)};
+        expect[i] = i;
+    }
+    for (int i = 0; i < NUM_MISSES; i++) {
+        paths[NUM_ROUTES + i] = (struct slice) {.data=misses[i], .size=strlen(misses[i])};
+        expect[NUM_ROUTES + i] = -1;
+    }
+
+    // Both must agree on every path before timing them
+    for (int i = 0; i < num_paths; i++) {
+        struct route_match m;
+        int got = router_match(&rt, paths[i], &m) ? m.route : -1;
+        if (got != expect[i] || linear_match(paths[i]) != expect[i]) {
+            fprintf(stderr, "Mismatch on %.*s\n", (int) paths[i].size, paths[i].data);
+            return -1;
+        }
+    }
+
+    size_t lookups = (size_t) NUM_ROUNDS * num_paths;
+
+    uint64_t start = get_relative_time_ns();
+    for (int k = 0; k < NUM_ROUNDS; k++)
+        for (int i = 0; i < num_paths; i++)
+            sink += linear_match(paths[i]);
+    uint64_t linear_ns = get_relative_time_ns() - start;
+
+    start = get_relative_time_ns();
+    for (int k = 0; k < NUM_ROUNDS; k++)
+        for (int i = 0; i < num_paths; i++) {
+            struct route_match m;
+            sink += router_match(&rt, paths[i], &m) ? m.route : -1;
+        }
+    uint64_t router_ns = get_relative_time_ns() - start;
+
+    fprintf(stderr, "%d routes, %d paths\n", NUM_ROUTES, num_paths);
+    fprintf(stderr, "linear :: %7.1f ns/lookup\n", (double) linear_ns / lookups);
+    fprintf(stderr, "router :: %7.1f ns/lookup\n", (double) router_ns / lookups);
+
+    for (int i = 0; i < NUM_ROUTES; i++)
+        free(paths[i].data);
+    free(paths);
+    free(expect);
+    router_free(&rt);
+    return 0;
+}
@@ -1,20 +1,25 @@
 #include <string.h>
 #include "cookie.h"
 
+// Token characters (RFC 7230)
 bool is_cookie_name(char c)
 {
     return (c >= 'a' && c <= 'z')
         || (c >= 'A' && c <= 'Z')
         || (c >= '0' && c <= '9')
-        || c == '_' || c == '-';
+        || c == '_' || c == '-' || c == '.'
+        || c == '!' || c == '#' || c == '$'
+        || c == '%' || c == '&' || c == '\''
+        || c == '*' || c == '+' || c == '^'
+        || c == '`' || c == '|' || c == '~';
 }
 
+// The cookie-octet of RFC 6265: printable ASCII except
+// space, '"', ',', ';' and '\\'
 bool is_cookie_value(char c)
 {
-    return (c >= 'a' && c <= 'z')
-        || (c >= 'A' && c <= 'Z')
-        || (c >= '0' && c <= '9')
-        || c == '_' || c == '-';
+    return c > ' ' && c < 127
+        && c != '"' && c != ',' && c != ';' && c != '\\';
 }
 
 static bool is_space(char c)
@@ -22,74 +27,123 @@ static bool is_space(char c)
     return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
 
-bool get_cookie(struct request *r, char *name, struct slice *out)
+/*
+ * Parses the cookie at *cur_ in the value of a Cookie header
+ * and moves past it and the ';' that follows. Returns 1 if a
+ * cookie was parsed, 0 at the end of the header and -1 if it
+ * is invalid. Quoted values are returned without the quotes.
+ */
+static int next_cookie(char *src, size_t len, size_t *cur_,
+                       struct slice *name, struct slice *value)
 {
-    struct slice value;
-    if (!find_header(r, name, &value))
-        return false;
+    size_t cur = *cur_;
+    size_t start;
 
-    size_t name_len = strlen(name);
+    while (cur < len && is_space(src[cur]))
+        cur++;
 
-    char  *src = value.data;
-    size_t len = value.size;
-    size_t cur = 0;
-    while (cur < len) {
-        
-        size_t start;
-
-        while (cur < len && is_space(src[cur]))
-            cur++;
-        
-        if (cur == len)
-            break;
-        
-        if (!is_cookie_name(src[cur]))
-            return false;
+    if (cur == len)
+        return 0;
 
-        start = cur;
-        do
-            cur++;
-        while (cur < len && is_cookie_name(src[cur]));
-        
-        char  *cookie_name     = src + start;
-        size_t cookie_name_len = cur - start;
-
-        while (cur < len && is_space(src[cur]))
-            cur++;
-        
-        if (cur == len || src[cur] != '=')
-            return false;
+    if (!is_cookie_name(src[cur]))
+        return -1;
+
+    start = cur;
+    do
         cur++;
+    while (cur < len && is_cookie_name(src[cur]));
 
-        while (cur < len && is_space(src[cur]))
-            cur++;
-        
-        if (!is_cookie_value(src[cur]))
-            return false;
+    name->data = src + start;
+    name->size = cur - start;
 
-        start = cur;
-        do
-            cur++;
-        while (cur < len && is_cookie_value(src[cur]));
-        
-        char  *cookie_value     = src + start;
-        size_t cookie_value_len = cur - start;
-
-        while (cur < len && is_space(src[cur]))
-            cur++;
-        
-        if (cur < len) {
-            if (src[cur] != ';')
-                return false;
-            cur++;
-        }
+    while (cur < len && is_space(src[cur]))
+        cur++;
+
+    if (cur == len || src[cur] != '=')
+        return -1;
+    cur++;
+
+    while (cur < len && is_space(src[cur]))
+        cur++;
+
+    bool quoted = cur < len && src[cur] == '"';
+    if (quoted)
+        cur++;
+
+    // Values may be empty
+    start = cur;
+    while (cur < len && is_cookie_value(src[cur]))
+        cur++;
+
+    value->data = src + start;
+    value->size = cur - start;
+
+    if (quoted) {
+        if (cur == len || src[cur] != '"')
+            return -1;
+        cur++;
+    }
 
-        if (name_len == cookie_name_len && !memcmp(cookie_name, name, name_len)) {
-            out->data = cookie_value;
-            out->size = cookie_value_len;
+    while (cur < len && is_space(src[cur]))
+        cur++;
+
+    if (cur < len) {
+        if (src[cur] != ';')
+            return -1;
+        cur++;
+    }
+
+    *cur_ = cur;
+    return 1;
+}
+
+bool get_cookie(struct request *r, char *name, struct slice *out)
+{
+    struct slice header;
+    if (!find_known_header(r, H_COOKIE, &header))
+        return false;
+
+    size_t name_len = strlen(name);
+
+    size_t cur = 0;
+    struct slice cookie_name;
+    struct slice cookie_value;
+    while (next_cookie(header.data, header.size, &cur, &cookie_name, &cookie_value) == 1) {
+        if (name_len == cookie_name.size && !memcmp(cookie_name.data, name, name_len)) {
+            *out = cookie_value;
             return true;
         }
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+/*
+ * Splits the Cookie header of a request into the index so
+ * that any number of cookies can be looked up with find_param
+ * without scanning it again. Cookie values aren't encoded, so
+ * they are always returned as slices of the header. Returns
+ * false if the header is invalid or has more than
+ * PARAM_INDEX_MAX distinct cookies.
+ */
+bool index_cookies(struct request *r, struct param_index *idx)
+{
+    reset_param_index(idx);
+
+    struct slice header;
+    if (!find_known_header(r, H_COOKIE, &header))
+        return true;
+
+    size_t cur = 0;
+    for (;;) {
+        struct param p = {.key_encoded=false, .value_encoded=false};
+        int ret = next_cookie(header.data, header.size, &cur, &p.key, &p.value);
+        if (ret < 0)
+            return false;
+        if (ret == 0)
+            break;
+        if (!add_param(idx, p))
+            return false;
+    }
+    return true;
+}
@@ -3,5 +3,7 @@
 
 // This is just for slice
 #include "parse.h"
+#include "query_string.h"
 
 bool get_cookie(struct request *r, char *name, struct slice *out);
+bool index_cookies(struct request *r, struct param_index *idx);
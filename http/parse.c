@@ -3,6 +3,87 @@
 #include <stdbool.h>
 #include "parse.h"
 
+// Scans are done SIMD_WIDTH bytes at a time with the widest
+// instruction set enabled at compile time (-mavx2), falling
+// back to scalar code without SSE2 or with HTTP_NO_SIMD.
+#if defined(__AVX2__) && !defined(HTTP_NO_SIMD)
+#include <immintrin.h>
+#define SIMD_WIDTH 32
+#elif defined(__SSE2__) && !defined(HTTP_NO_SIMD)
+#include <emmintrin.h>
+#define SIMD_WIDTH 16
+#endif
+
+#ifdef SIMD_WIDTH
+// Bit i is set if src[i] is c, for i < SIMD_WIDTH
+static inline uint32_t match_byte(const char *src, char c)
+{
+#if SIMD_WIDTH == 32
+    __m256i v = _mm256_loadu_si256((const __m256i*) src);
+    return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+#else
+    __m128i v = _mm_loadu_si128((const __m128i*) src);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+#endif
+}
+#endif
+
+/*
+ * Returns the index of the first c in src[cur..len),
+ * or len if there is none.
+ */
+static inline size_t find_byte(const char *src, size_t cur, size_t len, char c)
+{
+#ifdef SIMD_WIDTH
+    while (cur + SIMD_WIDTH <= len) {
+        uint32_t m = match_byte(src + cur, c);
+        if (m)
+            return cur + __builtin_ctz(m);
+        cur += SIMD_WIDTH;
+    }
+#endif
+    while (cur < len && src[cur] != c)
+        cur++;
+    return cur;
+}
+
+/*
+ * Returns the length of the request head in src up to
+ * and including the "\r\n\r\n" that ends it, or 0 if it
+ * wasn't received entirely. The first "from" bytes are
+ * the ones searched by a previous call on the same input,
+ * so that the search resumes where it stopped instead of
+ * starting over as more input arrives.
+ */
+size_t find_head_end(const char *src, size_t len, size_t from)
+{
+    // The terminator may start in the bytes that were
+    // already searched.
+    size_t cur = from < 3 ? 0 : from - 3;
+
+#ifdef SIMD_WIDTH
+    // The terminator starts at i when the bytes at i,
+    // i+1, i+2 and i+3 match, so the masks of the four
+    // shifted loads are combined.
+    while (cur + SIMD_WIDTH + 3 <= len) {
+        uint32_t m = match_byte(src + cur + 0, '\r')
+                   & match_byte(src + cur + 1, '\n')
+                   & match_byte(src + cur + 2, '\r')
+                   & match_byte(src + cur + 3, '\n');
+        if (m)
+            return cur + __builtin_ctz(m) + 4;
+        cur += SIMD_WIDTH;
+    }
+#endif
+    while (cur + 4 <= len) {
+        if (src[cur+0] == '\r' && src[cur+1] == '\n'
+         && src[cur+2] == '\r' && src[cur+3] == '\n')
+            return cur + 4;
+        cur++;
+    }
+    return 0;
+}
+
 bool is_digit(char c)
 {
     return c >= '0' && c <= '9';
@@ -13,9 +94,78 @@ bool is_space(char c)
     return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
 
+char to_lower(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A' + 'a';
+    else
+        return c;
+}
+
+/*
+ * The names of the known headers are told apart by a hash
+ * of their length and of their first and last letter, which
+ * has no collisions between them. A name is known if it's
+ * the one in the slot of its hash. The slots need to be
+ * recomputed when a header is added.
+ */
+#define HEADER_HASH_SIZE 64
+
+static const struct {
+    const char *name; // Lowercase
+    int         size;
+    int         id;
+} header_slots[HEADER_HASH_SIZE] = {
+    [24] = {"host",               4, H_HOST},
+    [ 2] = {"content-length",    14, H_CONTENT_LENGTH},
+    [61] = {"content-type",      12, H_CONTENT_TYPE},
+    [ 8] = {"transfer-encoding", 17, H_TRANSFER_ENCODING},
+    [ 4] = {"connection",        10, H_CONNECTION},
+    [55] = {"cookie",             6, H_COOKIE},
+    [62] = {"accept",             6, H_ACCEPT},
+    [58] = {"accept-encoding",   15, H_ACCEPT_ENCODING},
+    [56] = {"accept-language",   15, H_ACCEPT_LANGUAGE},
+    [18] = {"user-agent",        10, H_USER_AGENT},
+    [25] = {"if-none-match",     13, H_IF_NONE_MATCH},
+    [26] = {"if-modified-since", 17, H_IF_MODIFIED_SINCE},
+    [17] = {"if-range",           8, H_IF_RANGE},
+    [50] = {"range",              5, H_RANGE},
+    [14] = {"expect",             6, H_EXPECT},
+    [ 0] = {"upgrade",            7, H_UPGRADE},
+    [63] = {"authorization",     13, H_AUTHORIZATION},
+    [ 1] = {"referer",            7, H_REFERER},
+    [48] = {"origin",             6, H_ORIGIN},
+    [ 5] = {"cache-control",     13, H_CACHE_CONTROL},
+};
+
+/*
+ * Returns the H_* value of a header name, or -1 if it's
+ * not one of the known ones.
+ */
+int classify_header(struct slice name)
+{
+    if (name.size == 0)
+        return -1;
+
+    char first = to_lower(name.data[0]);
+    char last  = to_lower(name.data[name.size-1]);
+    size_t h = (name.size + 4 * (unsigned char) first + (unsigned char) last) & (HEADER_HASH_SIZE-1);
+
+    if (header_slots[h].name == NULL || (size_t) header_slots[h].size != name.size)
+        return -1;
+
+    for (size_t i = 0; i < name.size; i++)
+        if (to_lower(name.data[i]) != header_slots[h].name[i])
+            return -1;
+
+    return header_slots[h].id;
+}
+
 int parse_request_head(char *src, size_t len,
                        struct request *r)
 {
+    _Static_assert(MAX_HEADERS < UINT16_MAX);
+
     size_t cur;
     if (len > 2
         && src[0] == 'G'
@@ -99,8 +249,7 @@ int parse_request_head(char *src, size_t len,
     // TODO: Make this more robust
     {
         size_t start = cur;
-        while (cur < len && src[cur] != ' ')
-            cur++;
+        cur = find_byte(src, cur, len, ' ');
         r->path.data = src + start;
         r->path.size = cur - start;
     }
@@ -138,6 +287,7 @@ int parse_request_head(char *src, size_t len,
     cur += 2;
 
     r->nhs = 0;
+    memset(r->known, 0, sizeof(r->known));
     while (cur+1 >= len
         || src[cur+0] != '\r'
         || src[cur+1] != '\n') {
@@ -148,9 +298,8 @@ int parse_request_head(char *src, size_t len,
         size_t start = cur;
 
         // TODO: More robust
-        while (cur < len && src[cur] != ':')
-            cur++;
-        
+        cur = find_byte(src, cur, len, ':');
+
         name.data = src + start;
         name.size = cur - start;
 
@@ -160,8 +309,7 @@ int parse_request_head(char *src, size_t len,
 
         // TODO: More robust
         start = cur;
-        while (cur < len && src[cur] != '\r')
-            cur++;
+        cur = find_byte(src, cur, len, '\r');
         value.data = src + start;
         value.size = cur - start;
 
@@ -171,6 +319,9 @@ int parse_request_head(char *src, size_t len,
         cur++; // \n
 
         if (r->nhs < MAX_HEADERS) {
+            int h = classify_header(name);
+            if (h >= 0 && r->known[h] == 0)
+                r->known[h] = r->nhs + 1;
             r->hs[r->nhs].name = name;
             r->hs[r->nhs].value = value;
             r->nhs++;
@@ -180,14 +331,6 @@ int parse_request_head(char *src, size_t len,
     return P_OK;
 }
 
-char to_lower(char c)
-{
-    if (c >= 'A' || c <= 'Z')
-        return c - 'A' + 'a';
-    else
-        return c;
-}
-
 bool string_match_case_insensitive(struct slice x,
                                    struct slice y)
 {
@@ -220,6 +363,8 @@ struct slice trim(struct slice s)
         s.data = "";
         s.size = 0;
     } else {
+        s.data += cur;
+        s.size -= cur;
         while (is_space(s.data[s.size-1]))
             s.size--;
     }
@@ -233,9 +378,23 @@ bool match_header_value(struct slice s1, char *s2)
     return string_match_case_insensitive(x, y);
 }
 
+bool find_known_header(struct request *r, enum known_header h,
+                       struct slice *value)
+{
+    int i = r->known[h];
+    if (i == 0)
+        return false;
+    *value = r->hs[i-1].value;
+    return true;
+}
+
 bool find_header(struct request *r, char *name,
                  struct slice *value)
 {
+    int h = classify_header(str_to_slice(name));
+    if (h >= 0)
+        return find_known_header(r, h, value);
+
     for (int i = 0; i < r->nhs; i++)
         if (match_header_name(r->hs[i].name, name)) {
             *value = r->hs[i].value;
@@ -247,7 +406,7 @@ bool find_header(struct request *r, char *name,
 size_t find_and_parse_content_length(struct request *r)
 {
     struct slice value;
-    if (!find_header(r, "Content-Length", &value))
+    if (!find_known_header(r, H_CONTENT_LENGTH, &value))
         return -1;
 
     size_t cur = 0;
@@ -308,7 +467,7 @@ size_t parse_content_length(struct slice s)
 int find_and_parse_transfer_encoding(struct request *r)
 {
     struct slice value;
-    if (!find_header(r, "Transfer-Encoding", &value))
+    if (!find_known_header(r, H_TRANSFER_ENCODING, &value))
         return 0;
     
     int res = 0;
@@ -319,7 +478,10 @@ int find_and_parse_transfer_encoding(struct request *r)
         
         while (cur < len && (is_space(src[cur]) || src[cur] == ','))
             cur++;
-        
+
+        if (cur == len)
+            break;
+
         if (cur+6 < len
             && src[cur+0] == 'c'
             && src[cur+1] == 'h'
@@ -364,3 +526,413 @@ int find_and_parse_transfer_encoding(struct request *r)
     }
     return res;
 }
+
+/*
+ * Returns whether the parameters that follow a coding in
+ * an Accept-Encoding list give it a weight of zero, which
+ * means that the coding is refused. The cursor is left on
+ * the comma that ends the item, or at the end.
+ */
+static bool parse_zero_weight(char *src, size_t len, size_t *pcur)
+{
+    bool zero = false;
+    size_t cur = *pcur;
+    while (cur < len && src[cur] != ',') {
+
+        if (src[cur] != ';') {
+            cur++;
+            continue;
+        }
+        cur++; // ;
+
+        while (cur < len && is_space(src[cur]))
+            cur++;
+
+        if (cur+1 < len && to_lower(src[cur]) == 'q' && src[cur+1] == '=') {
+            cur += 2;
+            // The weight is zero if it's 0 with at most three
+            // zero decimals.
+            zero = (cur < len && src[cur] == '0');
+            if (zero) {
+                cur++;
+                if (cur < len && src[cur] == '.') {
+                    cur++;
+                    while (cur < len && src[cur] == '0')
+                        cur++;
+                }
+                if (cur < len && is_digit(src[cur]))
+                    zero = false;
+            }
+        }
+    }
+    *pcur = cur;
+    return zero;
+}
+
+/*
+ * Returns the content codings among T_GZIP and T_DEFLATE
+ * that the client accepts. Unknown codings are ignored and
+ * the wildcard stands for those that aren't listed.
+ */
+int find_and_parse_accept_encoding(struct request *r)
+{
+    struct slice value;
+    if (!find_known_header(r, H_ACCEPT_ENCODING, &value))
+        return 0;
+
+    int accepted = 0;
+    int listed = 0;
+    bool wildcard = false;
+    char  *src = value.data;
+    size_t len = value.size;
+    size_t cur = 0;
+    for (;;) {
+
+        while (cur < len && (is_space(src[cur]) || src[cur] == ','))
+            cur++;
+
+        if (cur == len)
+            break;
+
+        size_t start = cur;
+        while (cur < len && src[cur] != ',' && src[cur] != ';' && !is_space(src[cur]))
+            cur++;
+        struct slice coding = {.data=src+start, .size=cur-start};
+
+        int flag = 0;
+        if (string_match_case_insensitive(coding, str_to_slice("gzip"))
+            || string_match_case_insensitive(coding, str_to_slice("x-gzip")))
+            flag = T_GZIP;
+        else if (string_match_case_insensitive(coding, str_to_slice("deflate")))
+            flag = T_DEFLATE;
+
+        bool zero = parse_zero_weight(src, len, &cur);
+        if (flag) {
+            listed |= flag;
+            if (!zero) accepted |= flag;
+        } else if (coding.size == 1 && coding.data[0] == '*')
+            wildcard = !zero;
+    }
+
+    if (wildcard)
+        accepted |= (T_GZIP | T_DEFLATE) & ~listed;
+    return accepted;
+}
+
+/*
+ * Returns whether the list of entity-tags of an If-None-Match
+ * or If-Match header contains the tag (with its quotes), or
+ * is "*". With the weak comparison the W/ prefix is ignored,
+ * else weak tags never match.
+ */
+bool match_etag_list(struct slice list, struct slice etag, bool weak)
+{
+    char  *src = list.data;
+    size_t len = list.size;
+    size_t cur = 0;
+    for (;;) {
+
+        while (cur < len && (is_space(src[cur]) || src[cur] == ','))
+            cur++;
+
+        if (cur == len)
+            return false;
+
+        if (src[cur] == '*')
+            return true;
+
+        bool weak_tag = false;
+        if (cur+1 < len && src[cur] == 'W' && src[cur+1] == '/') {
+            weak_tag = true;
+            cur += 2;
+        }
+
+        if (cur == len || src[cur] != '"')
+            return false;
+        size_t start = cur;
+        cur++;
+        while (cur < len && src[cur] != '"')
+            cur++;
+        if (cur == len)
+            return false;
+        cur++;
+
+        if ((weak || !weak_tag)
+            && cur - start == etag.size
+            && !memcmp(src + start, etag.data, etag.size))
+            return true;
+    }
+}
+
+static bool parse_digits(char *src, size_t len, size_t *pcur, int num, int *out)
+{
+    int x = 0;
+    for (int i = 0; i < num; i++) {
+        if (*pcur == len || !is_digit(src[*pcur]))
+            return false;
+        x = x * 10 + (src[*pcur] - '0');
+        (*pcur)++;
+    }
+    *out = x;
+    return true;
+}
+
+static bool parse_char(char *src, size_t len, size_t *pcur, char c)
+{
+    if (*pcur == len || src[*pcur] != c)
+        return false;
+    (*pcur)++;
+    return true;
+}
+
+/*
+ * Parses a date in the preferred format of HTTP, such as
+ * "Sun, 06 Nov 1994 08:49:37 GMT", into seconds since the
+ * epoch. The obsolete formats aren't supported, which just
+ * makes conditional requests that use them unconditional.
+ */
+bool parse_http_date(struct slice s, int64_t *t)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    struct slice x = trim(s);
+    char  *src = x.data;
+    size_t len = x.size;
+    size_t cur = 0;
+
+    // The day of the week is implied by the date
+    if (len != 29 || src[3] != ',')
+        return false;
+    cur = 4;
+
+    int day, month, year, hour, min, sec;
+    if (!parse_char(src, len, &cur, ' ')
+        || !parse_digits(src, len, &cur, 2, &day)
+        || !parse_char(src, len, &cur, ' '))
+        return false;
+
+    for (month = 0; month < 12; month++)
+        if (!memcmp(src + cur, months + 3 * month, 3))
+            break;
+    if (month == 12)
+        return false;
+    cur += 3;
+
+    if (!parse_char(src, len, &cur, ' ')
+        || !parse_digits(src, len, &cur, 4, &year)
+        || !parse_char(src, len, &cur, ' ')
+        || !parse_digits(src, len, &cur, 2, &hour)
+        || !parse_char(src, len, &cur, ':')
+        || !parse_digits(src, len, &cur, 2, &min)
+        || !parse_char(src, len, &cur, ':')
+        || !parse_digits(src, len, &cur, 2, &sec)
+        || memcmp(src + cur, " GMT", 4))
+        return false;
+
+    if (day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+        return false;
+
+    // Days from the epoch to the civil date, counting
+    // years from March so that leap days come last.
+    int64_t y = year - (month < 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (month < 2 ? month + 10 : month - 2) + 2) / 5 + day - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = era * 146097 + doe - 719468;
+
+    *t = days * 86400 + hour * 3600 + min * 60 + sec;
+    return true;
+}
+
+/*
+ * Parses the value of a Range header against a resource
+ * of the given size. Ranges are clamped to the size and
+ * the ones that start past it are dropped. Returns the
+ * number of ranges that are left, or -1 if the header is
+ * invalid or asks for more than max ranges, in which case
+ * it should be ignored.
+ */
+int parse_byte_ranges(struct slice s, size_t size,
+                      struct byte_range *ranges, int max)
+{
+    char  *src = s.data;
+    size_t len = s.size;
+    size_t cur = 0;
+
+    while (cur < len && is_space(src[cur]))
+        cur++;
+
+    if (cur+5 >= len
+        || to_lower(src[cur+0]) != 'b'
+        || to_lower(src[cur+1]) != 'y'
+        || to_lower(src[cur+2]) != 't'
+        || to_lower(src[cur+3]) != 'e'
+        || to_lower(src[cur+4]) != 's'
+        || src[cur+5] != '=')
+        return -1;
+    cur += 6;
+
+    int num = 0;
+    int specs = 0;
+    for (;;) {
+
+        while (cur < len && (is_space(src[cur]) || src[cur] == ','))
+            cur++;
+
+        if (cur == len)
+            break;
+
+        bool   has_first = false;
+        size_t first = 0;
+        while (cur < len && is_digit(src[cur])) {
+            int d = src[cur] - '0';
+            if (first > (SIZE_MAX - d) / 10)
+                return -1;
+            first = first * 10 + d;
+            has_first = true;
+            cur++;
+        }
+
+        if (cur == len || src[cur] != '-')
+            return -1;
+        cur++;
+
+        bool   has_last = false;
+        size_t last = 0;
+        while (cur < len && is_digit(src[cur])) {
+            int d = src[cur] - '0';
+            if (last > (SIZE_MAX - d) / 10)
+                last = SIZE_MAX; // Clamped to the size anyway
+            else
+                last = last * 10 + d;
+            has_last = true;
+            cur++;
+        }
+
+        while (cur < len && is_space(src[cur]))
+            cur++;
+        if (cur < len && src[cur] != ',')
+            return -1;
+
+        if (!has_first && !has_last)
+            return -1;
+
+        if (has_first && has_last && last < first)
+            return -1;
+
+        if (++specs > max)
+            return -1;
+
+        size_t offset, length;
+        if (!has_first) {
+            // Suffix of the given length
+            if (last == 0 || size == 0)
+                continue;
+            if (last > size)
+                last = size;
+            offset = size - last;
+            length = last;
+        } else {
+            if (first >= size)
+                continue;
+            if (!has_last || last >= size)
+                last = size - 1;
+            offset = first;
+            length = last - first + 1;
+        }
+        ranges[num++] = (struct byte_range) {.offset=offset, .length=length};
+    }
+
+    if (specs == 0)
+        return -1;
+    return num;
+}
+
+static int hex_digit_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Parses a body with chunked transfer coding that starts
+ * at src. Returns P_INCOMPLETE if the last chunk wasn't
+ * received yet, else the number of bytes used by the
+ * encoded body is stored in raw_len and the length of
+ * the data it carries in content_len.
+ *
+ * If decode is set the chunk data is moved to the start
+ * of src, overwriting the chunk headers. Since that can't
+ * be undone, the body should be decoded only once it was
+ * checked to be complete.
+ *
+ * Chunk extensions and trailers are ignored.
+ */
+int parse_chunked_body(char *src, size_t len, bool decode,
+                       size_t *raw_len, size_t *content_len)
+{
+    size_t cur = 0;
+    size_t out = 0;
+    for (;;) {
+
+        if (cur == len)
+            return P_INCOMPLETE;
+
+        if (hex_digit_value(src[cur]) < 0)
+            return P_BADCHUNK;
+
+        size_t chunk_size = 0;
+        do {
+            int d = hex_digit_value(src[cur]);
+            if (chunk_size > (SIZE_MAX - d) / 16)
+                return P_BADCHUNK;
+            chunk_size = chunk_size * 16 + d;
+            cur++;
+        } while (cur < len && hex_digit_value(src[cur]) >= 0);
+
+        // Skip the extensions
+        while (cur < len && src[cur] != '\r')
+            cur++;
+
+        if (cur+1 >= len)
+            return P_INCOMPLETE;
+        if (src[cur+1] != '\n')
+            return P_BADCHUNK;
+        cur += 2;
+
+        if (chunk_size == 0)
+            break;
+
+        if (chunk_size > len - cur || len - cur - chunk_size < 2)
+            return P_INCOMPLETE;
+
+        if (src[cur + chunk_size] != '\r' || src[cur + chunk_size + 1] != '\n')
+            return P_BADCHUNK;
+
+        if (decode)
+            memmove(src + out, src + cur, chunk_size);
+        out += chunk_size;
+        cur += chunk_size + 2;
+    }
+
+    // Skip the trailer fields up to the empty line
+    for (;;) {
+        size_t start = cur;
+        while (cur < len && src[cur] != '\r')
+            cur++;
+        if (cur+1 >= len)
+            return P_INCOMPLETE;
+        if (src[cur+1] != '\n')
+            return P_BADCHUNK;
+        cur += 2;
+        if (cur - start == 2)
+            break;
+    }
+
+    *raw_len = cur;
+    *content_len = out;
+    return P_OK;
+}
@@ -1,6 +1,8 @@
 #ifndef PARSE_H
 #define PARSE_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include "../common/slice.h"
 
 enum method {
@@ -15,7 +17,36 @@ enum method {
     M_PATCH,
 };
 
+// Headers of a request after the first MAX_HEADERS are ignored
+#ifndef MAX_HEADERS
 #define MAX_HEADERS 32
+#endif
+
+// Headers that are classified while parsing, so that
+// looking them up doesn't need to go over all of them.
+enum known_header {
+    H_HOST,
+    H_CONTENT_LENGTH,
+    H_CONTENT_TYPE,
+    H_TRANSFER_ENCODING,
+    H_CONNECTION,
+    H_COOKIE,
+    H_ACCEPT,
+    H_ACCEPT_ENCODING,
+    H_ACCEPT_LANGUAGE,
+    H_USER_AGENT,
+    H_IF_NONE_MATCH,
+    H_IF_MODIFIED_SINCE,
+    H_IF_RANGE,
+    H_RANGE,
+    H_EXPECT,
+    H_UPGRADE,
+    H_AUTHORIZATION,
+    H_REFERER,
+    H_ORIGIN,
+    H_CACHE_CONTROL,
+    H_COUNT,
+};
 
 struct header {
     struct slice name;
@@ -29,6 +60,7 @@ struct request {
     int minor;
     int nhs;
     struct header hs[MAX_HEADERS];
+    uint16_t known[H_COUNT]; // Index+1 in hs of the first header of each kind, or 0
     struct slice content;
 };
 
@@ -38,6 +70,7 @@ enum {
     P_BADMETHOD,
     P_BADVERSION,
     P_BADHEADER,
+    P_BADCHUNK,
 };
 
 enum {
@@ -47,11 +80,24 @@ enum {
     T_GZIP     = 1 << 3,
 };
 
+struct byte_range {
+    size_t offset;
+    size_t length;
+};
+
+size_t find_head_end(const char *src, size_t len, size_t from);
 int parse_request_head(char *src, size_t len, struct request *r);
+int  classify_header(struct slice name);
+bool find_known_header(struct request *r, enum known_header h, struct slice *value);
 bool match_header_name(struct slice s1, char *s2);
 bool match_header_value(struct slice s1, char *s2);
 size_t find_and_parse_content_length(struct request *r);
 int    find_and_parse_transfer_encoding(struct request *r);
+int    find_and_parse_accept_encoding(struct request *r);
 size_t parse_content_length(struct slice s);
+bool   match_etag_list(struct slice list, struct slice etag, bool weak);
+bool   parse_http_date(struct slice s, int64_t *t);
+int    parse_byte_ranges(struct slice s, size_t size, struct byte_range *ranges, int max);
 bool find_header(struct request *r, char *name, struct slice *value);
+int  parse_chunked_body(char *src, size_t len, bool decode, size_t *raw_len, size_t *content_len);
 #endif /* PARSE_H */
\ No newline at end of file
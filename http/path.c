@@ -171,7 +171,7 @@ int match_path_format(struct slice path, char *fmt, ...)
             if (f_stack[i].size != p_stack[i].size)
                 return 1; // No match
             if (memcmp(f_stack[i].data, p_stack[i].data, f_stack[i].size))
-                return false;
+                return 1; // No match
         }
     }
 
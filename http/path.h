@@ -2,8 +2,13 @@
 #define COZISBLOG_PATH_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include "../common/slice.h"
 
+int split_path_components(char *src, size_t len,
+                          struct slice *stack,
+                          int limit, bool allow_ddots);
+
 size_t sanitize_path(char *src, size_t len,
                      char *mem, size_t max);
 
@@ -3,6 +3,44 @@
 #include <assert.h>
 #include "query_string.h"
 
+// Plain bytes of keys and values are skipped SIMD_WIDTH at a
+// time, with the same instruction sets as the scans in parse.c.
+#if defined(__AVX2__) && !defined(HTTP_NO_SIMD)
+#include <immintrin.h>
+#define SIMD_WIDTH 32
+#elif defined(__SSE2__) && !defined(HTTP_NO_SIMD)
+#include <emmintrin.h>
+#define SIMD_WIDTH 16
+#endif
+
+#ifdef SIMD_WIDTH
+// Bit i is set if src[i] isn't a plain byte: a separator, the
+// start of an encoded byte or a non-printable byte. Bytes are
+// compared as signed, so the ones above 127 are below 32 too.
+static inline uint32_t match_special(const char *src)
+{
+#if SIMD_WIDTH == 32
+    __m256i v = _mm256_loadu_si256((const __m256i*) src);
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127)));
+    m = _mm256_or_si256(m, _mm256_cmpgt_epi8(_mm256_set1_epi8(32), v));
+    return (uint32_t) _mm256_movemask_epi8(m);
+#else
+    __m128i v = _mm_loadu_si128((const __m128i*) src);
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('=')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('+')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(127)));
+    m = _mm_or_si128(m, _mm_cmplt_epi8(v, _mm_set1_epi8(32)));
+    return (uint32_t) _mm_movemask_epi8(m);
+#endif
+}
+#endif
+
 bool is_print(char c)
 {
     return c >= 32 && c < 127;
@@ -11,8 +49,8 @@ bool is_print(char c)
 bool hex_to_num(char x, int *n)
 {
     // TODO: This is inefficient
-    if      (x >= 'A' && x <= 'F') *n = x - 'A';
-    else if (x >= 'a' && x <= 'f') *n = x - 'a';
+    if      (x >= 'A' && x <= 'F') *n = x - 'A' + 10;
+    else if (x >= 'a' && x <= 'f') *n = x - 'a' + 10;
     else if (x >= '0' && x <= '9') *n = x - '0';
     else return false;
     return true;
@@ -20,6 +58,14 @@ bool hex_to_num(char x, int *n)
 
 size_t skip_any_valid_chars_not_percent_encoded(char *src, size_t len, size_t cur)
 {
+#ifdef SIMD_WIDTH
+    while (cur + SIMD_WIDTH <= len) {
+        uint32_t m = match_special(src + cur);
+        if (m)
+            return cur + __builtin_ctz(m);
+        cur += SIMD_WIDTH;
+    }
+#endif
     while (cur < len
         && src[cur] != '=' // Start of the value
         && src[cur] != '&' // End of the parameter (no value)
@@ -83,7 +129,7 @@ bool parse_percent_encoded_substr(char *src, size_t len,
         // Copy what was already scanned into the
         // output buffer.
         if (out->size > max)
-            return -1; // Output buffer is too small
+            return false; // Output buffer is too small
         memcpy(dst, out->data, out->size);
 
         size_t copied = out->size;
@@ -181,4 +227,179 @@ bool get_query_string_param(char *src, size_t src_len, char *key, char *dst, siz
         cur++; // &
     }
     return false;
-}
\ No newline at end of file
+}
+
+/*
+ * Scans a key or a value up to a separator or an invalid
+ * character, noting if it needs to be decoded. Returns false
+ * if it contains an invalid percent encoding.
+ */
+static bool scan_param_part(char *src, size_t len, size_t *cur,
+                            struct slice *out, bool *encoded)
+{
+    size_t start = *cur;
+    size_t end = skip_any_valid_chars_not_percent_encoded(src, len, start);
+    *encoded = end < len && (src[end] == '%' || src[end] == '+');
+    if (*encoded && !skip_percent_encoded_substr(src, len, &end))
+        return false;
+    out->data = src + start;
+    out->size = end - start;
+    *cur = end;
+    return true;
+}
+
+// Returns the byte at *i of a slice that was validated while
+// indexing, decoding it if necessary, and moves past it.
+static char next_byte(struct slice s, bool encoded, size_t *i)
+{
+    char c = s.data[*i];
+    if (!encoded || (c != '%' && c != '+')) {
+        (*i)++;
+        return c;
+    }
+    if (c == '+') {
+        (*i)++;
+        return ' ';
+    }
+    int u = 0, v = 0;
+    hex_to_num(s.data[*i+1], &u);
+    hex_to_num(s.data[*i+2], &v);
+    *i += 3;
+    return (char) ((u << 4) | v);
+}
+
+// FNV-1a of the decoded bytes
+static uint32_t hash_decoded(struct slice s, bool encoded)
+{
+    uint32_t h = 2166136261u;
+    size_t i = 0;
+    while (i < s.size)
+        h = (h ^ (uint8_t) next_byte(s, encoded, &i)) * 16777619u;
+    return h;
+}
+
+static bool equal_decoded(struct slice a, bool a_encoded,
+                          struct slice b, bool b_encoded)
+{
+    if (!a_encoded && !b_encoded)
+        return a.size == b.size && !memcmp(a.data, b.data, a.size);
+
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a.size && j < b.size)
+        if (next_byte(a, a_encoded, &i) != next_byte(b, b_encoded, &j))
+            return false;
+    return i == a.size && j == b.size;
+}
+
+void reset_param_index(struct param_index *idx)
+{
+    idx->count = 0;
+    memset(idx->slots, 0, sizeof(idx->slots));
+}
+
+/*
+ * Adds a parameter to the index unless one with the same
+ * key was already added, in which case the first one is
+ * kept like get_query_string_param would find it. Returns
+ * false if the index is full.
+ */
+bool add_param(struct param_index *idx, struct param p)
+{
+    p.hash = hash_decoded(p.key, p.key_encoded);
+
+    uint32_t mask = PARAM_INDEX_SLOTS - 1;
+    uint32_t i = p.hash & mask;
+    while (idx->slots[i]) {
+        struct param *q = &idx->params[idx->slots[i]-1];
+        if (q->hash == p.hash && equal_decoded(q->key, q->key_encoded, p.key, p.key_encoded))
+            return true;
+        i = (i + 1) & mask;
+    }
+
+    if (idx->count == PARAM_INDEX_MAX)
+        return false;
+    idx->params[idx->count++] = p;
+    idx->slots[i] = idx->count;
+    return true;
+}
+
+/*
+ * Looks up the value of a key in the index. Values that
+ * need decoding are decoded into dst, the others are
+ * returned as they are in the source. Returns false if
+ * the key isn't there or dst is too small.
+ */
+bool find_param(struct param_index *idx, char *key, char *dst, size_t max, struct slice *out)
+{
+    struct slice k = {.data=key, .size=strlen(key)};
+    uint32_t h = hash_decoded(k, false);
+
+    uint32_t mask = PARAM_INDEX_SLOTS - 1;
+    for (uint32_t i = h & mask; idx->slots[i]; i = (i + 1) & mask) {
+        struct param *p = &idx->params[idx->slots[i]-1];
+        if (p->hash != h || !equal_decoded(p->key, p->key_encoded, k, false))
+            continue;
+
+        if (!p->value_encoded) {
+            *out = p->value;
+            return true;
+        }
+
+        size_t n = 0;
+        size_t j = 0;
+        while (j < p->value.size) {
+            if (n == max)
+                return false; // Output buffer is too small
+            dst[n++] = next_byte(p->value, true, &j);
+        }
+        out->data = dst;
+        out->size = n;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Splits a query string into the index so that any number
+ * of parameters can be looked up without scanning it again.
+ * The syntax is the one accepted by get_query_string_param.
+ * Returns false if the query string is invalid or has more
+ * than PARAM_INDEX_MAX distinct keys.
+ */
+bool index_query_string(char *src, size_t len, struct param_index *idx)
+{
+    reset_param_index(idx);
+
+    if (src == NULL)
+        return true;
+
+    size_t cur = 0;
+    if (cur < len && src[cur] == '?')
+        cur++;
+
+    while (cur < len) {
+
+        struct param p;
+        if (!scan_param_part(src, len, &cur, &p.key, &p.key_encoded))
+            return false;
+
+        if (cur < len && src[cur] == '=') {
+            cur++; // =
+            if (!scan_param_part(src, len, &cur, &p.value, &p.value_encoded))
+                return false;
+        } else {
+            p.value.data = "";
+            p.value.size = 0;
+            p.value_encoded = false;
+        }
+
+        if (cur < len && src[cur] != '&')
+            return false; // Invalid query string
+        cur++; // &
+
+        if (!add_param(idx, p))
+            return false;
+    }
+    return true;
+}
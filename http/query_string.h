@@ -1,5 +1,49 @@
+#ifndef QUERY_STRING_H
+#define QUERY_STRING_H
+
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include "../common/slice.h"
 
-bool get_query_string_param(char *src, size_t src_len, char *key, char *dst, size_t max, struct slice *out);
\ No newline at end of file
+// Parameters of an index, and slots of its hash table
+// (a power of two larger than the parameters).
+#ifndef PARAM_INDEX_MAX
+#define PARAM_INDEX_MAX 64
+#endif
+
+#ifndef PARAM_INDEX_SLOTS
+#define PARAM_INDEX_SLOTS 128
+#endif
+
+struct param {
+    struct slice key;   // As found in the source
+    struct slice value; // As found in the source, empty if there was none
+    bool key_encoded;   // The slice contains %xx or +
+    bool value_encoded;
+    uint32_t hash;      // Of the decoded key
+};
+
+/*
+ * Parameters of a query string or a Cookie header, split
+ * in one pass. The slices refer to the source, which must
+ * outlive the index. Encoded keys and values are decoded
+ * only when they are looked up.
+ */
+struct param_index {
+    int count;
+    struct param params[PARAM_INDEX_MAX];
+    uint8_t slots[PARAM_INDEX_SLOTS]; // Index+1 in params, or 0
+};
+
+// The table never fills up and its slots fit the indices
+_Static_assert(PARAM_INDEX_MAX < PARAM_INDEX_SLOTS && PARAM_INDEX_MAX < 256);
+
+bool get_query_string_param(char *src, size_t src_len, char *key, char *dst, size_t max, struct slice *out);
+
+void reset_param_index(struct param_index *idx);
+bool add_param(struct param_index *idx, struct param p);
+bool find_param(struct param_index *idx, char *key, char *dst, size_t max, struct slice *out);
+bool index_query_string(char *src, size_t len, struct param_index *idx);
+
+#endif /* QUERY_STRING_H */
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include "path.h"
+#include "router.h"
+
+struct route_edge {
+    char  *label; // Owned copy of the component
+    size_t size;
+    int    node;
+};
+
+struct route_node {
+    struct route_edge *edges; // Literal components, sorted by size then bytes
+    int num_edges;
+    int number_child; // Index of the :n child, or -1
+    int label_child;  // Index of the :l child, or -1
+    int route;        // Route ending here, or -1
+};
+
+bool router_init(struct router *rt)
+{
+    rt->max_nodes = 16;
+    rt->nodes = malloc(rt->max_nodes * sizeof(struct route_node));
+    if (rt->nodes == NULL)
+        return false;
+
+    rt->nodes[0] = (struct route_node) {
+        .edges = NULL,
+        .num_edges = 0,
+        .number_child = -1,
+        .label_child = -1,
+        .route = -1,
+    };
+    rt->num_nodes = 1;
+    return true;
+}
+
+void router_free(struct router *rt)
+{
+    for (int i = 0; i < rt->num_nodes; i++) {
+        struct route_node *n = &rt->nodes[i];
+        for (int j = 0; j < n->num_edges; j++)
+            free(n->edges[j].label);
+        free(n->edges);
+    }
+    free(rt->nodes);
+    rt->nodes = NULL;
+}
+
+static int compare_label(struct route_edge *e, struct slice s)
+{
+    if (e->size != s.size)
+        return e->size < s.size ? -1 : 1;
+    return memcmp(e->label, s.data, s.size);
+}
+
+/*
+ * Binary search of the literal component among the edges
+ * of a node. Returns the index of its edge, or the one it
+ * would need to be inserted at as -(i+1).
+ */
+static int find_edge(struct route_node *n, struct slice comp)
+{
+    int lo = 0;
+    int hi = n->num_edges;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = compare_label(&n->edges[mid], comp);
+        if (c == 0)
+            return mid;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -(lo + 1);
+}
+
+// Returns the index of a new node, or -1
+static int alloc_node(struct router *rt)
+{
+    if (rt->num_nodes == rt->max_nodes) {
+        int new_max = 2 * rt->max_nodes;
+        struct route_node *new_nodes = realloc(rt->nodes, new_max * sizeof(struct route_node));
+        if (new_nodes == NULL)
+            return -1;
+        rt->nodes = new_nodes;
+        rt->max_nodes = new_max;
+    }
+    int i = rt->num_nodes++;
+    rt->nodes[i] = (struct route_node) {
+        .edges = NULL,
+        .num_edges = 0,
+        .number_child = -1,
+        .label_child = -1,
+        .route = -1,
+    };
+    return i;
+}
+
+// Returns the child of the node for a literal component,
+// adding it if it doesn't exist, or -1 if out of memory.
+static int literal_child(struct router *rt, int node, struct slice comp)
+{
+    int i = find_edge(&rt->nodes[node], comp);
+    if (i >= 0)
+        return rt->nodes[node].edges[i].node;
+    i = -(i + 1);
+
+    char *label = malloc(comp.size);
+    if (label == NULL)
+        return -1;
+    memcpy(label, comp.data, comp.size);
+
+    int child = alloc_node(rt);
+    if (child < 0) {
+        free(label);
+        return -1;
+    }
+
+    // The node array may have moved
+    struct route_node *n = &rt->nodes[node];
+    struct route_edge *new_edges = realloc(n->edges, (n->num_edges + 1) * sizeof(struct route_edge));
+    if (new_edges == NULL) {
+        free(label);
+        rt->num_nodes--;
+        return -1;
+    }
+    n->edges = new_edges;
+    memmove(n->edges + i + 1, n->edges + i, (n->num_edges - i) * sizeof(struct route_edge));
+    n->edges[i] = (struct route_edge) {.label=label, .size=comp.size, .node=child};
+    n->num_edges++;
+    return child;
+}
+
+static int capture_child(struct router *rt, int node, bool number)
+{
+    int child = number ? rt->nodes[node].number_child : rt->nodes[node].label_child;
+    if (child >= 0)
+        return child;
+
+    child = alloc_node(rt);
+    if (child < 0)
+        return -1;
+
+    if (number)
+        rt->nodes[node].number_child = child;
+    else
+        rt->nodes[node].label_child = child;
+    return child;
+}
+
+/*
+ * Adds a path format with the same syntax as the ones of
+ * match_path_format. Paths that match it are reported with
+ * the given route, which must not be negative. Returns false
+ * if the format is invalid, was already added or there is no
+ * memory.
+ */
+bool router_add(struct router *rt, char *fmt, int route)
+{
+    if (route < 0)
+        return false;
+
+    struct slice comps[ROUTER_MAX_DEPTH];
+    int depth = split_path_components(fmt, strlen(fmt), comps, ROUTER_MAX_DEPTH, true);
+    if (depth < 0)
+        return false;
+
+    int node = 0;
+    int num_captures = 0;
+    for (int i = 0; i < depth; i++) {
+        struct slice comp = comps[i];
+        if (comp.data[0] == ':') {
+            if (comp.size != 2 || (comp.data[1] != 'l' && comp.data[1] != 'n'))
+                return false;
+            if (num_captures == ROUTER_MAX_CAPTURES)
+                return false;
+            num_captures++;
+            node = capture_child(rt, node, comp.data[1] == 'n');
+        } else {
+            if (memchr(comp.data, ':', comp.size))
+                return false;
+            node = literal_child(rt, node, comp);
+        }
+        if (node < 0)
+            return false;
+    }
+
+    if (rt->nodes[node].route >= 0)
+        return false;
+    rt->nodes[node].route = route;
+    return true;
+}
+
+static bool parse_number(struct slice s, uint32_t *out)
+{
+    uint32_t n = 0;
+    for (size_t i = 0; i < s.size; i++) {
+        char c = s.data[i];
+        if (c < '0' || c > '9')
+            return false;
+        int d = c - '0';
+        if (n > (UINT32_MAX - d) / 10)
+            return false;
+        n = n * 10 + d;
+    }
+    *out = n;
+    return true;
+}
+
+/*
+ * Matches the components from i on against the subtree of
+ * the node. When a more specific branch doesn't lead to a
+ * route the next one is tried, which only happens when the
+ * same component is both a literal and a capture in the
+ * routes. Captures made along failed branches are simply
+ * overwritten.
+ */
+static bool match_node(struct router *rt, int node,
+                       struct slice *comps, int depth, int i,
+                       struct route_match *m, int num_captures)
+{
+    struct route_node *n = &rt->nodes[node];
+
+    if (i == depth) {
+        if (n->route < 0)
+            return false;
+        m->route = n->route;
+        m->num_captures = num_captures;
+        return true;
+    }
+    struct slice comp = comps[i];
+
+    if (n->num_edges > 0) {
+        int e = find_edge(n, comp);
+        if (e >= 0 && match_node(rt, n->edges[e].node, comps, depth, i+1, m, num_captures))
+            return true;
+    }
+
+    uint32_t number;
+    if (n->number_child >= 0 && parse_number(comp, &number)) {
+        m->captures[num_captures] = (struct route_capture) {.type=ROUTE_NUMBER, .text=comp, .number=number};
+        if (match_node(rt, n->number_child, comps, depth, i+1, m, num_captures+1))
+            return true;
+    }
+
+    if (n->label_child >= 0) {
+        m->captures[num_captures] = (struct route_capture) {.type=ROUTE_LABEL, .text=comp, .number=0};
+        if (match_node(rt, n->label_child, comps, depth, i+1, m, num_captures+1))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Finds the route of a request path. The query string, if
+ * the path has one, isn't considered. Returns false if no
+ * route matches or the path is invalid.
+ */
+bool router_match(struct router *rt, struct slice path, struct route_match *m)
+{
+    char *query = memchr(path.data, '?', path.size);
+    if (query)
+        path.size = query - path.data;
+
+    struct slice comps[ROUTER_MAX_DEPTH];
+    int depth = split_path_components(path.data, path.size, comps, ROUTER_MAX_DEPTH, false);
+    if (depth < 0)
+        return false;
+
+    return match_node(rt, 0, comps, depth, 0, m, 0);
+}
@@ -0,0 +1,54 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../common/slice.h"
+
+// Components of a route and captures of a match
+#ifndef ROUTER_MAX_DEPTH
+#define ROUTER_MAX_DEPTH 32
+#endif
+
+#ifndef ROUTER_MAX_CAPTURES
+#define ROUTER_MAX_CAPTURES 8
+#endif
+
+enum {
+    ROUTE_LABEL,  // :l captures any component
+    ROUTE_NUMBER, // :n captures a component made of digits
+};
+
+struct route_capture {
+    int          type;   // ROUTE_*
+    struct slice text;   // The component in the path
+    uint32_t     number; // Only for ROUTE_NUMBER
+};
+
+struct route_match {
+    int route; // As given to router_add
+    int num_captures;
+    struct route_capture captures[ROUTER_MAX_CAPTURES]; // In order of the path
+};
+
+struct route_node;
+
+/*
+ * Set of path formats, in the syntax of match_path_format,
+ * compiled into a tree of path components. A request path
+ * is matched against all of them in one walk of the tree.
+ * Literal components take precedence over :n, which takes
+ * precedence over :l.
+ */
+struct router {
+    struct route_node *nodes; // The first one is the root
+    int num_nodes;
+    int max_nodes;
+};
+
+bool router_init(struct router *rt);
+void router_free(struct router *rt);
+bool router_add(struct router *rt, char *fmt, int route);
+bool router_match(struct router *rt, struct slice path, struct route_match *m);
+
+#endif /* ROUTER_H */
@@ -6,11 +6,18 @@
 #include <assert.h>
 #include <dirent.h>
 #include <stdlib.h> 
+#include <time.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include "../http/path.h"
+#include "../thread/thread.h"
 #include "smu.h"
 #include "send_static.h"
 
+#ifdef HTTP_ZLIB
+#include <zlib.h>
+#endif
+
 struct {
     char *mime;
     char *ext;
@@ -60,8 +67,29 @@ char *mimetype_from_filename(char *name)
     return NULL;
 }
 
+/*
+ * Types that are worth compressing. Sending them to clients
+ * that accept gzip or deflate is what makes responses vary
+ * on Accept-Encoding.
+ */
+static bool is_compressible(char *mime)
+{
+    if (mime == NULL)
+        return false;
+    return !strncmp(mime, "text/", 5)
+        || !strcmp(mime, "application/json")
+        || !strcmp(mime, "application/xml")
+        || !strcmp(mime, "image/svg+xml");
+}
+
 static bool send_dir_listing(struct server *s, uint32_t h,
                              char *dir, char *prefix, struct slice path);
+static bool send_file_ex(struct server *s, uint32_t handle,
+                         char *file, char *mime, struct request *r);
+static bool send_file_cached_ex(struct static_cache *cache, struct server *s,
+                                uint32_t handle, char *file, char *mime, struct request *r);
+static bool send_file_md_cached_ex(struct static_cache *cache, struct server *s,
+                                   uint32_t handle, char *file, struct request *r);
 
 /*
  * The prefix must start with / and end without it.
@@ -73,6 +101,31 @@ bool serve_static_dir(char *dir,
                       uint32_t handle,
                       bool dir_listing,
                       bool convert_md)
+{
+    return serve_static_dir_ex(dir, prefix, s, r, handle, dir_listing, convert_md, NULL);
+}
+
+/*
+ * Like serve_static_dir but files are served through
+ * the cache, if one is given.
+ *
+ * Clients that accept gzip get the precompressed sibling
+ * of a file (name.gz) when there is one. With the cache,
+ * files are otherwise compressed the first time they're
+ * requested and the result is cached (with HTTP_ZLIB).
+ *
+ * Files are sent with an ETag and a Last-Modified date,
+ * and conditional and Range requests are answered with
+ * 304 and 206 responses.
+ */
+bool serve_static_dir_ex(char *dir,
+                         char *prefix,
+                         struct server *s,
+                         struct request *r,
+                         uint32_t handle,
+                         bool dir_listing,
+                         bool convert_md,
+                         struct static_cache *cache)
 {
     assert(dir);
 
@@ -101,8 +154,8 @@ bool serve_static_dir(char *dir,
 
     char tmp[1<<10];
     if (tmp_len >= sizeof(tmp)) {
-        set_status(s, handle, 500);
-        send_response(s, handle);
+        http_server_set_status(s, handle, 500);
+        http_server_send_response(s, handle);
         return true;
     }
     if (dir)
@@ -110,7 +163,9 @@ bool serve_static_dir(char *dir,
     memcpy(tmp + dir_len, path.data, path.size);
     tmp[tmp_len] = '\0';
 
+#ifdef HTTP_DEBUG
     fprintf(stderr, "tmp=%s\n", tmp);
+#endif
 
     bool replied;
     if (convert_md
@@ -118,16 +173,18 @@ bool serve_static_dir(char *dir,
         && tmp[tmp_len-3] == '.'
         && tmp[tmp_len-2] == 'm'
         && tmp[tmp_len-1] == 'd')
-        replied = send_file_md(s, handle, tmp);
+        replied = cache ? send_file_md_cached_ex(cache, s, handle, tmp, r) : send_file_md(s, handle, tmp);
+    else if (cache)
+        replied = send_file_cached_ex(cache, s, handle, tmp, NULL, r);
     else
-        replied = send_file(s, handle, tmp, NULL);
+        replied = send_file_ex(s, handle, tmp, NULL, r);
 
     if (!replied && dir_listing)
         replied = send_dir_listing(s, handle, dir, prefix, path);
     
     if (!replied) {
-        set_status(s, handle, 404);
-        send_response(s, handle);
+        http_server_set_status(s, handle, 404);
+        http_server_send_response(s, handle);
     }
 
     return true;
@@ -149,13 +206,13 @@ struct markup {
 static void outcb(void *userp, const char *str, size_t len)
 {
     struct markup *mu = userp;
-    append_content(mu->s, mu->h, (char*) str, len);
+    http_server_append_content(mu->s, mu->h, (char*) str, len);
 }
 
 static void outvacb(void *userp, const char *fmt, va_list args)
 {
     struct markup *mu = userp;
-    append_content_format_2(mu->s, mu->h, fmt, args);
+    http_server_append_content_format_2(mu->s, mu->h, fmt, args);
 }
 
 void append_markup_as_html(struct server *s, uint32_t h, const char *str, size_t len, bool nohtml)
@@ -175,6 +232,47 @@ void append_markup_as_html(struct server *s, uint32_t h, const char *str, size_t
     if (!ok) fprintf(stderr, "Error: %s\n", msg);
 }
 
+/*
+ * Reads the rest of the file into a new buffer.
+ */
+static char *read_file(int fd, size_t *psize)
+{
+    size_t size = 0;
+    size_t capacity = 1<<10;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL)
+        return NULL;
+
+    for (;;) {
+
+        if (size == capacity) {
+            size_t new_capacity = 2 * capacity;
+            char *temp = realloc(buffer, new_capacity);
+            if (temp == NULL) {
+                free(buffer);
+                return NULL;
+            }
+            buffer = temp;
+            capacity = new_capacity;
+        }
+
+        int num = read(fd, buffer + size, capacity - size);
+        if (num < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buffer);
+            return NULL;
+        }
+        if (num == 0)
+            break;
+
+        size += num;
+    }
+
+    *psize = size;
+    return buffer;
+}
+
 bool send_file_md(struct server *s,
                   uint32_t handle,
                   char *file)
@@ -187,92 +285,1362 @@ bool send_file_md(struct server *s,
     if (fd < 0) {
         if (errno == ENOENT)
             return false;
-        set_status(s, handle, 500);
+        http_server_set_status(s, handle, 500);
     } else {
         if (!is_file(fd)) {
             close(fd);
             return false;
         }
-        
-        bool fail = false;
-        size_t size = 0;
-        size_t capacity = 1<<10;
-        char *buffer = malloc(capacity);
-        if (buffer) for (;;) {
-
-            if (size == capacity) {
-                size_t new_capacity = 2 * capacity;
-                char *temp = realloc(buffer, new_capacity);
-                if (temp == NULL) {
-                    fail = true;
-                    break;
-                }
-            }
-
-            int num = read(fd, buffer + size, capacity - size);
-            if (num < 0) {
-                fail = true;
-                break;
-            }
-            if (num == 0)
-                break;
 
-            size += num;
-        }
+        size_t size;
+        char *buffer = read_file(fd, &size);
         close(fd);
 
-        if (fail) {
-            set_status(s, handle, 500);
+        if (buffer == NULL) {
+            http_server_set_status(s, handle, 500);
         } else {
-            set_status(s, handle, 200);
-            append_header(s, handle, "Content-Type: text/html");
+            http_server_set_status(s, handle, 200);
+            http_server_append_header(s, handle, "Content-Type: text/html");
             append_markup_as_html(s, handle, buffer, size, 0);
         }
         free(buffer);
     }
-    send_response(s, handle);
+    http_server_send_response(s, handle);
     return true;
 }
 
-bool send_file(struct server *s,
-               uint32_t handle,
-               char *file,
-               char *mime)
+/*
+ * Opens a file to be served. Returns -1 and sets
+ * errno if it can't be opened or isn't a regular file.
+ */
+static int open_regular_file(char *file, struct stat *buf)
 {
     int fd;
     do
         fd = open(file, O_RDONLY);
     while (fd < 0 && errno == EINTR);
 
-    if (fd < 0) {
-        if (errno == ENOENT)
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, buf) || !S_ISREG(buf->st_mode)) {
+        close(fd);
+        errno = ENOENT;
+        return -1;
+    }
+    return fd;
+}
+
+static bool read_whole(int fd, char *dst, size_t size, off_t offset)
+{
+    size_t copied = 0;
+    while (copied < size) {
+        ssize_t n = pread(fd, dst + copied, size - copied, offset + copied);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
             return false;
-        set_status(s, handle, 500);
+        copied += n;
+    }
+    return true;
+}
+
+/*
+ * Opens the precompressed sibling of a file (name.gz). It's
+ * not used if it's older than the file, as it was probably
+ * left behind when the file changed. Returns -1 if there's
+ * no usable sibling.
+ */
+static int open_gzip_sibling(char *file, size_t len,
+                             struct timespec mtime,
+                             struct stat *buf)
+{
+    char gz[1<<10];
+    if (len + 3 >= sizeof(gz))
+        return -1;
+    memcpy(gz, file, len);
+    memcpy(gz + len, ".gz", 4);
+
+    int fd = open_regular_file(gz, buf);
+    if (fd < 0)
+        return -1;
+
+    if (buf->st_mtim.tv_sec < mtime.tv_sec
+        || (buf->st_mtim.tv_sec == mtime.tv_sec && buf->st_mtim.tv_nsec < mtime.tv_nsec)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Returns the encodings (T_GZIP and T_DEFLATE) that the
+ * file can be sent in. Parts of a file are always sent
+ * as they are, so requests for ranges get no encoding.
+ */
+static int accepted_encodings(struct request *r)
+{
+    struct slice range;
+    if (r == NULL || (r->m == M_GET && find_known_header(r, H_RANGE, &range)))
+        return 0;
+    return find_and_parse_accept_encoding(r);
+}
+
+// Gzip is preferred when both are accepted
+static int preferred_encoding(int encodings)
+{
+    if (encodings & T_GZIP)
+        return T_GZIP;
+    return encodings & T_DEFLATE;
+}
+
+// Names are spelled out since they don't depend on the locale
+static void format_http_date(time_t t, char *dst, size_t max)
+{
+    static const char *days[]   = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(dst, max, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+             days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+             tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/*
+ * Formats the header lines that are sent with 304 responses
+ * as well: ETag, Last-Modified and Vary if the response
+ * depends on the encodings accepted by the client. The tag
+ * changes with the file's mtime and size and tells the
+ * encodings apart, since each one is a different sequence
+ * of bytes. Returns the length, or -1 if it doesn't fit.
+ */
+static int format_validators(char *dst, size_t max,
+                             struct timespec mtime, off_t size,
+                             int encoding, bool vary)
+{
+    char *suffix = "";
+    if (encoding == T_GZIP)    suffix = "-gzip";
+    if (encoding == T_DEFLATE) suffix = "-deflate";
+
+    char date[32];
+    format_http_date(mtime.tv_sec, date, sizeof(date));
+
+    int n = snprintf(dst, max, "ETag: \"%llx.%lx-%llx%s\"\r\nLast-Modified: %s\r\n%s",
+                     (unsigned long long) mtime.tv_sec, (long) mtime.tv_nsec,
+                     (unsigned long long) size, suffix, date,
+                     vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (n < 0 || (size_t) n >= max)
+        return -1;
+    return n;
+}
+
+// The tag in lines made by format_validators, with its quotes
+static struct slice validators_etag(char *validators, size_t len)
+{
+    char *tag = validators + sizeof("ETag: ")-1;
+    char *end = memchr(tag, '\r', validators + len - tag);
+    return (struct slice) {.data=tag, .size=end - tag};
+}
+
+/*
+ * Returns whether the client's copy of the file is current
+ * according to the request's If-None-Match, or else its
+ * If-Modified-Since. Only GET and HEAD are conditional.
+ */
+static bool is_not_modified(struct request *r,
+                            struct slice etag,
+                            struct timespec mtime)
+{
+    if (r == NULL || (r->m != M_GET && r->m != M_HEAD))
+        return false;
+
+    struct slice value;
+    if (find_known_header(r, H_IF_NONE_MATCH, &value))
+        return match_etag_list(value, etag, true);
+
+    int64_t since;
+    if (find_known_header(r, H_IF_MODIFIED_SINCE, &value) && parse_http_date(value, &since))
+        return mtime.tv_sec <= since;
+
+    return false;
+}
+
+/*
+ * Returns the number of ranges of the file that the request
+ * asks for, 0 if none of them can be satisfied, or -1 if the
+ * whole file should be sent. That's also the case when the
+ * If-Range header names another version of the file.
+ */
+static int requested_ranges(struct request *r,
+                            struct slice etag,
+                            struct timespec mtime,
+                            size_t size,
+                            struct byte_range *ranges)
+{
+    struct slice value;
+    if (r == NULL || r->m != M_GET || !find_known_header(r, H_RANGE, &value))
+        return -1;
+
+    // If-Range has either a tag or a date
+    struct slice cond;
+    if (find_known_header(r, H_IF_RANGE, &cond)) {
+        int64_t date;
+        if (memchr(cond.data, '"', cond.size)) {
+            if (!match_etag_list(cond, etag, false))
+                return -1;
+        } else if (!parse_http_date(cond, &date) || date != mtime.tv_sec)
+            return -1;
+    }
+
+    return parse_byte_ranges(value, size, ranges, STATIC_MAX_RANGES);
+}
+
+static void send_not_modified(struct server *s, uint32_t handle,
+                              char *validators, size_t len)
+{
+    http_server_set_status(s, handle, 304);
+    http_server_append_headers(s, handle, validators, len);
+    http_server_send_response(s, handle);
+}
+
+static void send_range_not_satisfiable(struct server *s, uint32_t handle,
+                                       size_t size)
+{
+    http_server_set_status(s, handle, 416);
+    http_server_append_header_format(s, handle, "Content-Range: bytes */%zu", size);
+    http_server_send_response(s, handle);
+}
+
+// The boundary only needs to be absent from the parts
+static void format_boundary(char *dst, size_t max, struct slice etag)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < etag.size; i++) {
+        h ^= (unsigned char) etag.data[i];
+        h *= 1099511628211ULL;
+    }
+    snprintf(dst, max, "%016llx", (unsigned long long) h);
+}
+
+static void append_part_header(struct server *s, uint32_t handle,
+                               char *boundary, char *mime,
+                               struct byte_range range, size_t size)
+{
+    http_server_append_content_format(s, handle, "\r\n--%s\r\n", boundary);
+    if (mime) http_server_append_content_format(s, handle, "Content-Type: %s\r\n", mime);
+    http_server_append_content_format(s, handle, "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                                      range.offset, range.offset + range.length - 1, size);
+}
+
+/*
+ * Sends multiple ranges of a file that isn't cached. They
+ * are read before the response is started so that a read
+ * error can still be reported. Returns false if the ranges
+ * are too big to be read into memory.
+ */
+static bool send_file_ranges(struct server *s, uint32_t handle,
+                             int fd, struct stat *buf, char *mime,
+                             char *validators, size_t validators_len,
+                             struct byte_range *ranges, int num_ranges)
+{
+    size_t total = 0;
+    for (int i = 0; i < num_ranges; i++)
+        total += ranges[i].length;
+    if (total > STATIC_MAX_RANGE_COPY)
+        return false;
+
+    char *data = malloc(total);
+    if (data == NULL)
+        return false;
+
+    size_t copied = 0;
+    for (int i = 0; i < num_ranges; i++) {
+        if (!read_whole(fd, data + copied, ranges[i].length, ranges[i].offset)) {
+            free(data);
+            http_server_set_status(s, handle, 500);
+            http_server_send_response(s, handle);
+            return true;
+        }
+        copied += ranges[i].length;
+    }
+
+    char boundary[20];
+    format_boundary(boundary, sizeof(boundary), validators_etag(validators, validators_len));
+
+    http_server_set_status(s, handle, 206);
+    http_server_append_headers(s, handle, validators, validators_len);
+    http_server_append_header_format(s, handle, "Content-Type: multipart/byteranges; boundary=%s", boundary);
+
+    copied = 0;
+    for (int i = 0; i < num_ranges; i++) {
+        append_part_header(s, handle, boundary, mime, ranges[i], buf->st_size);
+        http_server_append_content(s, handle, data + copied, ranges[i].length);
+        copied += ranges[i].length;
+    }
+    http_server_append_content_format(s, handle, "\r\n--%s--\r\n", boundary);
+    http_server_send_response(s, handle);
+
+    free(data);
+    return true;
+}
+
+/*
+ * Streams an open file, or its precompressed sibling
+ * if the client accepts gzip. The request may also ask
+ * for parts of the file or only for it if it changed.
+ */
+static void stream_file(struct server *s, uint32_t handle,
+                        char *file, int fd, struct stat *buf,
+                        char *mime, struct request *r)
+{
+    bool compressible = is_compressible(mime);
+
+    struct stat gz_buf;
+    int gz_fd = -1;
+    if (compressible && (accepted_encodings(r) & T_GZIP))
+        gz_fd = open_gzip_sibling(file, strlen(file), buf->st_mtim, &gz_buf);
+
+    // The sibling goes by the validators of the file, as
+    // cached variants do.
+    char validators[256];
+    int validators_len = format_validators(validators, sizeof(validators), buf->st_mtim,
+                                           buf->st_size, gz_fd >= 0 ? T_GZIP : 0, compressible);
+    assert(validators_len > 0);
+    struct slice etag = validators_etag(validators, validators_len);
+
+    if (is_not_modified(r, etag, buf->st_mtim)) {
+        close(fd);
+        if (gz_fd >= 0) close(gz_fd);
+        send_not_modified(s, handle, validators, validators_len);
+        return;
+    }
+
+    if (gz_fd >= 0) {
+        close(fd);
+        fd  = gz_fd;
+        buf = &gz_buf;
     } else {
-        if (!is_file(fd)) {
+
+        struct byte_range ranges[STATIC_MAX_RANGES];
+        int num_ranges = requested_ranges(r, etag, buf->st_mtim, buf->st_size, ranges);
+        if (num_ranges == 0) {
+            close(fd);
+            send_range_not_satisfiable(s, handle, buf->st_size);
+            return;
+        }
+        if (num_ranges == 1) {
+            http_server_set_status(s, handle, 206);
+            if (mime != NULL) http_server_append_header_format(s, handle, "Content-Type: %s", mime);
+            http_server_append_headers(s, handle, validators, validators_len);
+            http_server_append_header_format(s, handle, "Content-Range: bytes %zu-%zu/%zu",
+                                             ranges[0].offset, ranges[0].offset + ranges[0].length - 1,
+                                             (size_t) buf->st_size);
+            http_server_send_response_file(s, handle, fd, ranges[0].offset, ranges[0].length);
+            return;
+        }
+        if (num_ranges > 1 && send_file_ranges(s, handle, fd, buf, mime, validators, validators_len, ranges, num_ranges)) {
             close(fd);
+            return;
+        }
+    }
+
+    http_server_set_status(s, handle, 200);
+    if (mime != NULL) http_server_append_header_format(s, handle, "Content-Type: %s", mime);
+    if (gz_fd >= 0) http_server_append_header(s, handle, "Content-Encoding: gzip");
+    else http_server_append_header(s, handle, "Accept-Ranges: bytes");
+    http_server_append_headers(s, handle, validators, validators_len);
+
+    // The content is streamed from the file by the
+    // server, which also takes care of closing it.
+    http_server_send_response_file(s, handle, fd, 0, buf->st_size);
+}
+
+/*
+ * Like send_file, but the response depends on the request
+ * as described for serve_static_dir_ex.
+ */
+static bool send_file_ex(struct server *s,
+                         uint32_t handle,
+                         char *file,
+                         char *mime,
+                         struct request *r)
+{
+    struct stat buf;
+    int fd = open_regular_file(file, &buf);
+    if (fd < 0) {
+        if (errno == ENOENT)
             return false;
+        http_server_set_status(s, handle, 500);
+        http_server_send_response(s, handle);
+        return true;
+    }
+
+    if (mime == NULL) mime = mimetype_from_filename(file);
+    stream_file(s, handle, file, fd, &buf, mime, r);
+    return true;
+}
+
+bool send_file(struct server *s,
+               uint32_t handle,
+               char *file,
+               char *mime)
+{
+    return send_file_ex(s, handle, file, mime, NULL);
+}
+
+struct static_cache_entry {
+    struct static_cache_entry *next; // Bucket chain
+    struct static_cache_entry *lru_prev;
+    struct static_cache_entry *lru_next;
+    uint64_t hash;
+    uint64_t checked_ms; // When the file was last known to be unchanged
+    struct timespec mtime;
+    ino_t    ino;
+    off_t    file_size;
+    bool     markdown; // The body is the file rendered as HTML
+    int      encoding; // T_GZIP or T_DEFLATE if the body is compressed, else 0
+    int      unencodable; // Encodings that couldn't be made or weren't smaller
+    bool     removed;  // Out of the cache but still referenced
+    int      refs;     // Responses that are sending the body
+    char    *mime;
+    char    *path;
+    char    *headers; // Prebuilt header lines
+    char    *body;
+    size_t   path_len;
+    size_t   headers_len;
+    size_t   validators_len; // Leading header lines that 304 responses have too
+    size_t   size;
+    // The path, MIME type, headers and body follow
+};
+
+bool static_cache_init(struct static_cache *cache,
+                       struct static_cache_config config)
+{
+    if (config.budget == 0)
+        config.budget = 64 << 20;
+    if (config.max_file_size == 0)
+        config.max_file_size = 1 << 20;
+    if (config.max_file_size > config.budget)
+        config.max_file_size = config.budget;
+    if (config.revalidate_ms == 0)
+        config.revalidate_ms = 1000;
+    if (config.min_compress_size == 0)
+        config.min_compress_size = 256;
+
+    cache->nbuckets = 64;
+    cache->buckets = calloc(cache->nbuckets, sizeof(struct static_cache_entry*));
+    if (cache->buckets == NULL)
+        return false;
+
+    cache->config = config;
+    cache->count = 0;
+    cache->used = 0;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    return true;
+}
+
+void static_cache_free(struct static_cache *cache)
+{
+    struct static_cache_entry *e = cache->lru_head;
+    while (e) {
+        struct static_cache_entry *next = e->lru_next;
+        if (e->refs > 0)
+            e->removed = true;
+        else
+            free(e);
+        e = next;
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+}
+
+static uint64_t hash_path(const char *path, size_t len)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// The coarse clock is read from the vDSO, so
+// no system call is made.
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void lru_unlink(struct static_cache *cache,
+                       struct static_cache_entry *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache->lru_head = e->lru_next;
+
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void lru_push_front(struct static_cache *cache,
+                           struct static_cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->lru_prev = e;
+    else
+        cache->lru_tail = e;
+    cache->lru_head = e;
+}
+
+static size_t entry_cost(struct static_cache_entry *e)
+{
+    return sizeof(*e) + e->path_len + e->headers_len + e->size;
+}
+
+static void cache_remove(struct static_cache *cache,
+                         struct static_cache_entry *e)
+{
+    struct static_cache_entry **p = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+
+    lru_unlink(cache, e);
+    cache->count--;
+    cache->used -= entry_cost(e);
+
+    // Responses that reference the body free
+    // the entry when they are done with it.
+    if (e->refs > 0)
+        e->removed = true;
+    else
+        free(e);
+}
+
+static void release_entry(void *userp)
+{
+    struct static_cache_entry *e = userp;
+    assert(e->refs > 0);
+    e->refs--;
+    if (e->removed && e->refs == 0)
+        free(e);
+}
+
+static void append_entry_slice(struct server *s, uint32_t handle,
+                               struct static_cache_entry *e,
+                               size_t offset, size_t length)
+{
+    e->refs++;
+    http_server_append_content_ref(s, handle, e->body + offset, length, release_entry, e);
+}
+
+static void send_entry_ranges(struct server *s, uint32_t handle,
+                              struct static_cache_entry *e,
+                              struct byte_range *ranges,
+                              int num_ranges)
+{
+    http_server_set_status(s, handle, 206);
+
+    if (num_ranges == 1) {
+        http_server_append_headers(s, handle, e->headers, e->headers_len);
+        http_server_append_header_format(s, handle, "Content-Range: bytes %zu-%zu/%zu",
+                                         ranges[0].offset, ranges[0].offset + ranges[0].length - 1, e->size);
+        append_entry_slice(s, handle, e, ranges[0].offset, ranges[0].length);
+        http_server_send_response(s, handle);
+        return;
+    }
+
+    char boundary[20];
+    format_boundary(boundary, sizeof(boundary), validators_etag(e->headers, e->validators_len));
+
+    http_server_append_headers(s, handle, e->headers, e->validators_len);
+    http_server_append_header_format(s, handle, "Content-Type: multipart/byteranges; boundary=%s", boundary);
+    for (int i = 0; i < num_ranges; i++) {
+        append_part_header(s, handle, boundary, e->mime, ranges[i], e->size);
+        append_entry_slice(s, handle, e, ranges[i].offset, ranges[i].length);
+    }
+    http_server_append_content_format(s, handle, "\r\n--%s--\r\n", boundary);
+    http_server_send_response(s, handle);
+}
+
+/*
+ * The body isn't copied into the response but is sent
+ * from the entry, which is kept alive until then. So
+ * are the parts of it that the request asks for.
+ */
+static void send_entry(struct server *s, uint32_t handle,
+                       struct static_cache_entry *e,
+                       struct request *r)
+{
+    struct slice etag = validators_etag(e->headers, e->validators_len);
+    if (is_not_modified(r, etag, e->mtime)) {
+        send_not_modified(s, handle, e->headers, e->validators_len);
+        return;
+    }
+
+    if (e->encoding == 0) {
+        struct byte_range ranges[STATIC_MAX_RANGES];
+        int num_ranges = requested_ranges(r, etag, e->mtime, e->size, ranges);
+        if (num_ranges == 0) {
+            send_range_not_satisfiable(s, handle, e->size);
+            return;
+        }
+        if (num_ranges > 0) {
+            send_entry_ranges(s, handle, e, ranges, num_ranges);
+            return;
+        }
+    }
+
+    http_server_set_status(s, handle, 200);
+    http_server_append_headers(s, handle, e->headers, e->headers_len);
+    append_entry_slice(s, handle, e, 0, e->size);
+    http_server_send_response(s, handle);
+}
+
+static struct static_cache_entry*
+cache_lookup(struct static_cache *cache, char *path, size_t len, uint64_t hash, bool markdown, int encoding)
+{
+    struct static_cache_entry *e = cache->buckets[hash & (cache->nbuckets - 1)];
+    while (e) {
+        if (e->hash == hash && e->markdown == markdown && e->encoding == encoding
+            && e->path_len == len && !memcmp(e->path, path, len))
+            return e;
+        e = e->next;
+    }
+    return NULL;
+}
+
+static void cache_grow(struct static_cache *cache)
+{
+    size_t new_nbuckets = 2 * cache->nbuckets;
+    struct static_cache_entry **new_buckets = calloc(new_nbuckets, sizeof(struct static_cache_entry*));
+    if (new_buckets == NULL)
+        return; // Chains just get longer
+
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        struct static_cache_entry *e = cache->buckets[i];
+        while (e) {
+            struct static_cache_entry *next = e->next;
+            size_t j = e->hash & (new_nbuckets - 1);
+            e->next = new_buckets[j];
+            new_buckets[j] = e;
+            e = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = new_buckets;
+    cache->nbuckets = new_nbuckets;
+}
+
+/*
+ * Allocates an entry with room for a body of the given
+ * size, which is left for the caller to fill.
+ */
+static struct static_cache_entry*
+alloc_entry(char *path, size_t len, uint64_t hash,
+            struct stat *buf, char *mime, int encoding, size_t size)
+{
+    char *content_encoding = "";
+    if (encoding == T_GZIP)    content_encoding = "Content-Encoding: gzip\r\n";
+    if (encoding == T_DEFLATE) content_encoding = "Content-Encoding: deflate\r\n";
+
+    // The validators come first so that they can be
+    // sent alone with 304 responses.
+    char headers[512];
+    int validators_len = format_validators(headers, sizeof(headers), buf->st_mtim,
+                                           buf->st_size, encoding, is_compressible(mime));
+    if (validators_len < 0)
+        return NULL;
+
+    int headers_len = snprintf(headers + validators_len, sizeof(headers) - validators_len, "%s%s%s%s%s",
+                               mime ? "Content-Type: " : "",
+                               mime ? mime : "",
+                               mime ? "\r\n" : "",
+                               content_encoding,
+                               encoding ? "" : "Accept-Ranges: bytes\r\n");
+    if (headers_len < 0 || headers_len >= (int) (sizeof(headers) - validators_len))
+        return NULL;
+    headers_len += validators_len;
+
+    // The caller's string may not outlive the entry
+    size_t mime_size = mime ? strlen(mime) + 1 : 0;
+
+    struct static_cache_entry *e = malloc(sizeof(*e) + len + 1 + mime_size + headers_len + size);
+    if (e == NULL)
+        return NULL;
+
+    e->path    = (char*) (e + 1);
+    e->mime    = mime ? e->path + len + 1 : NULL;
+    e->headers = e->path + len + 1 + mime_size;
+    e->body    = e->headers + headers_len;
+    e->path_len    = len;
+    e->headers_len = headers_len;
+    e->validators_len = validators_len;
+    e->size = size;
+    e->hash = hash;
+    e->ino  = buf->st_ino;
+    e->mtime = buf->st_mtim;
+    e->file_size = buf->st_size;
+    e->markdown = false;
+    e->encoding = encoding;
+    e->unencodable = 0;
+    e->removed = false;
+    e->refs = 0;
+    e->checked_ms = now_ms();
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+    if (mime)
+        memcpy(e->mime, mime, mime_size);
+    memcpy(e->headers, headers, headers_len);
+    return e;
+}
+
+/*
+ * Adds the entry to the cache, evicting the least recently
+ * used ones until it fits in the budget.
+ */
+static void cache_link(struct static_cache *cache,
+                       struct static_cache_entry *e)
+{
+    while (cache->lru_tail && cache->used + entry_cost(e) > cache->config.budget)
+        cache_remove(cache, cache->lru_tail);
+
+    if (cache->count >= cache->nbuckets)
+        cache_grow(cache);
+
+    size_t i = e->hash & (cache->nbuckets - 1);
+    e->next = cache->buckets[i];
+    cache->buckets[i] = e;
+    lru_push_front(cache, e);
+    cache->count++;
+    cache->used += entry_cost(e);
+}
+
+/*
+ * Reads the file into a new entry.
+ */
+static struct static_cache_entry*
+cache_insert(struct static_cache *cache, char *path, size_t len, uint64_t hash,
+             int fd, struct stat *buf, char *mime)
+{
+    size_t size = buf->st_size;
+    struct static_cache_entry *e = alloc_entry(path, len, hash, buf, mime, 0, size);
+    if (e == NULL)
+        return NULL;
+
+    if (!read_whole(fd, e->body, size, 0)) {
+        free(e);
+        return NULL;
+    }
+
+    cache_link(cache, e);
+    return e;
+}
+
+/*
+ * Entries are trusted for revalidate_ms after which
+ * the file is checked again with a stat. Hits within
+ * that time are served without system calls.
+ */
+static bool entry_is_fresh(struct static_cache *cache,
+                           struct static_cache_entry *e)
+{
+    uint64_t now = now_ms();
+    if (now - e->checked_ms < cache->config.revalidate_ms)
+        return true;
+
+    struct stat buf;
+    if (stat(e->path, &buf)
+        || !S_ISREG(buf.st_mode)
+        || buf.st_ino  != e->ino
+        || buf.st_size != e->file_size
+        || buf.st_mtim.tv_sec  != e->mtime.tv_sec
+        || buf.st_mtim.tv_nsec != e->mtime.tv_nsec)
+        return false;
+
+    e->checked_ms = now;
+    return true;
+}
+
+/*
+ * Returns the entry for the path if it's still valid and
+ * marks it as the most recently used.
+ */
+static struct static_cache_entry*
+cache_find(struct static_cache *cache, char *path, size_t len, uint64_t hash,
+           bool markdown, int encoding, char *mime)
+{
+    struct static_cache_entry *e = cache_lookup(cache, path, len, hash, markdown, encoding);
+    if (e == NULL)
+        return NULL;
+
+    if (!entry_is_fresh(cache, e) || (mime && strcmp(e->mime ? e->mime : "", mime))) {
+        cache_remove(cache, e);
+        return NULL;
+    }
+
+    lru_unlink(cache, e);
+    lru_push_front(cache, e);
+    return e;
+}
+
+#ifdef HTTP_ZLIB
+/*
+ * Compresses the data into a new buffer. Gzip and
+ * deflate only differ in the wrapper that zlib puts
+ * around the stream.
+ */
+static char *compress_body(char *src, size_t len, int encoding, size_t *out_len)
+{
+    if (len > UINT32_MAX)
+        return NULL;
+
+    z_stream z = {0};
+    int window_bits = (encoding == T_GZIP) ? 15 + 16 : 15;
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    size_t capacity = deflateBound(&z, len);
+    char *dst = malloc(capacity);
+    if (dst == NULL) {
+        deflateEnd(&z);
+        return NULL;
+    }
+
+    z.next_in   = (Bytef*) src;
+    z.avail_in  = len;
+    z.next_out  = (Bytef*) dst;
+    z.avail_out = capacity;
+    int ret = deflate(&z, Z_FINISH);
+    *out_len = z.total_out;
+    deflateEnd(&z);
+
+    if (ret != Z_STREAM_END) {
+        free(dst);
+        return NULL;
+    }
+    return dst;
+}
+#endif
+
+/*
+ * Returns whether a compressed variant of the entry is
+ * worth trying.
+ */
+static bool should_encode(struct static_cache *cache,
+                          struct static_cache_entry *e,
+                          int encoding)
+{
+    return encoding != 0
+        && !(e->unencodable & encoding)
+        && e->size >= cache->config.min_compress_size
+        && is_compressible(e->mime);
+}
+
+/*
+ * Makes the compressed variant of an entry, preferring the
+ * precompressed sibling of the file when asked for gzip.
+ * The variant is revalidated against the file itself, so
+ * it goes away when the file changes. If it can't be made
+ * or isn't smaller, NULL is returned and the entry remembers
+ * not to try again.
+ */
+static struct static_cache_entry*
+cache_insert_encoded(struct static_cache *cache,
+                     struct static_cache_entry *e,
+                     int encoding)
+{
+    struct stat buf;
+    buf.st_ino  = e->ino;
+    buf.st_mtim = e->mtime;
+    buf.st_size = e->file_size;
+
+    struct static_cache_entry *v = NULL;
+
+    struct stat gz_buf;
+    int gz_fd = -1;
+    if (encoding == T_GZIP && !e->markdown)
+        gz_fd = open_gzip_sibling(e->path, e->path_len, e->mtime, &gz_buf);
+    if (gz_fd >= 0) {
+        size_t size = gz_buf.st_size;
+        if (size <= cache->config.max_file_size) {
+            v = alloc_entry(e->path, e->path_len, e->hash, &buf, e->mime, encoding, size);
+            if (v && !read_whole(gz_fd, v->body, size, 0)) {
+                free(v);
+                v = NULL;
+            }
         }
-        set_status(s, handle, 200);
+        close(gz_fd);
+    }
+
+#ifdef HTTP_ZLIB
+    if (v == NULL && gz_fd < 0) {
+        size_t size;
+        char *data = compress_body(e->body, e->size, encoding, &size);
+        // Compression that saves less than an eighth of
+        // the size isn't worth the client's time.
+        if (data && size < e->size - e->size / 8) {
+            v = alloc_entry(e->path, e->path_len, e->hash, &buf, e->mime, encoding, size);
+            if (v) memcpy(v->body, data, size);
+        }
+        free(data);
+    }
+#endif
+
+    if (v == NULL) {
+        e->unencodable |= encoding;
+        return NULL;
+    }
+    v->markdown = e->markdown;
+    v->checked_ms = e->checked_ms;
+
+    // Making room for the variant may evict the entry
+    // it was made from, which isn't used after this.
+    cache_link(cache, v);
+    return v;
+}
+
+/*
+ * Sends the entry, or its variant in the encoding if
+ * one is worth making.
+ */
+static void send_entry_encoded(struct static_cache *cache,
+                               struct server *s, uint32_t handle,
+                               struct static_cache_entry *e,
+                               int encoding, struct request *r)
+{
+    if (should_encode(cache, e, encoding)) {
+        struct static_cache_entry *v = cache_insert_encoded(cache, e, encoding);
+        if (v) e = v;
+    }
+    send_entry(s, handle, e, r);
+}
+
+/*
+ * Like send_file, but small files are kept in the cache
+ * together with their headers. Bigger files are streamed
+ * as usual.
+ */
+bool send_file_cached(struct static_cache *cache,
+                      struct server *s,
+                      uint32_t handle,
+                      char *file,
+                      char *mime)
+{
+    return send_file_cached_ex(cache, s, handle, file, mime, NULL);
+}
+
+static bool send_file_cached_ex(struct static_cache *cache,
+                                struct server *s,
+                                uint32_t handle,
+                                char *file,
+                                char *mime,
+                                struct request *r)
+{
+    size_t len = strlen(file);
+    uint64_t hash = hash_path(file, len);
+
+    struct static_cache_entry *e;
+    int encoding = preferred_encoding(accepted_encodings(r));
+    if (encoding) {
+        e = cache_find(cache, file, len, hash, false, encoding, mime);
+        if (e) {
+            send_entry(s, handle, e, r);
+            return true;
+        }
+    }
+
+    e = cache_find(cache, file, len, hash, false, 0, mime);
+    if (e == NULL) {
+
+        struct stat buf;
+        int fd = open_regular_file(file, &buf);
+        if (fd < 0) {
+            if (errno == ENOENT)
+                return false;
+            http_server_set_status(s, handle, 500);
+            http_server_send_response(s, handle);
+            return true;
+        }
+
         if (mime == NULL) mime = mimetype_from_filename(file);
-        if (mime != NULL) append_header_format(s, handle, "Content-Type: %s", mime);
-        for (;;) {
-            char mem[1<<13]; // 8K
-            int num = read(fd, mem, sizeof(mem));
-            if (num < 0)
-                // Error. Unfortunately we already set the first
-                // status code to 200.
-                break;
-            if (num == 0)
-                break;
-            append_content(s, handle, mem, num);
+
+        if ((size_t) buf.st_size > cache->config.max_file_size) {
+            stream_file(s, handle, file, fd, &buf, mime, r);
+            return true;
+        }
+
+        e = cache_insert(cache, file, len, hash, fd, &buf, mime);
+        if (e == NULL) {
+            // Serve it without caching
+            stream_file(s, handle, file, fd, &buf, mime, r);
+            return true;
         }
         close(fd);
     }
-    send_response(s, handle);
+
+    send_entry_encoded(cache, s, handle, e, encoding, r);
     return true;
 }
 
+struct md_output {
+    char  *data;
+    size_t size;
+    size_t capacity;
+    bool   error;
+};
+
+static bool md_output_reserve(struct md_output *out, size_t min)
+{
+    if (out->error)
+        return false;
+    if (out->capacity - out->size >= min)
+        return true;
+
+    size_t new_capacity = out->capacity ? 2 * out->capacity : 1<<12;
+    while (new_capacity - out->size < min)
+        new_capacity *= 2;
+
+    char *new_data = realloc(out->data, new_capacity);
+    if (new_data == NULL) {
+        out->error = true;
+        return false;
+    }
+    out->data = new_data;
+    out->capacity = new_capacity;
+    return true;
+}
+
+static void md_outcb(void *userp, const char *str, size_t len)
+{
+    struct md_output *out = userp;
+    if (!md_output_reserve(out, len))
+        return;
+    memcpy(out->data + out->size, str, len);
+    out->size += len;
+}
+
+static void md_outvacb(void *userp, const char *fmt, va_list args)
+{
+    struct md_output *out = userp;
+
+    va_list args2;
+    va_copy(args2, args);
+    int len = vsnprintf(NULL, 0, fmt, args2);
+    va_end(args2);
+
+    if (len < 0) {
+        out->error = true;
+        return;
+    }
+    if (!md_output_reserve(out, len+1))
+        return;
+    vsnprintf(out->data + out->size, len+1, fmt, args);
+    out->size += len;
+}
+
+/*
+ * Renders the markdown into a new buffer instead of
+ * a response. Returns false on failure.
+ */
+static bool render_md(const char *src, size_t len, struct md_output *out)
+{
+    *out = (struct md_output) {0};
+    struct smu_config conf = {
+        .nohtml = 0,
+        .outfn = md_outcb,
+        .outvafn = md_outvacb,
+        .userp = out,
+    };
+    const char *msg;
+    int ok = smu(src, len, conf, &msg);
+    if (!ok) fprintf(stderr, "Error: %s\n", msg);
+    if (!ok || out->error) {
+        free(out->data);
+        out->data = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Reads and renders a markdown file. The rendered page
+ * is returned with the file's stat information.
+ */
+static bool load_md(char *file, struct stat *buf, struct md_output *out)
+{
+    int fd = open_regular_file(file, buf);
+    if (fd < 0)
+        return false;
+
+    size_t size;
+    char *src = read_file(fd, &size);
+    close(fd);
+    if (src == NULL) {
+        errno = EIO;
+        return false;
+    }
+
+    bool ok = render_md(src, size, out);
+    free(src);
+    if (!ok)
+        errno = EIO;
+    return ok;
+}
+
+static struct static_cache_entry*
+cache_insert_md(struct static_cache *cache, char *path, size_t len, uint64_t hash,
+                struct stat *buf, struct md_output *out)
+{
+    if (out->size > cache->config.max_file_size)
+        return NULL;
+
+    struct static_cache_entry *e = alloc_entry(path, len, hash, buf, "text/html", 0, out->size);
+    if (e == NULL)
+        return NULL;
+    e->markdown = true;
+    memcpy(e->body, out->data, out->size);
+
+    cache_link(cache, e);
+    return e;
+}
+
+/*
+ * Like send_file_md, but the rendered page is cached
+ * and only rendered again when the file changes.
+ */
+bool send_file_md_cached(struct static_cache *cache,
+                         struct server *s,
+                         uint32_t handle,
+                         char *file)
+{
+    return send_file_md_cached_ex(cache, s, handle, file, NULL);
+}
+
+static bool send_file_md_cached_ex(struct static_cache *cache,
+                                   struct server *s,
+                                   uint32_t handle,
+                                   char *file,
+                                   struct request *r)
+{
+    size_t len = strlen(file);
+    uint64_t hash = hash_path(file, len);
+
+    struct static_cache_entry *e;
+    int encoding = preferred_encoding(accepted_encodings(r));
+    if (encoding) {
+        e = cache_find(cache, file, len, hash, true, encoding, NULL);
+        if (e) {
+            send_entry(s, handle, e, r);
+            return true;
+        }
+    }
+
+    e = cache_find(cache, file, len, hash, true, 0, NULL);
+    if (e == NULL) {
+
+        struct stat buf;
+        struct md_output out;
+        if (!load_md(file, &buf, &out)) {
+            if (errno == ENOENT)
+                return false;
+            http_server_set_status(s, handle, 500);
+            http_server_send_response(s, handle);
+            return true;
+        }
+
+        e = cache_insert_md(cache, file, len, hash, &buf, &out);
+        if (e == NULL) {
+            // Too big to be cached
+            http_server_set_status(s, handle, 200);
+            http_server_append_header(s, handle, "Content-Type: text/html");
+            http_server_append_content(s, handle, out.data, out.size);
+            http_server_send_response(s, handle);
+            free(out.data);
+            return true;
+        }
+        free(out.data);
+    }
+
+    send_entry_encoded(cache, s, handle, e, encoding, r);
+    return true;
+}
+
+struct md_page {
+    char *path;
+    struct stat buf;
+    struct md_output out;
+    bool ok;
+};
+
+struct md_pages {
+    struct md_page *items;
+    size_t count;
+    size_t capacity;
+    _Atomic(size_t) next; // First page not yet taken by a worker
+};
+
+static bool md_pages_add(struct md_pages *pages, char *path, size_t len)
+{
+    if (pages->count == pages->capacity) {
+        size_t new_capacity = pages->capacity ? 2 * pages->capacity : 32;
+        struct md_page *new_items = realloc(pages->items, new_capacity * sizeof(struct md_page));
+        if (new_items == NULL)
+            return false;
+        pages->items = new_items;
+        pages->capacity = new_capacity;
+    }
+
+    char *copy = malloc(len+1);
+    if (copy == NULL)
+        return false;
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+
+    pages->items[pages->count++] = (struct md_page) { .path=copy };
+    return true;
+}
+
+/*
+ * Collects the .md files under the directory. The paths
+ * are built the same way serve_static_dir builds them.
+ */
+static bool collect_md(char *path, size_t len, size_t max, struct md_pages *pages)
+{
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return false;
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+
+        if (ent->d_name[0] == '.')
+            continue;
+
+        size_t name_len = strlen(ent->d_name);
+        if (len + 1 + name_len >= max)
+            continue;
+        path[len] = '/';
+        memcpy(path + len + 1, ent->d_name, name_len+1);
+        size_t sub_len = len + 1 + name_len;
+
+        struct stat buf;
+        if (stat(path, &buf))
+            continue;
+
+        if (S_ISDIR(buf.st_mode)) {
+            collect_md(path, sub_len, max, pages);
+        } else if (S_ISREG(buf.st_mode)
+            && name_len > 3
+            && !strcmp(ent->d_name + name_len - 3, ".md")) {
+            if (!md_pages_add(pages, path, sub_len)) {
+                closedir(d);
+                return false;
+            }
+        }
+    }
+    path[len] = '\0';
+    closedir(d);
+    return true;
+}
+
+static os_threadreturn prerender_routine(void *arg)
+{
+    struct md_pages *pages = arg;
+    for (;;) {
+        size_t i = atomic_fetch_add(&pages->next, 1);
+        if (i >= pages->count)
+            break;
+        struct md_page *page = &pages->items[i];
+        page->ok = load_md(page->path, &page->buf, &page->out);
+    }
+    return 0;
+}
+
+/*
+ * Renders all .md files under the directory into the
+ * cache, so that the first requests don't pay for it.
+ * Rendering is split between num_threads threads, or
+ * one per online CPU if num_threads is less than 1.
+ * Pages are inserted in the cache from the calling
+ * thread once they're all rendered.
+ *
+ * Returns the number of cached pages, or -1 if the
+ * directory couldn't be scanned.
+ */
+int static_cache_prerender_md(struct static_cache *cache,
+                              char *dir, int num_threads)
+{
+    char path[1<<10];
+    size_t len = strlen(dir);
+    while (len > 0 && dir[len-1] == '/')
+        len--;
+    if (len >= sizeof(path))
+        return -1;
+    memcpy(path, dir, len);
+    path[len] = '\0';
+
+    struct md_pages pages = {0};
+    if (!collect_md(path, len, sizeof(path), &pages)) {
+        for (size_t i = 0; i < pages.count; i++)
+            free(pages.items[i].path);
+        free(pages.items);
+        return -1;
+    }
+
+    if (num_threads < 1) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = n < 1 ? 1 : n;
+    }
+    if ((size_t) num_threads > pages.count)
+        num_threads = pages.count;
+
+    os_thread threads[64];
+    if (num_threads > (int) (sizeof(threads)/sizeof(threads[0])))
+        num_threads = sizeof(threads)/sizeof(threads[0]);
+
+    for (int i = 0; i < num_threads; i++)
+        os_thread_create(&threads[i], &pages, prerender_routine);
+    for (int i = 0; i < num_threads; i++)
+        os_thread_join(threads[i]);
+
+    int cached = 0;
+    for (size_t i = 0; i < pages.count; i++) {
+        struct md_page *page = &pages.items[i];
+        if (page->ok) {
+            size_t path_len = strlen(page->path);
+            uint64_t hash = hash_path(page->path, path_len);
+
+            // Compressed variants of the old page go with it
+            int encodings[] = {0, T_GZIP, T_DEFLATE};
+            for (int j = 0; j < (int) (sizeof(encodings)/sizeof(encodings[0])); j++) {
+                struct static_cache_entry *old = cache_lookup(cache, page->path, path_len, hash, true, encodings[j]);
+                if (old) cache_remove(cache, old);
+            }
+
+            if (cache_insert_md(cache, page->path, path_len, hash, &page->buf, &page->out))
+                cached++;
+            free(page->out.data);
+        }
+        free(page->path);
+    }
+    free(pages.items);
+    return cached;
+}
+
 static bool send_dir_listing(struct server *s, uint32_t h,
                              char *dir, char *prefix, struct slice path)
 {
@@ -281,8 +1649,8 @@ static bool send_dir_listing(struct server *s, uint32_t h,
     size_t dirlen = strlen(dir);
     char fullpath[1<<10];
     if (dirlen + path.size >= sizeof(fullpath)) {
-        set_status(s, h, 500);
-        send_response(s, h);
+        http_server_set_status(s, h, 500);
+        http_server_send_response(s, h);
         return true;
     }
     memcpy(fullpath, dir, dirlen);
@@ -293,11 +1661,11 @@ static bool send_dir_listing(struct server *s, uint32_t h,
     if (d == NULL) {
         if (errno == ENOENT || errno == ENOTDIR)
             return false;
-        set_status(s, h, 500);
+        http_server_set_status(s, h, 500);
     } else {
         struct dirent *dir;
-        set_status(s, h, 200);
-        append_content_format(s, h,
+        http_server_set_status(s, h, 200);
+        http_server_append_content_format(s, h,
             "<html>\n"
             "    <head>\n"
             "    </head>\n"
@@ -308,14 +1676,14 @@ static bool send_dir_listing(struct server *s, uint32_t h,
         while ((dir = readdir(d)) != NULL) {
             if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
                 continue;
-            append_content_format(s, h, "<li><a href=\"%s/%.*s%s\">%s</a></li>\n", prefix, (int) path.size, path.data, dir->d_name, dir->d_name);
+            http_server_append_content_format(s, h, "<li><a href=\"%s/%.*s%s\">%s</a></li>\n", prefix, (int) path.size, path.data, dir->d_name, dir->d_name);
         }
-        append_content_string(s, h,
+        http_server_append_content_string(s, h,
             "        </ul>\n"
             "    </body>\n"
             "</html>\n");
         closedir(d);
     }
-    send_response(s, h);
+    http_server_send_response(s, h);
     return true;
-}
\ No newline at end of file
+}
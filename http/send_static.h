@@ -1,5 +1,49 @@
 #include "../http/server.h"
 
+// Requests for more ranges than this get the whole file
+#ifndef STATIC_MAX_RANGES
+#define STATIC_MAX_RANGES 16
+#endif
+
+// Multiple ranges of a file that isn't cached are read
+// into memory, so their total size is limited to this.
+// Over it, the whole file is sent.
+#ifndef STATIC_MAX_RANGE_COPY
+#define STATIC_MAX_RANGE_COPY (1 << 20)
+#endif
+
+/*
+ * Zero means default for all fields
+ */
+struct static_cache_config {
+    size_t   budget;        // Bytes of file content kept in memory
+    size_t   max_file_size; // Bigger files are streamed and never cached
+    uint32_t revalidate_ms; // How long an entry is trusted before checking the file's mtime
+    size_t   min_compress_size; // Smaller files are never sent compressed
+};
+
+struct static_cache_entry;
+
+/*
+ * Least recently used set of small files, held in memory
+ * together with their headers. It's not thread-safe, so
+ * each shard needs its own.
+ */
+struct static_cache {
+    struct static_cache_config config;
+    struct static_cache_entry **buckets;
+    size_t nbuckets; // Power of 2
+    size_t count;
+    size_t used;     // Bytes counted against the budget
+    struct static_cache_entry *lru_head; // Most recently used
+    struct static_cache_entry *lru_tail;
+};
+
+bool static_cache_init(struct static_cache *cache,
+                       struct static_cache_config config);
+
+void static_cache_free(struct static_cache *cache);
+
 bool serve_static_dir(char *dir,
                       char *prefix,
                       struct server *s,
@@ -8,11 +52,34 @@ bool serve_static_dir(char *dir,
                       bool dir_listing,
                       bool convert_md);
 
+bool serve_static_dir_ex(char *dir,
+                         char *prefix,
+                         struct server *s,
+                         struct request *r,
+                         uint32_t handle,
+                         bool dir_listing,
+                         bool convert_md,
+                         struct static_cache *cache);
+
 bool send_file(struct server *s,
                uint32_t handle,
                char *file,
                char *mime);
 
+bool send_file_cached(struct static_cache *cache,
+                      struct server *s,
+                      uint32_t handle,
+                      char *file,
+                      char *mime);
+
 bool send_file_md(struct server *s,
                   uint32_t handle,
-                  char *file);
\ No newline at end of file
+                  char *file);
+
+bool send_file_md_cached(struct static_cache *cache,
+                         struct server *s,
+                         uint32_t handle,
+                         char *file);
+
+int static_cache_prerender_md(struct static_cache *cache,
+                              char *dir, int num_threads);
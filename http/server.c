@@ -8,10 +8,36 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include "server.h"
 
+#ifdef HTTP_DEBUG
+#define DEBUG_BYTES(prefix, bytes, count) print_bytes(prefix, bytes, count)
+#else
+#define DEBUG_BYTES(...)
+#endif
+
+// Handles hold the generation of the client in the low
+// bits and its index in the table in the others. A stale
+// handle only refers to a client again after its slot was
+// reused 2^HANDLE_GEN_BITS-1 times, so the generation gets
+// half of the bits, which still leaves room for 65536
+// clients.
+#define HANDLE_GEN_BITS 16
+#define HANDLE_GEN_MASK ((1 << HANDLE_GEN_BITS) - 1)
+_Static_assert(MAX_CLIENTS_LIMIT <= (1 << (32 - HANDLE_GEN_BITS)));
+
+#ifdef HTTP_ASYNCIO
+// Each client may use two I/O resources (socket and file)
+// and there is the listener.
+_Static_assert(2 * MAX_CLIENTS_LIMIT + 1 <= IO_MAX_RES);
+#endif
+
 void print_bytes(const char *prefix,
                  char *bytes,
                  int   count)
@@ -45,7 +71,7 @@ bool set_non_blocking(int fd)
     return fcntl(fd, F_SETFL, flags) == 0;
 }
 
-int start_server_ipv4(const char *addr, uint16_t port)
+int start_server_ipv4(const char *addr, uint16_t port, bool reuse_port, int backlog)
 {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0)
@@ -59,12 +85,22 @@ int start_server_ipv4(const char *addr, uint16_t port)
     int one = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
+    // With SO_REUSEPORT each shard binds its own listening
+    // socket to the same address and the kernel spreads the
+    // incoming connections between them.
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+        close(fd);
+        return -1;
+    }
+
     struct in_addr x;
     if (addr == NULL)
         x.s_addr = htonl(INADDR_ANY);
     else {
-        if (inet_pton(AF_INET, addr, &x) != 1)
+        if (inet_pton(AF_INET, addr, &x) != 1) {
+            close(fd);
             return -1;
+        }
     }
 
     struct sockaddr_in y;
@@ -76,7 +112,6 @@ int start_server_ipv4(const char *addr, uint16_t port)
         return -1;
     }
 
-    int backlog = 32;
     if (listen(fd, backlog)) {
         close(fd);
         return -1;
@@ -88,89 +123,652 @@ int start_server_ipv4(const char *addr, uint16_t port)
 void push_client(struct server *s,
                  struct client *c)
 {
-    assert(s->qused < MAX_CLIENTS);
-    s->qdata[(s->qhead + s->qused) % MAX_CLIENTS] = c;
+    assert(s->qused < (size_t) s->capacity);
+    s->qdata[(s->qhead + s->qused) % s->capacity] = c;
     s->qused++;
+    c->queued_ns = s->now_ns;
 }
 
 struct client *pop_client(struct server *s)
 {
     assert(s->qused > 0);
     struct client *c = s->qdata[s->qhead];
-    s->qhead = (s->qhead + 1) % MAX_CLIENTS;
+    s->qhead = (s->qhead + 1) % s->capacity;
     s->qused--;
     return c;
 }
 
+/*
+ * Removes a client that was closed while waiting in the
+ * queue. The following ones are moved back by one to
+ * keep the order. This only happens when a peer goes
+ * away with a request pending, so the linear scan is
+ * fine.
+ */
 static void remove_queued_client(struct server *s,
                                  struct client *c)
 {
     assert(c->state == C_QUEUED);
-    // TODO
+
+    size_t i = 0;
+    while (i < s->qused && s->qdata[(s->qhead + i) % s->capacity] != c)
+        i++;
+    assert(i < s->qused);
+
+    for (; i+1 < s->qused; i++)
+        s->qdata[(s->qhead + i) % s->capacity] = s->qdata[(s->qhead + i + 1) % s->capacity];
+    s->qused--;
+}
+
+/*
+ * Buffers of up to BUFFER_POOL_MAX_SIZE bytes come in power
+ * of 2 sizes starting from BUFFER_POOL_MIN_SIZE. When one
+ * is released it's kept in the list of its size for the
+ * next time a buffer is needed, so that the buffers of
+ * a request are taken from the ones left by the previous
+ * ones instead of the heap. Bigger buffers are allocated
+ * and freed as usual.
+ */
+struct pooled_buffer {
+    struct pooled_buffer *next;
+};
+
+static int buffer_class(size_t size)
+{
+    int k = 0;
+    size_t class_size = BUFFER_POOL_MIN_SIZE;
+    while (class_size < size) {
+        class_size <<= 1;
+        k++;
+    }
+    return k;
+}
+
+static char *get_buffer(struct server *s, size_t *size)
+{
+    if (*size > BUFFER_POOL_MAX_SIZE)
+        return malloc(*size);
+
+    int k = buffer_class(*size);
+    *size = (size_t) BUFFER_POOL_MIN_SIZE << k;
+
+    struct pooled_buffer *b = s->pool.lists[k];
+    if (b) {
+        s->pool.lists[k] = b->next;
+        s->pool.counts[k]--;
+        return (char*) b;
+    }
+    return malloc(*size);
+}
+
+static void put_buffer(struct server *s, char *data, size_t size)
+{
+    if (data == NULL)
+        return;
+
+    if (size > BUFFER_POOL_MAX_SIZE) {
+        free(data);
+        return;
+    }
+
+    int k = buffer_class(size);
+    assert(size == (size_t) BUFFER_POOL_MIN_SIZE << k);
+
+    if (s->pool.counts[k] == BUFFER_POOL_DEPTH) {
+        free(data);
+        return;
+    }
+
+    struct pooled_buffer *b = (struct pooled_buffer*) data;
+    b->next = s->pool.lists[k];
+    s->pool.lists[k] = b;
+    s->pool.counts[k]++;
+}
+
+static void free_buffer_pool(struct server *s)
+{
+    for (int k = 0; k < BUFFER_POOL_CLASSES; k++) {
+        while (s->pool.lists[k]) {
+            struct pooled_buffer *b = s->pool.lists[k];
+            s->pool.lists[k] = b->next;
+            free(b);
+        }
+        s->pool.counts[k] = 0;
+    }
+}
+
+static void release_iobuf(struct server *s, struct iobuf *b)
+{
+    put_buffer(s, b->data, b->size);
+    b->data = NULL;
+    b->size = 0;
+    b->used = 0;
+}
+
+/*
+ * Calls the release callbacks of the referenced buffers
+ * that weren't sent.
+ */
+static void release_output_refs(struct client *c)
+{
+    for (int i = 0; i < c->num_refs; i++)
+        if (c->refs[i].release)
+            c->refs[i].release(c->refs[i].userp);
+    c->num_refs = 0;
+    c->ref_sent = 0;
+}
+
+/*
+ * Moves the output that wasn't sent yet to the start of
+ * the buffer, shifting the offsets that point into it.
+ */
+static void rebase_output(struct client *c)
+{
+    size_t head = c->output_head;
+    if (head == 0)
+        return;
+
+    memmove(c->output.data,
+            c->output.data + head,
+            c->output.used - head);
+    c->output.used -= head;
+    c->output_head = 0;
+
+    if (c->content_length_offset >= head) c->content_length_offset -= head;
+    if (c->content_offset >= head) c->content_offset -= head;
+    if (c->file_fd >= 0) c->file_at -= head;
+    for (int i = 0; i < c->num_refs; i++)
+        c->refs[i].at -= head;
 }
 
 void invalidate_handles(struct client *c)
 {
     c->gen++;
-    if (c->gen == (uint16_t) -1)
+    if (c->gen == HANDLE_GEN_MASK)
         c->gen = 0;
 }
 
+static struct client *client_at(struct server *s, int i)
+{
+    return &s->chunks[i / CLIENT_CHUNK][i % CLIENT_CHUNK];
+}
+
+/*
+ * Reallocates the arrays indexed by client so that they
+ * can hold "capacity" entries. The queue is unrolled while
+ * it's copied, and the poll backend's clients are pointed
+ * to the new pollfds.
+ */
+static bool grow_arrays(struct server *s, int capacity)
+{
+    struct client **qdata = malloc(capacity * sizeof(struct client*));
+    if (qdata == NULL)
+        return false;
+
+    struct pollfd *ps = realloc(s->ps, (capacity + 1) * sizeof(struct pollfd));
+    if (ps == NULL) {
+        free(qdata);
+        return false;
+    }
+    s->ps = ps;
+
+    int *pis = realloc(s->pis, capacity * sizeof(int));
+    if (pis == NULL) {
+        free(qdata);
+        return false;
+    }
+    s->pis = pis;
+
+    int *free_ = realloc(s->free, capacity * sizeof(int));
+    if (free_ == NULL) {
+        free(qdata);
+        return false;
+    }
+    s->free = free_;
+
+    struct client **flush = realloc(s->flush, capacity * sizeof(struct client*));
+    if (flush == NULL) {
+        free(qdata);
+        return false;
+    }
+    s->flush = flush;
+
+    for (size_t i = 0; i < s->qused; i++)
+        qdata[i] = s->qdata[(s->qhead + i) % s->capacity];
+    free(s->qdata);
+    s->qdata = qdata;
+    s->qhead = 0;
+
+    if (s->backend == HTTP_BACKEND_POLL)
+        for (int i = 0; i < s->ncs; i++)
+            client_at(s, s->pis[i])->pitem = &s->ps[i+1];
+
+    s->capacity = capacity;
+    return true;
+}
+
+/*
+ * Allocates the next chunk of clients and pushes them to
+ * the free list. The arrays indexed by client double in
+ * size when they're full, so growing to N clients costs
+ * O(N) overall.
+ */
+static bool grow_clients(struct server *s)
+{
+    int n = s->max_clients - s->num_slots;
+    if (n == 0)
+        return false;
+    if (n > CLIENT_CHUNK)
+        n = CLIENT_CHUNK;
+
+    if (s->num_slots + n > s->capacity) {
+        int capacity = 2 * s->capacity;
+        if (capacity < s->num_slots + n)
+            capacity = s->num_slots + n;
+        if (capacity > s->max_clients)
+            capacity = s->max_clients;
+        if (!grow_arrays(s, capacity))
+            return false;
+    }
+
+    struct client *chunk = malloc(n * sizeof(struct client));
+    if (chunk == NULL)
+        return false;
+    s->chunks[s->num_slots / CLIENT_CHUNK] = chunk;
+
+    // Pushed in reverse so that lower indices are used first
+    for (int i = n-1; i >= 0; i--) {
+        chunk[i].state = C_FREE;
+        chunk[i].gen = 0;
+        chunk[i].timer.kind = TIMER_NONE;
+        chunk[i].index = s->num_slots + i;
+        s->free[s->nfree++] = s->num_slots + i;
+    }
+    s->num_slots += n;
+    return true;
+}
+
+/*
+ * Takes a free client from the table, growing it if
+ * needed. Returns NULL when the table is at its limit
+ * or memory ran out.
+ */
+static struct client *alloc_client(struct server *s)
+{
+    if (s->nfree == 0 && !grow_clients(s))
+        return NULL;
+
+    struct client *c = client_at(s, s->free[--s->nfree]);
+    assert(c->state == C_FREE);
+    return c;
+}
+
+static void free_client(struct server *s, struct client *c)
+{
+    s->free[s->nfree++] = c->index;
+}
+
+static void free_client_table(struct server *s)
+{
+    for (int i = 0; i < s->num_slots; i += CLIENT_CHUNK)
+        free(s->chunks[i / CLIENT_CHUNK]);
+    free(s->chunks);
+    free(s->ps);
+    free(s->pis);
+    free(s->free);
+    free(s->qdata);
+    free(s->flush);
+}
+
+/*
+ * Connection timeouts are kept in a hierarchical timer
+ * wheel. Level 0 has a list of the timers that expire at
+ * each of the next TIMER_WHEEL_SLOTS ticks, and each level
+ * after it covers TIMER_WHEEL_SLOTS times the span of the
+ * previous one with the same number of lists. When a level
+ * wraps around, the list of the next level that became
+ * current is spread over the lower ones. Arming a timer and
+ * removing it are list operations, and a timer is moved at
+ * most once per level before it expires.
+ */
+static uint64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Milliseconds the loop can wait before the next tick,
+// or -1 if there are no timers.
+static int timer_wait_ms(struct server *s)
+{
+    if (s->wheel.count == 0)
+        return -1;
+    return TIMER_TICK_MS - get_time_ms() % TIMER_TICK_MS;
+}
+
+static void init_timer_wheel(struct timer_wheel *w, uint64_t tick)
+{
+    w->tick = tick;
+    w->count = 0;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++)
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            struct client_timer *head = &w->slots[l][i];
+            head->prev = head;
+            head->next = head;
+        }
+}
+
+// The timer must not expire before the current tick
+static void link_timer(struct timer_wheel *w, struct client_timer *t)
+{
+    uint64_t delta = t->expire - w->tick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS-1 && delta >= (uint64_t) 1 << (TIMER_WHEEL_BITS * (level+1)))
+        level++;
+
+    int slot = (t->expire >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS-1);
+    struct client_timer *head = &w->slots[level][slot];
+    t->prev = head;
+    t->next = head->next;
+    head->next->prev = t;
+    head->next = t;
+}
+
+static void unlink_timer(struct client_timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+}
+
+static void disarm_timer(struct server *s, struct client *c)
+{
+    if (c->timer.kind == TIMER_NONE)
+        return;
+    unlink_timer(&c->timer);
+    c->timer.kind = TIMER_NONE;
+    s->wheel.count--;
+}
+
+static void arm_timer(struct server *s, struct client *c, int kind)
+{
+    disarm_timer(s, c);
+
+    int ms = s->timeouts[kind];
+    if (ms < 0)
+        return;
+
+    // An empty wheel can skip to the current tick
+    if (s->wheel.count == 0)
+        s->wheel.tick = s->now_ms / TIMER_TICK_MS;
+
+    uint64_t max_delta = ((uint64_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    uint64_t expire = (s->now_ms + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (expire <= s->wheel.tick)
+        expire = s->wheel.tick + 1;
+    if (expire - s->wheel.tick > max_delta)
+        expire = s->wheel.tick + max_delta;
+
+    c->timer.expire = expire;
+    c->timer.kind = kind;
+    link_timer(&s->wheel, &c->timer);
+    s->wheel.count++;
+}
+
+/*
+ * Metrics are only written by the thread that drives the
+ * server, so recording one is a load and a store of each
+ * value it updates. The event loop reads the clock once
+ * after each wait and before flushing output (now_ns) for
+ * the events it handles then, and it's only read again for
+ * the phases that run in between.
+ */
+static uint64_t metrics_time_ns(void)
+{
+#ifdef HTTP_NO_METRICS
+    return 0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void metric_add(_Atomic uint64_t *m, uint64_t n)
+{
+    atomic_store_explicit(m, atomic_load_explicit(m, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void count_event(struct server *s, int counter)
+{
+#ifdef HTTP_NO_METRICS
+    (void) s;
+    (void) counter;
+#else
+    metric_add(&s->metrics.counters[counter], 1);
+#endif
+}
+
+// Values under 2^HISTOGRAM_SUB_BITS have a bucket each, then
+// every power of 2 is split in 2^HISTOGRAM_SUB_BITS buckets
+// by the bits that follow the highest one.
+static inline int histogram_bucket(uint64_t ns)
+{
+    if (ns < (1 << HISTOGRAM_SUB_BITS))
+        return ns;
+    int e = 63 - __builtin_clzll(ns);
+    if (e >= HISTOGRAM_MAX_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+    int sub = (ns >> (e - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((e - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) | sub;
+}
+
+// Highest value that goes in a bucket
+static uint64_t histogram_bucket_max(int i)
+{
+    if (i < (1 << HISTOGRAM_SUB_BITS))
+        return i;
+    int shift = (i >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = i & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (((1 << HISTOGRAM_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static inline void record_phase(struct server *s, int phase, uint64_t start_ns, uint64_t end_ns)
+{
+#ifdef HTTP_NO_METRICS
+    (void) s;
+    (void) phase;
+    (void) start_ns;
+    (void) end_ns;
+#else
+    struct histogram *h = &s->metrics.phases[phase];
+    uint64_t ns = end_ns > start_ns ? end_ns - start_ns : 0;
+    metric_add(&h->buckets[histogram_bucket(ns)], 1);
+    metric_add(&h->count, 1);
+    metric_add(&h->sum, ns);
+#endif
+}
+
+static void update_gauges(struct server *s)
+{
+#ifdef HTTP_NO_METRICS
+    (void) s;
+#else
+    atomic_store_explicit(&s->metrics.connections, s->ncs, memory_order_relaxed);
+    atomic_store_explicit(&s->metrics.queued, s->qused, memory_order_relaxed);
+#endif
+}
+
+/*
+ * Ends the write phase once all of the output was sent.
+ * Output is sent by the event loop, so the end is the time
+ * it took when it woke up or started flushing. Streamed
+ * output is also sent from handlers, where that time is
+ * older than the start, so the end is left to the loop.
+ */
+static void output_drained(struct server *s, struct client *c)
+{
+    if (c->write_start_ns == 0 || c->write_start_ns > s->now_ns)
+        return;
+    record_phase(s, PHASE_WRITE, c->write_start_ns, s->now_ns);
+    c->write_start_ns = 0;
+}
+
+/*
+ * Tell the event loop that the client has output to send.
+ *
+ * With poll this is done by adding POLLOUT to the client's
+ * pollfd. Clients are registered to the epoll instance
+ * edge-triggered for both input and output, so readiness
+ * for output is only reported when a previously full socket
+ * buffer drains. Output produced outside of the loop is
+ * instead flushed at the start of the next iteration by
+ * pushing the client to the flush list.
+ */
+static void watch_output(struct server *s, struct client *c)
+{
+    if (s->backend == HTTP_BACKEND_POLL)
+        c->pitem->events |= POLLOUT;
+    else {
+        if (c->flush_index < 0) {
+            c->flush_index = s->nflush;
+            s->flush[s->nflush++] = c;
+        }
+    }
+}
+
+static void unwatch_output(struct server *s, struct client *c)
+{
+    if (s->backend == HTTP_BACKEND_POLL)
+        c->pitem->events &= ~POLLOUT;
+}
+
+static void remove_from_flush_list(struct server *s, struct client *c)
+{
+    if (c->flush_index < 0)
+        return;
+    struct client *last = s->flush[--s->nflush];
+    s->flush[c->flush_index] = last;
+    last->flush_index = c->flush_index;
+    c->flush_index = -1;
+}
+
+/*
+ * Stops or resumes reporting new connections while the
+ * client table is full. Otherwise the listener would stay
+ * readable and wake up the loop over and over.
+ */
+static void pause_listener(struct server *s, bool pause)
+{
+    if (s->listener_paused == pause)
+        return;
+
+    if (s->backend == HTTP_BACKEND_POLL)
+        s->ps[0].events = pause ? 0 : POLLIN;
+    else {
+        struct epoll_event ev;
+        ev.events = pause ? 0 : EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, s->fd, &ev))
+            return;
+    }
+    s->listener_paused = pause;
+}
+
 void close_client(struct server *s,
                   struct client *c)
 {
-    int ci = c - s->cs;
-    int pi = c->pitem - s->ps;
+    uint64_t start_ns = metrics_time_ns();
+    count_event(s, COUNTER_CLOSED);
 
     invalidate_handles(c);
+    disarm_timer(s, c);
 
     if (c->state == C_QUEUED)
         remove_queued_client(s, c);
 
-    close(c->pitem->fd);
-
-    free(c->input.data);
-    c->input.data = NULL;
-    c->input.size = 0;
-    c->input.used = 0;
-    free(c->output.data);
-    c->output.data = NULL;
-    c->output.size = 0;
-    c->output.used = 0;
+#ifdef HTTP_ASYNCIO
+    if (s->backend == HTTP_BACKEND_ASYNCIO)
+        io_close(&s->ioc, c->handle);
+    else
+#endif
+    // Closing the descriptor also removes it
+    // from the epoll interest list.
+    close(c->fd);
+
+    release_iobuf(s, &c->input);
+    c->input_head = 0;
+    release_iobuf(s, &c->output);
+    c->output_head = 0;
+    release_output_refs(c);
     c->state = C_FREE;
-    c->pitem = NULL;
-
-    s->pis[pi-1] = s->pis[s->ncs-1];
-    s->ps[pi] = s->ps[s->ncs];
-    s->ncs--;
+    c->fd = -1;
+
+    if (c->file_fd >= 0) {
+#ifdef HTTP_ASYNCIO
+        if (s->backend == HTTP_BACKEND_ASYNCIO)
+            io_close(&s->ioc, c->file_handle);
+        else
+#endif
+        close(c->file_fd);
+        c->file_fd = -1;
+    }
 
-    s->cs[s->pis[pi-1]].pitem = &s->ps[pi];
+    if (s->backend == HTTP_BACKEND_POLL) {
+        int pi = c->pitem - s->ps;
+        s->pis[pi-1] = s->pis[s->ncs-1];
+        s->ps[pi] = s->ps[s->ncs];
+        client_at(s, s->pis[pi-1])->pitem = &s->ps[pi];
+        c->pitem = NULL;
+    } else
+        remove_from_flush_list(s, c);
+
+#ifdef HTTP_ASYNCIO
+    // The buffers of pending operations can't be freed
+    // until the operations complete, so the slot is only
+    // released when that happens.
+    if (s->backend == HTTP_BACKEND_ASYNCIO) {
+        if (c->recving || c->sending.data || c->sending_file) {
+            c->state = C_DRAINING;
+            record_phase(s, PHASE_CLOSE, start_ns, metrics_time_ns());
+            return;
+        }
+        free(c->recv_buffer);
+        c->recv_buffer = NULL;
+    }
+#endif
 
-    s->free[MAX_CLIENTS - (s->ncs + 1)] = ci;
+    s->ncs--;
+    free_client(s, c);
+    if (s->backend != HTTP_BACKEND_ASYNCIO)
+        pause_listener(s, false);
+    record_phase(s, PHASE_CLOSE, start_ns, metrics_time_ns());
 }
 
-size_t find(struct iobuf *hay, char *needle)
+#ifdef HTTP_ASYNCIO
+static void release_drained_client(struct server *s, struct client *c)
 {
-    size_t needle_len = strlen(needle);
-    if (needle_len == 0 || hay->used < needle_len - 1)
-        return -1;
-
-    size_t i = 0;
-    while (i < hay->used - needle_len + 1 && memcmp(hay->data + i, needle, needle_len))
-        i++;
+    assert(c->state == C_DRAINING);
+    if (c->recving || c->sending.data || c->sending_file)
+        return;
 
-    if (i >= hay->used - needle_len + 1)
-        return -1;
+    free(c->recv_buffer);
+    c->recv_buffer = NULL;
+    c->state = C_FREE;
 
-    return i;
+    s->ncs--;
+    free_client(s, c);
 }
+#endif
 
-static int ensure_free_space(struct iobuf *b, size_t min)
+static int ensure_free_space(struct server *s, struct iobuf *b, size_t min)
 {
     if (b->data == NULL) {
 
         size_t init = 512;
-        b->data = malloc(init);
+        if (init < min)
+            init = min;
+        b->data = get_buffer(s, &init);
         if (b->data == NULL)
             return 0;
         b->size = init;
@@ -183,13 +781,13 @@ static int ensure_free_space(struct iobuf *b, size_t min)
         if (new_size - b->used < min)
             new_size = b->used + min;
 
-        char *new_data = malloc(new_size);
+        char *new_data = get_buffer(s, &new_size);
         if (new_data == NULL)
             return 0;
 
         assert(b->data);
         memcpy(new_data, b->data, b->used);
-        free(b->data);
+        put_buffer(s, b->data, b->size);
 
         b->data = new_data;
         b->size = new_size;
@@ -197,14 +795,153 @@ static int ensure_free_space(struct iobuf *b, size_t min)
     return 1;
 }
 
+/*
+ * Requests that were served stay at the start of the
+ * input buffer until more room is needed to receive,
+ * so that a batch of pipelined requests is moved at
+ * most once instead of once per request.
+ */
+static int reserve_input(struct server *s, struct client *c, size_t min)
+{
+    // Not while a request is being served since its
+    // slices point into the buffer.
+    if (c->input_head > 0 && c->request_length == 0 && c->input.size - c->input.used < min) {
+        memmove(c->input.data,
+                c->input.data + c->input_head,
+                c->input.used - c->input_head);
+        c->input.used -= c->input_head;
+        c->input_head = 0;
+    }
+    return ensure_free_space(s, &c->input, min);
+}
+
+/*
+ * Returns true if the head of the next request was
+ * received entirely. Only the input that arrived since
+ * the last call is searched.
+ */
+static bool request_head_ready(struct client *c)
+{
+    if (c->head_length > 0)
+        return true;
+
+    size_t len = c->input.used - c->input_head;
+    c->head_length = find_head_end(c->input.data + c->input_head, len, c->head_scanned);
+    c->head_scanned = len;
+    return c->head_length > 0;
+}
+
+/*
+ * Queues an idle client once the head of its next request
+ * was received. The read phase starts when the first bytes
+ * of a head are received, and requests that were already
+ * buffered or that are waiting for their body don't count.
+ */
+static void queue_if_ready(struct server *s, struct client *c)
+{
+    if (c->state != C_IDLE)
+        return;
+
+    if (c->head_length == 0 && c->head_start_ns == 0 && c->input.used > c->input_head)
+        c->head_start_ns = s->now_ns;
+
+    if (request_head_ready(c)) {
+        if (c->head_start_ns) {
+            record_phase(s, PHASE_READ_HEAD, c->head_start_ns, s->now_ns);
+            c->head_start_ns = 0;
+        }
+        push_client(s, c);
+        c->state = C_QUEUED;
+    }
+}
+
+static bool has_pending_output(struct client *c)
+{
+#ifdef HTTP_ASYNCIO
+    if (c->sending.data || c->sending_file)
+        return true;
+#endif
+    return c->output.used > c->output_head || c->num_refs > 0 || c->file_fd >= 0;
+}
+
+/*
+ * Arms the timeout of what the client is waiting for, if
+ * that changed. The header and keep-alive timeouts run from
+ * when the wait started so that a client can't hold its
+ * slot by sending a byte at a time. The body and write ones
+ * restart whenever there's progress.
+ */
+static void update_timer(struct server *s, struct client *c, bool progress)
+{
+    int kind = TIMER_NONE;
+    if (has_pending_output(c))
+        kind = TIMER_WRITE;
+    else if (c->state == C_IDLE) {
+        if (c->input.used == c->input_head)
+            kind = TIMER_KEEPALIVE;
+        else if (request_head_ready(c))
+            kind = TIMER_BODY; // Back from wait_request
+        else
+            kind = TIMER_HEADER;
+    }
+
+    if (kind == c->timer.kind && !(progress && (kind == TIMER_BODY || kind == TIMER_WRITE)))
+        return;
+
+    if (kind == TIMER_NONE)
+        disarm_timer(s, c);
+    else
+        arm_timer(s, c, kind);
+}
+
+/*
+ * Advances the wheel to the current time and closes the
+ * clients whose timers expired.
+ */
+static void expire_timers(struct server *s)
+{
+    struct timer_wheel *w = &s->wheel;
+    uint64_t now = s->now_ms / TIMER_TICK_MS;
+
+    while (w->tick < now && w->count > 0) {
+
+        w->tick++;
+
+        for (int l = 1; l < TIMER_WHEEL_LEVELS; l++) {
+
+            if ((w->tick >> (TIMER_WHEEL_BITS * (l-1))) & (TIMER_WHEEL_SLOTS-1))
+                break;
+
+            int slot = (w->tick >> (TIMER_WHEEL_BITS * l)) & (TIMER_WHEEL_SLOTS-1);
+            struct client_timer *head = &w->slots[l][slot];
+            while (head->next != head) {
+                struct client_timer *t = head->next;
+                unlink_timer(t);
+                link_timer(w, t);
+            }
+        }
+
+        struct client_timer *head = &w->slots[0][w->tick & (TIMER_WHEEL_SLOTS-1)];
+        while (head->next != head) {
+            struct client *c = (struct client*) ((char*) head->next - offsetof(struct client, timer));
+            count_event(s, COUNTER_TIMEOUTS);
+            close_client(s, c);
+        }
+    }
+
+    // Nothing to expire in between
+    if (w->count == 0)
+        w->tick = now;
+}
+
 int socket_input(struct server *s, struct client *c)
 {
-    int fd = c->pitem->fd;
+    int fd = c->fd;
 
     for (;;) {
 
         size_t min_recv = 256;
-        if (!ensure_free_space(&c->input, min_recv))
+        if (!reserve_input(s, c, min_recv))
             return 0;
 
         int n = recv(fd, c->input.data + c->input.used, c->input.size - c->input.used, 0);
@@ -217,211 +954,891 @@ int socket_input(struct server *s, struct client *c)
         }
         assert(n > 0);
 
-        print_bytes(">>> ", c->input.data + c->input.used, n);
+        DEBUG_BYTES(">>> ", c->input.data + c->input.used, n);
 
         c->input.used += (size_t) n;
     }
 
-    if (c->state == C_IDLE)
-        if (find(&c->input, "\r\n\r\n") != (size_t) -1) {
-            push_client(s, c);
-            c->state = C_QUEUED;
-        }
+    queue_if_ready(s, c);
 
+    update_timer(s, c, false);
     return 1;
 }
 
-int socket_output(struct server *s, struct client *c)
+/*
+ * Sends the file that follows the buffered output
+ * until it's over or the socket buffer is full.
+ */
+static int socket_output_file(struct client *c, bool *blocked)
 {
-    (void) s;
-
-    size_t limit;
-    if (c->state == C_CONTENT)
-        limit = c->content_length_offset;
-    else
-        limit = c->output.used;
+    while (c->file_left > 0) {
+        ssize_t n = sendfile(c->fd, c->file_fd, &c->file_pos, c->file_left);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                *blocked = true;
+                return 1;
+            }
+            return 0;
+        }
+        if (n == 0)
+            return 0; // The file shrank and the Content-Length is wrong
+        c->file_left -= n;
+    }
+    close(c->file_fd);
+    c->file_fd = -1;
+    return 1;
+}
 
-    int fd = c->pitem->fd;
+/*
+ * Accounts for n bytes that were written, starting from
+ * the head of the output.
+ */
+static void consume_output(struct client *c, size_t n, size_t limit)
+{
+    while (n > 0) {
+        if (c->num_refs > 0 && c->refs[0].at == c->output_head) {
+
+            struct output_ref *ref = &c->refs[0];
+            size_t num = ref->size - c->ref_sent;
+            if (num > n)
+                num = n;
+            c->ref_sent += num;
+            n -= num;
+
+            if (c->ref_sent == ref->size) {
+                if (ref->release)
+                    ref->release(ref->userp);
+                c->num_refs--;
+                memmove(c->refs, c->refs + 1, c->num_refs * sizeof(struct output_ref));
+                c->ref_sent = 0;
+            }
 
-    int maxzeros = 0;
-    size_t sent = 0;
-    while (sent < limit) {
-        int n = send(fd, c->output.data + sent, limit - sent, 0);
-        if (n == 0) {
-            maxzeros++;
-            if (maxzeros == 128)
-                break;
-            continue;
         } else {
-            maxzeros = 0;
+            size_t next = limit;
+            if (c->num_refs > 0 && c->refs[0].at < next)
+                next = c->refs[0].at;
+            size_t num = next - c->output_head;
+            if (num > n)
+                num = n;
+            c->output_head += num;
+            n -= num;
         }
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
+    }
+}
+
+/*
+ * Gathers the owned output and the buffers it references
+ * up to limit. The iov array must have room for at least
+ * 2*OUTPUT_REFS+1 items. Returns the number of bytes.
+ */
+static size_t gather_output(struct client *c, size_t limit,
+                            struct iovec *iov, int *cnt)
+{
+    size_t total = 0;
+    size_t pos = c->output_head;
+    *cnt = 0;
+    for (int i = 0; i < c->num_refs && c->refs[i].at <= limit; i++) {
+        struct output_ref *ref = &c->refs[i];
+        if (ref->at > pos) {
+            iov[*cnt].iov_base = c->output.data + pos;
+            iov[*cnt].iov_len  = ref->at - pos;
+            total += ref->at - pos;
+            (*cnt)++;
+            pos = ref->at;
+        }
+        size_t skip = (i == 0) ? c->ref_sent : 0;
+        iov[*cnt].iov_base = ref->data + skip;
+        iov[*cnt].iov_len  = ref->size - skip;
+        total += ref->size - skip;
+        (*cnt)++;
+    }
+    if (limit > pos) {
+        iov[*cnt].iov_base = c->output.data + pos;
+        iov[*cnt].iov_len  = limit - pos;
+        total += limit - pos;
+        (*cnt)++;
+    }
+    return total;
+}
+
+int socket_output(struct server *s, struct client *c)
+{
+    bool blocked = false;
+    for (;;) {
+
+        // The Content-Length of the response that is being
+        // built isn't known yet, so what comes after it is
+        // held back. Streamed responses have none.
+        size_t limit;
+        if (c->state == C_CONTENT && !c->streaming)
+            limit = c->content_length_offset;
+        else
+            limit = c->output.used;
+
+        if (c->file_fd >= 0 && c->file_at < limit)
+            limit = c->file_at;
+
+        // Headers, buffered content and the referenced
+        // buffers go out with a single call and nothing
+        // that is left is moved.
+        int cnt;
+        struct iovec iov[2*OUTPUT_REFS+1];
+        size_t total = gather_output(c, limit, iov, &cnt);
+
+        size_t sent = 0;
+        while (sent < total) {
+            ssize_t n = writev(c->fd, iov, cnt);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                return 0;
+            }
+            if (n == 0)
                 break;
-            return 0;
+            consume_output(c, n, limit);
+            sent += n;
+            if (sent < total)
+                gather_output(c, limit, iov, &cnt);
         }
 
-        print_bytes("<<< ", c->output.data + sent, n);
+        if (sent < total) {
+            blocked = true;
+            break;
+        }
 
-        sent += n;
+        // The file goes out straight from the page cache
+        // once the output that precedes it was sent. What
+        // was buffered after it is sent at the next round.
+        if (c->file_fd < 0 || c->file_at > c->output_head)
+            break;
+
+        if (!socket_output_file(c, &blocked))
+            return 0;
+
+        if (blocked)
+            break;
     }
 
-    if (c->state == C_CONTENT)
-        c->content_length_offset -= sent;
+    if (c->output_head == c->output.used && c->num_refs == 0) {
+        rebase_output(c);
+        release_iobuf(s, &c->output);
+        if (c->file_fd < 0)
+            output_drained(s, c);
+    }
 
-    if (sent == limit)
-        c->pitem->events &= ~POLLOUT;
+    if (!blocked)
+        unwatch_output(s, c);
+
+    if (c->output.used == 0 && c->num_refs == 0 && c->file_fd < 0 && c->state == C_CLOSE)
+        return 0;
+
+    update_timer(s, c, true);
+    return 1;
+}
+
+static void accept_clients(struct server *s)
+{
+    while (s->ncs < s->max_clients) {
 
-    if (sent == c->output.used) {
-        free(c->output.data);
+        uint64_t start_ns = metrics_time_ns();
+        int accept_fd = accept(s->fd, NULL, NULL);
+        if (accept_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // Out of descriptors or similar
+        }
+
+        if (!set_non_blocking(accept_fd)) {
+            close(accept_fd);
+            continue;
+        }
+
+        struct client *c = alloc_client(s);
+        if (c == NULL) {
+            close(accept_fd);
+            break;
+        }
+
+        if (s->backend == HTTP_BACKEND_POLL) {
+            struct pollfd *p = &s->ps[s->ncs+1];
+            p->fd = accept_fd;
+            p->events = POLLIN;
+            p->revents = 0;
+            s->pis[s->ncs] = c->index;
+            c->pitem = p;
+        } else {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = c;
+            if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, accept_fd, &ev)) {
+                close(accept_fd);
+                free_client(s, c);
+                continue;
+            }
+            c->pitem = NULL;
+            c->flush_index = -1;
+        }
+
+        c->fd = accept_fd;
+        c->state = C_IDLE;
+        c->input.data = NULL;
+        c->input.used = 0;
+        c->input.size = 0;
+        c->input_head = 0;
+        c->head_length = 0;
+        c->head_scanned = 0;
+        c->request_length = 0;
         c->output.data = NULL;
-        c->output.size = 0;
+        c->output_head = 0;
+        c->num_refs = 0;
+        c->ref_sent = 0;
         c->output.used = 0;
-        if (c->state == C_CLOSE)
-            return 0;
-    } else {
-        if (sent > 0) {
-            memmove(c->output.data,
-                    c->output.data + sent,
-                    c->output.used - sent);
-            c->output.used -= sent;
-        }
+        c->output.size = 0;
+        c->file_fd = -1;
+        c->num_served = 0;
+        c->head_start_ns = 0;
+        c->write_start_ns = 0;
+        c->keepalive = false;
+        c->streaming = false;
+        c->no_content = false;
+
+        s->ncs++;
+        update_timer(s, c, false);
+
+        count_event(s, COUNTER_ACCEPTED);
+        record_phase(s, PHASE_ACCEPT, start_ns, metrics_time_ns());
     }
-    return 1;
+
+    if (s->ncs == s->max_clients)
+        pause_listener(s, true);
 }
 
-void process_io(struct server *s)
+static void process_io_poll(struct server *s)
 {
-    int timeout = -1;
+    int timeout = timer_wait_ms(s);
     int n = poll(s->ps, s->ncs+1, timeout);
+    s->now_ms = get_time_ms();
+    s->now_ns = metrics_time_ns();
     if (n < 0) return;
 
-    if (s->ps[0].revents & POLLIN) {
+    if (s->ps[0].revents & POLLIN)
+        accept_clients(s);
 
-        while (s->ncs < MAX_CLIENTS) {
+    for (int i = 1; i < s->ncs+1; i++) {
 
-            int accept_fd = accept(s->fd, NULL, NULL);
-            if (accept_fd < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    break;
-                assert(0);
-                continue;
-            }
+        int ci = s->pis[i-1];
+        
+        struct client *c = client_at(s, ci);
+        assert(c->pitem == &s->ps[i]);
 
-            if (!set_non_blocking(accept_fd)) {
-                close(accept_fd);
-                continue;
+        int evs = s->ps[i].revents;
+        int ok = 1;
+
+        if (evs & POLLIN)
+            ok = socket_input(s, c);
+
+        if (ok && (evs & POLLOUT))
+            ok = socket_output(s, c);
+
+        if (!ok) {
+            close_client(s, c);
+            i--;
+        }
+    }
+
+    expire_timers(s);
+}
+
+/*
+ * Only the clients that are ready are visited, so
+ * the cost of an iteration doesn't depend on how
+ * many connections are idle.
+ */
+static void process_io_epoll(struct server *s)
+{
+    if (s->nflush > 0)
+        s->now_ns = metrics_time_ns();
+    while (s->nflush > 0) {
+        struct client *c = s->flush[s->nflush-1];
+        remove_from_flush_list(s, c);
+        if (!socket_output(s, c))
+            close_client(s, c);
+    }
+
+    int timeout = timer_wait_ms(s);
+    struct epoll_event evs[EPOLL_BATCH];
+    int n = epoll_wait(s->epfd, evs, EPOLL_BATCH, timeout);
+    s->now_ms = get_time_ms();
+    s->now_ns = metrics_time_ns();
+    if (n < 0) return;
+
+    for (int i = 0; i < n; i++) {
+
+        struct client *c = evs[i].data.ptr;
+        if (c == NULL) {
+            accept_clients(s);
+            continue;
+        }
+
+        int ok = 1;
+        uint32_t flags = evs[i].events;
+
+        if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            ok = socket_input(s, c);
+
+        if (ok && (flags & EPOLLOUT) && (c->output.used > 0 || c->num_refs > 0 || c->file_fd >= 0))
+            ok = socket_output(s, c);
+
+        if (!ok)
+            close_client(s, c);
+    }
+
+    expire_timers(s);
+}
+
+#ifdef HTTP_ASYNCIO
+/*
+ * When the kernel supports provided buffer rings, receives
+ * land in a buffer picked from a shared pool at completion
+ * time and a single multishot operation serves the client
+ * until it fails. Else each client needs its own receive
+ * buffer and a receive per completion. The own buffer is
+ * also used for one receive when the pool ran out.
+ */
+static bool start_recv(struct server *s, struct client *c, bool own_buffer)
+{
+    bool ok;
+    if (s->recv_pool && !own_buffer)
+        ok = io_recv_multishot(&s->ioc, c, c->handle);
+    else
+        ok = io_recv(&s->ioc, c, c->handle, c->recv_buffer, RECV_CHUNK);
+    if (!ok)
+        return false;
+    c->recving = true;
+    return true;
+}
+
+/*
+ * The output buffer is handed over to the send operation
+ * and the client starts a new one, so that responses can
+ * be appended while the send is in progress without
+ * moving memory the kernel is reading from.
+ */
+static bool start_send(struct server *s, struct client *c)
+{
+    if (c->sending.data || c->sending_file)
+        return true; // Resumed when the current send completes
+
+    if (c->file_fd >= 0 && c->file_at == 0) {
+        size_t num = c->file_left;
+        if (num > UINT32_MAX)
+            num = UINT32_MAX;
+        if (!io_sendfile(&s->ioc, c, c->handle, c->file_handle, c->file_pos, num))
+            return false;
+        c->sending_file = true;
+        return true;
+    }
+
+    // Only the output that comes before the file can be
+    // sent. Else, only complete responses are.
+    size_t limit = c->output.used;
+    if (c->file_fd >= 0)
+        limit = c->file_at;
+    else if (c->state == C_STATUS || c->state == C_HEADER || (c->state == C_CONTENT && !c->streaming))
+        return true; // The response is still being built
+
+    if (limit == 0) {
+        if (c->file_fd < 0)
+            output_drained(s, c);
+        return c->state != C_CLOSE;
+    }
+
+    struct iobuf rest = {NULL, 0, 0};
+    if (limit < c->output.used) {
+        if (!ensure_free_space(s, &rest, c->output.used - limit))
+            return false;
+        memcpy(rest.data, c->output.data + limit, c->output.used - limit);
+        rest.used = c->output.used - limit;
+    }
+
+    if (!io_send(&s->ioc, c, c->handle, c->output.data, limit)) {
+        release_iobuf(s, &rest);
+        return false;
+    }
+
+    c->sending = c->output;
+    c->sending.used = limit;
+    c->sent = 0;
+    c->output = rest;
+    if (c->file_fd >= 0)
+        c->file_at = 0;
+    return true;
+}
+
+static void accept_complete(struct server *s, struct io_event ev)
+{
+    if (ev.evtype == IO_COMPLETE) {
+
+        uint64_t start_ns = metrics_time_ns();
+        struct client *c = NULL;
+        if (s->ncs < s->max_clients)
+            c = alloc_client(s);
+
+        if (c == NULL)
+            io_close(&s->ioc, ev.accepted);
+        else {
+
+            c->recv_buffer = NULL;
+            if (s->recv_pool == NULL)
+                c->recv_buffer = malloc(RECV_CHUNK);
+            if (s->recv_pool == NULL && c->recv_buffer == NULL) {
+                io_close(&s->ioc, ev.accepted);
+                free_client(s, c);
+            } else {
+                c->fd = -1;
+                c->handle = ev.accepted;
+                c->pitem = NULL;
+                c->flush_index = -1;
+                c->recving = false;
+                c->sending.data = NULL;
+                c->sending.size = 0;
+                c->sending.used = 0;
+                c->state = C_IDLE;
+                c->input.data = NULL;
+                c->input.used = 0;
+                c->input.size = 0;
+                c->input_head = 0;
+                c->head_length = 0;
+                c->head_scanned = 0;
+                c->request_length = 0;
+                c->output.data = NULL;
+                c->output_head = 0;
+                c->num_refs = 0;
+                c->ref_sent = 0;
+                c->output.used = 0;
+                c->output.size = 0;
+                c->file_fd = -1;
+                c->file_handle = IO_INVALID;
+                c->sending_file = false;
+                c->num_served = 0;
+                c->head_start_ns = 0;
+                c->write_start_ns = 0;
+                c->keepalive = false;
+                c->streaming = false;
+                c->no_content = false;
+
+                s->ncs++;
+                count_event(s, COUNTER_ACCEPTED);
+
+                if (!start_recv(s, c, false))
+                    close_client(s, c);
+                else {
+                    update_timer(s, c, false);
+                    record_phase(s, PHASE_ACCEPT, start_ns, metrics_time_ns());
+                }
             }
+        }
+    }
 
-            struct client *c;
-            struct pollfd *p;
+    if (!ev.more && !io_accept_multishot(&s->ioc, NULL, s->listener))
+        fprintf(stderr, "Couldn't start accept operation\n");
+}
 
-            int ft = MAX_CLIENTS - (s->ncs + 1);
-            int ci = s->free[ft];
-            assert(ci >= 0 && ci < MAX_CLIENTS);
+static void recv_complete(struct server *s, struct client *c, struct io_event ev)
+{
+    c->recving = ev.more;
 
-            c = &s->cs[ci];
-            assert(c->state == C_FREE);
+    char *src = ev.buffer ? ev.buffer : c->recv_buffer;
 
-            p = &s->ps[s->ncs+1];
-            p->fd = accept_fd;
-            p->events = POLLIN;
-            p->revents = 0;
+    bool ok = c->state != C_DRAINING
+           && ev.evtype == IO_COMPLETE && ev.num > 0
+           && reserve_input(s, c, ev.num);
+
+    if (ok) {
+        memcpy(c->input.data + c->input.used, src, ev.num);
+        DEBUG_BYTES(">>> ", c->input.data + c->input.used, ev.num);
+        c->input.used += ev.num;
+    }
+
+    if (ev.buffer)
+        io_release_recv_buffer(&s->ioc, ev.buffer_id);
+
+    if (c->state == C_DRAINING) {
+        release_drained_client(s, c);
+        return;
+    }
+
+    /*
+     * All pool buffers are held by other clients, which says
+     * nothing about this connection. Receive once into a
+     * buffer of its own, kept for the next time, and go back
+     * to the pool when that completes.
+     */
+    if (ev.evtype == IO_ABORT && ev.error == ENOBUFS) {
+        if (c->recv_buffer == NULL)
+            c->recv_buffer = malloc(RECV_CHUNK);
+        if (c->recv_buffer == NULL || !start_recv(s, c, true))
+            close_client(s, c);
+        return;
+    }
+
+    if (!ok) {
+        close_client(s, c);
+        return;
+    }
+
+    queue_if_ready(s, c);
+
+    if (!c->recving && !start_recv(s, c, false)) {
+        close_client(s, c);
+        return;
+    }
+
+    update_timer(s, c, false);
+}
+
+static void sendfile_complete(struct server *s, struct client *c, struct io_event ev)
+{
+    c->sending_file = false;
+
+    // A zero count means that the file shrank and the
+    // Content-Length can't be honored anymore.
+    if (c->state == C_DRAINING || ev.evtype != IO_COMPLETE || ev.num == 0) {
+        if (c->state == C_DRAINING)
+            release_drained_client(s, c);
+        else
+            close_client(s, c);
+        return;
+    }
+
+    c->file_pos  += ev.num;
+    c->file_left -= ev.num;
+    if (c->file_left == 0) {
+        io_close(&s->ioc, c->file_handle);
+        c->file_handle = IO_INVALID;
+        c->file_fd = -1;
+    }
+
+    if (!start_send(s, c)) {
+        close_client(s, c);
+        return;
+    }
+
+    update_timer(s, c, true);
+}
+
+static void send_complete(struct server *s, struct client *c, struct io_event ev)
+{
+    if (c->state == C_DRAINING || ev.evtype != IO_COMPLETE) {
+        release_iobuf(s, &c->sending);
+        if (c->state == C_DRAINING)
+            release_drained_client(s, c);
+        else
+            close_client(s, c);
+        return;
+    }
+
+    DEBUG_BYTES("<<< ", c->sending.data + c->sent, ev.num);
+    c->sent += ev.num;
+
+    if (c->sent < c->sending.used) {
+        if (!io_send(&s->ioc, c, c->handle,
+                     c->sending.data + c->sent,
+                     c->sending.used - c->sent)) {
+            release_iobuf(s, &c->sending);
+            close_client(s, c);
+            return;
+        }
+        update_timer(s, c, true);
+        return;
+    }
+
+    release_iobuf(s, &c->sending);
+
+    if (!start_send(s, c)) {
+        close_client(s, c);
+        return;
+    }
+
+    update_timer(s, c, true);
+}
+
+static void process_io_asyncio(struct server *s)
+{
+    if (s->nflush > 0)
+        s->now_ns = metrics_time_ns();
+    while (s->nflush > 0) {
+        struct client *c = s->flush[s->nflush-1];
+        remove_from_flush_list(s, c);
+        if (!start_send(s, c))
+            close_client(s, c);
+        else
+            update_timer(s, c, true);
+    }
+
+    // A single timer wakes the loop at every tick while
+    // there are connection timeouts.
+    int timeout = timer_wait_ms(s);
+    if (!s->timer_pending && timeout >= 0)
+        s->timer_pending = io_timer(&s->ioc, NULL, timeout);
+
+    struct io_event ev;
+    io_wait(&s->ioc, &ev);
+    s->now_ms = get_time_ms();
+    s->now_ns = metrics_time_ns();
+
+    switch (ev.optype) {
+        case IO_ACCEPT: accept_complete(s, ev); break;
+        case IO_RECV: recv_complete(s, ev.user, ev); break;
+        case IO_SEND: send_complete(s, ev.user, ev); break;
+        case IO_SENDFILE: sendfile_complete(s, ev.user, ev); break;
+        case IO_TIMER: s->timer_pending = false; break;
+        default: break;
+    }
+
+    expire_timers(s);
+}
+#endif
+
+void process_io(struct server *s)
+{
+    switch (s->backend) {
+        case HTTP_BACKEND_POLL : process_io_poll(s);  break;
+        case HTTP_BACKEND_EPOLL: process_io_epoll(s); break;
+#ifdef HTTP_ASYNCIO
+        case HTTP_BACKEND_ASYNCIO: process_io_asyncio(s); break;
+#endif
+    }
+    update_gauges(s);
+}
+
+bool http_server_init_ex(struct server *s,
+                         const char *addr,
+                         uint16_t port,
+                         struct server_config config)
+{
+    s->backend = config.backend;
+    s->epfd = -1;
+    s->listener_paused = false;
+    s->nflush = 0;
+    s->ncs = 0;
+    s->qhead = 0;
+    s->qused = 0;
+
+    s->max_clients = config.max_clients;
+    if (s->max_clients == 0)
+        s->max_clients = MAX_CLIENTS;
+    if (s->max_clients < 0 || s->max_clients > MAX_CLIENTS_LIMIT)
+        return false;
+
+    s->keepalive_limit = config.keepalive_limit;
+    if (s->keepalive_limit == 0)
+        s->keepalive_limit = 0.7 * s->max_clients;
 
-            s->pis[s->ncs] = ci;
+    int backlog = config.backlog;
+    if (backlog == 0)
+        backlog = 32;
 
-            c->state = C_IDLE;
-            c->input.data = NULL;
-            c->input.used = 0;
-            c->input.size = 0;
-            c->output.data = NULL;
-            c->output.used = 0;
-            c->output.size = 0;
-            c->pitem = &s->ps[s->ncs+1];
-            c->num_served = 0;
+    s->timeouts[TIMER_NONE]      = -1;
+    s->timeouts[TIMER_HEADER]    = config.header_timeout_ms    ? config.header_timeout_ms    : 10000;
+    s->timeouts[TIMER_BODY]      = config.body_timeout_ms      ? config.body_timeout_ms      : 30000;
+    s->timeouts[TIMER_KEEPALIVE] = config.keepalive_timeout_ms ? config.keepalive_timeout_ms : 5000;
+    s->timeouts[TIMER_WRITE]     = config.write_timeout_ms     ? config.write_timeout_ms     : 30000;
 
-            s->ncs++;
-        }
-    }
+    s->now_ms = get_time_ms();
+    s->timer_pending = false;
+    init_timer_wheel(&s->wheel, s->now_ms / TIMER_TICK_MS);
 
-    for (int i = 1; i < s->ncs+1; i++) {
+    s->now_ns = metrics_time_ns();
+    memset(&s->metrics, 0, sizeof(s->metrics));
+    s->metrics_group = NULL;
+    s->metrics_group_size = 0;
 
-        int ci = s->pis[i-1];
-        
-        struct client *c = &s->cs[ci];
-        assert(c->pitem == &s->ps[i]);
+    for (int k = 0; k < BUFFER_POOL_CLASSES; k++) {
+        s->pool.lists[k] = NULL;
+        s->pool.counts[k] = 0;
+    }
 
-        int evs = s->ps[i].revents;
-        int ok = 1;
+    s->num_slots = 0;
+    s->capacity = 0;
+    s->nfree = 0;
+    s->ps = NULL;
+    s->pis = NULL;
+    s->free = NULL;
+    s->qdata = NULL;
+    s->flush = NULL;
+    s->chunks = malloc((s->max_clients + CLIENT_CHUNK - 1) / CLIENT_CHUNK * sizeof(struct client*));
+    if (s->chunks == NULL || !grow_clients(s)) {
+        free_client_table(s);
+        return false;
+    }
 
-        if (evs & POLLIN)
-            ok = socket_input(s, c);
+#ifdef HTTP_ASYNCIO
+    // The listening socket is created by the I/O context,
+    // so reuse_port and backlog aren't supported by this
+    // backend. Its resources can't grow, so they're
+    // allocated for the maximum number of clients.
+    if (s->backend == HTTP_BACKEND_ASYNCIO) {
+        s->fd = -1;
+        int max_res = 2 * s->max_clients + 1;
+        int max_ops = max_res + 1; // And the timer
+        s->res = malloc(max_res * sizeof(struct io_resource));
+        s->ops = malloc(max_ops * sizeof(struct io_operation));
+        if (s->res == NULL || s->ops == NULL || !io_init(&s->ioc, s->res, s->ops, max_res, max_ops)) {
+            free(s->res);
+            free(s->ops);
+            free_client_table(s);
+            return false;
+        }
 
-        if (ok && (evs & POLLOUT))
-            ok = socket_output(s, c);
+        s->recv_pool = malloc(RECV_BUFFERS * RECV_CHUNK);
+        if (s->recv_pool && !io_setup_recv_buffers(&s->ioc, s->recv_pool, RECV_CHUNK, RECV_BUFFERS)) {
+            free(s->recv_pool);
+            s->recv_pool = NULL;
+        }
 
-        if (!ok) {
-            close_client(s, c);
-            i--;
+        s->listener = io_start_server(&s->ioc, addr, port);
+        if (s->listener == IO_INVALID || !io_accept_multishot(&s->ioc, NULL, s->listener)) {
+            io_free(&s->ioc);
+            free(s->recv_pool);
+            free(s->res);
+            free(s->ops);
+            free_client_table(s);
+            return false;
         }
+        return true;
     }
+#endif
+
+    int fd = start_server_ipv4(addr, port, config.reuse_port, backlog);
+    if (fd < 0) {
+        free_client_table(s);
+        return false;
+    }
+
+    if (s->backend == HTTP_BACKEND_EPOLL) {
+        s->epfd = epoll_create1(0);
+        if (s->epfd < 0) {
+            close(fd);
+            free_client_table(s);
+            return false;
+        }
+        // The listener is level-triggered so that pending
+        // connections that weren't accepted because the
+        // client table was full are reported again once
+        // it's resumed by close_client.
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            close(s->epfd);
+            close(fd);
+            free_client_table(s);
+            return false;
+        }
+    } else
+        assert(s->backend == HTTP_BACKEND_POLL);
+
+    s->fd = fd;
+    s->ps[0].fd = fd;
+    s->ps[0].events = POLLIN;
+    s->ps[0].revents = 0;
+
+    return true;
 }
 
 bool http_server_init(struct server *s,
                       const char *addr,
                       uint16_t port)
 {
-    int fd = start_server_ipv4(addr, port);
-    if (fd < 0)
-        return -1;
+    return http_server_init_ex(s, addr, port, (struct server_config) {0});
+}
 
-    s->fd = fd;
-    s->ncs = 0;
-    s->qhead = 0;
-    s->qused = 0;
+/*
+ * Like http_server_init but the listening socket is
+ * created with SO_REUSEPORT, so that multiple servers
+ * can be bound to the same address. Each one is a shard
+ * that owns its clients and request queue and must only
+ * be used by a single thread.
+ */
+bool http_server_init_shard(struct server *s,
+                            const char *addr,
+                            uint16_t port)
+{
+    return http_server_init_ex(s, addr, port, (struct server_config) {.reuse_port=true});
+}
 
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        s->cs[i].state = C_FREE;
-        s->cs[i].gen = 0;
-        s->free[i] = MAX_CLIENTS - (i + 1);
+void http_server_free(struct server *s)
+{
+    for (int i = 0; i < s->num_slots; i++) {
+        struct client *c = client_at(s, i);
+        if (c->state != C_FREE && c->state != C_DRAINING)
+            close_client(s, c);
     }
 
-    s->ps[0].fd = fd;
-    s->ps[0].events = POLLIN;
-    s->ps[0].revents = 0;
+#ifdef HTTP_ASYNCIO
+    if (s->backend == HTTP_BACKEND_ASYNCIO) {
+        io_free(&s->ioc);
+        for (int i = 0; i < s->num_slots; i++) {
+            struct client *c = client_at(s, i);
+            if (c->state == C_DRAINING) {
+                free(c->recv_buffer);
+                release_iobuf(s, &c->sending);
+                c->state = C_FREE;
+            }
+        }
+        free(s->recv_pool);
+        free(s->res);
+        free(s->ops);
+        free_buffer_pool(s);
+        free_client_table(s);
+        return;
+    }
+#endif
 
-    return s;
+    if (s->epfd >= 0)
+        close(s->epfd);
+    close(s->fd);
+    free_buffer_pool(s);
+    free_client_table(s);
 }
 
-void http_server_free(struct server *s)
+/*
+ * What was sent is only dropped from the start of the
+ * output when more room is needed.
+ */
+static int reserve_output(struct server *s, struct client *c, size_t min)
 {
-    for (int i = 0; i < s->ncs; i++) {
-        int ci = s->pis[i];
-        struct client *c = &s->cs[ci];
-        close_client(s, c);
-    }
-    close(s->fd);
+    if (c->output_head > 0 && c->output.size - c->output.used < min)
+        rebase_output(c);
+    return ensure_free_space(s, &c->output, min);
 }
 
-bool http_server_append_output(struct client *c, void *data, size_t size)
+static bool append_output(struct server *s, struct client *c, void *data, size_t size)
 {
     if (data == NULL || size == 0)
         return true;
-    if (!ensure_free_space(&c->output, size))
+    if (!reserve_output(s, c, size))
         return false;
     memcpy(c->output.data + c->output.used, data, size);
     c->output.used += size;
     if (size > 0)
-        c->pitem->events |= POLLOUT;
+        watch_output(s, c);
     return true;
 }
 
-bool http_server_append_output_string(struct client *c, char *str)
+static bool append_output_string(struct server *s, struct client *c, char *str)
 {
-    return append_output(c, str, str ? strlen(str) : 0);
+    return append_output(s, c, str, str ? strlen(str) : 0);
 }
 
-bool http_server_append_output_format_2(struct client *c, const char *f, va_list args)
+static bool append_output_format_2(struct server *s, struct client *c, const char *f, va_list args)
 {
     va_list args_copy;
     va_copy(args_copy, args);
@@ -431,7 +1848,7 @@ bool http_server_append_output_format_2(struct client *c, const char *f, va_list
     if (n < 0) return false;
 
     if ((size_t) n + 1 >= c->output.size - c->output.used) {
-        if (!ensure_free_space(&c->output, n+1)) {
+        if (!reserve_output(s, c, n+1)) {
             va_end(args_copy);
             return false;
         }
@@ -442,18 +1859,18 @@ bool http_server_append_output_format_2(struct client *c, const char *f, va_list
     c->output.used += n;
 
     if (n > 0)
-        c->pitem->events |= POLLOUT;
+        watch_output(s, c);
 
     va_end(args_copy);
     return true;
 }
 
-bool http_server_append_output_format(struct client *c, const char *f, ...)
+static bool append_output_format(struct server *s, struct client *c, const char *f, ...)
 {
     bool ok;
     va_list args;
     va_start(args, f);
-    ok = append_output_format_2(c, f, args);
+    ok = append_output_format_2(s, c, f, args);
     va_end(args);
     return ok;
 }
@@ -530,16 +1947,18 @@ const char *reason_phrase(int status)
 
 void send_basic_response_and_close(struct server *s, struct client *c, int minor, int status)
 {
+    count_event(s, COUNTER_REJECTED);
+
     bool ok;
     if (minor == 0)
-        ok = append_output_format(c,
+        ok = append_output_format(s, c,
             "HTTP/1.0 %d %s\r\n"
             "Content-Length: 0\r\n"
             "\r\n",
             status, reason_phrase(status));
     else {
         assert(minor == 1);
-        ok = append_output_format(c, 
+        ok = append_output_format(s, c, 
             "HTTP/1.1 %d %s\r\n"
             "Content-Length: 0\r\n"
             "Connection: Close\r\n"
@@ -566,11 +1985,20 @@ uint32_t http_server_wait_request(struct server *s,
         c = pop_client(s);
         c->state = C_POPPED;
 
-        size_t i = find(&c->input, "\r\n\r\n");
-        assert(i != (size_t) -1);
+        uint64_t popped_ns = metrics_time_ns();
+        record_phase(s, PHASE_QUEUE, c->queued_ns, popped_ns);
 
-        char  *head = c->input.data;
-        size_t head_len = i + 4;
+        // The request is parsed where it was received and
+        // the request's slices point into the input buffer.
+        struct iobuf pending = {
+            .data = c->input.data + c->input_head,
+            .size = c->input.size - c->input_head,
+            .used = c->input.used - c->input_head,
+        };
+        assert(c->head_length > 0);
+
+        char  *head = pending.data;
+        size_t head_len = c->head_length;
 
         if (parse_request_head(head, head_len, r) != P_OK) {
             send_basic_response_and_close(s, c, 1, 400);
@@ -583,55 +2011,95 @@ uint32_t http_server_wait_request(struct server *s,
         }
 
         size_t content_length;
+        size_t body_length;
         {
             struct slice content_length_header_value;
-            if (!find_header(r, "Content-Length", &content_length_header_value)) {
-                int transfer_encoding = find_and_parse_transfer_encoding(r);
-                if (transfer_encoding < 0) {
+            bool has_content_length = find_known_header(r, H_CONTENT_LENGTH, &content_length_header_value);
+
+            int transfer_encoding = find_and_parse_transfer_encoding(r);
+            if (transfer_encoding < 0) {
+                send_basic_response_and_close(s, c, r->minor, 400);
+                continue;
+            }
+
+            if (transfer_encoding != 0) {
+
+                // Having both headers is how requests are
+                // smuggled past proxies, so it's refused.
+                if (has_content_length || !(transfer_encoding & T_CHUNKED)) {
                     send_basic_response_and_close(s, c, r->minor, 400);
                     continue;
                 }
-                if (transfer_encoding & T_CHUNKED) {
-                    send_basic_response_and_close(s, c, r->minor, 411); // 411 Length required
+                if (transfer_encoding != T_CHUNKED) {
+                    send_basic_response_and_close(s, c, r->minor, 501); // 501 Not Implemented
                     continue;
                 }
-                content_length = 0;
-            } else {
+
+                // The body is decoded in place once it was
+                // received entirely.
+                int res = parse_chunked_body(head + head_len, pending.used - head_len, false,
+                                             &body_length, &content_length);
+                if (res == P_INCOMPLETE) {
+                    c->state = C_IDLE;
+                    update_timer(s, c, true);
+                    continue;
+                }
+                if (res != P_OK) {
+                    send_basic_response_and_close(s, c, r->minor, 400);
+                    continue;
+                }
+                parse_chunked_body(head + head_len, body_length, true, &body_length, &content_length);
+
+            } else if (has_content_length) {
                 content_length = parse_content_length(content_length_header_value);
                 if (content_length == (size_t) -1) {
                     send_basic_response_and_close(s, c, r->minor, 400);
                     continue;
                 }
+                body_length = content_length;
+            } else {
+                content_length = 0;
+                body_length = 0;
             }
         }
 
-        size_t total_request_length = head_len + content_length;
-        if (c->input.used < total_request_length)
+        size_t total_request_length = head_len + body_length;
+        if (pending.used < total_request_length) {
+            // Queued again once more of the body arrives
+            c->state = C_IDLE;
+            update_timer(s, c, true);
             continue;
+        }
 
         r->content.data = head + head_len;
         r->content.size = content_length;
         c->state = C_STATUS;
         c->minor = r->minor;
         c->connheader = -1;
+        c->streaming = false;
+        c->no_content = false;
+        c->content_refs = 0;
         c->request_length = total_request_length;
+
+        c->handler_start_ns = metrics_time_ns();
+        record_phase(s, PHASE_PARSE, popped_ns, c->handler_start_ns);
+        count_event(s, COUNTER_REQUESTS);
         break;
     }
-    _Static_assert(MAX_CLIENTS < (1<<16)-1);
-    assert(c->gen < (1<<16)-1);
+    assert(c->gen < HANDLE_GEN_MASK);
     uint32_t gen = c->gen;
-    uint32_t idx = c - s->cs;
-    uint32_t handle = gen | (idx << 16);
+    uint32_t idx = c->index;
+    uint32_t handle = gen | (idx << HANDLE_GEN_BITS);
     return handle;
 }
 
 struct client *client_from_handle(struct server *s, uint32_t handle)
 {
-    uint16_t gen = handle & 0xFFFF;
-    uint16_t idx = handle >> 16;
-    if (idx >= s->ncs)
+    uint16_t gen = handle & HANDLE_GEN_MASK;
+    uint32_t idx = handle >> HANDLE_GEN_BITS;
+    if (idx >= (uint32_t) s->num_slots)
         return NULL;
-    struct client *c = &s->cs[idx];
+    struct client *c = client_at(s, idx);
     if (c->gen != gen)
         return NULL;
     return c;
@@ -647,15 +2115,16 @@ void http_server_set_status(struct server *s, uint32_t handle, int status)
         return;
     }
 
-    if (!append_output_format(c, "HTTP/1.%d %d %s\r\n", c->minor, status, reason_phrase(status)))
+    if (!append_output_format(s, c, "HTTP/1.%d %d %s\r\n", c->minor, status, reason_phrase(status)))
         close_client(s, c);
     else {
         c->state = C_HEADER;
+        c->no_content = (status < 200 || status == 204 || status == 304);
     }
 }
 
-bool http_server_parse_header(char *src, size_t len,
-                              struct header *h)
+static bool parse_header(char *src, size_t len,
+                       struct header *h)
 {
     size_t cur = 0;
     size_t start;
@@ -664,7 +2133,7 @@ bool http_server_parse_header(char *src, size_t len,
     while (cur < len && src[cur] != ':')
         cur++;
     h->name.data = src + start;
-    h->name.size = len - start;
+    h->name.size = cur - start;
 
     if (cur == len)
         return false;
@@ -694,7 +2163,7 @@ void http_server_append_header_format(struct server *s, uint32_t handle, char *f
     }
     mem[num] = '\0';
 
-    append_header(s, handle, mem);
+    http_server_append_header(s, handle, mem);
 }
 
 void http_server_append_header(struct server *s, uint32_t handle, char *text)
@@ -713,10 +2182,11 @@ void http_server_append_header(struct server *s, uint32_t handle, char *text)
     if (!parse_header(text, text_len, &h))
         return;    
 
-    if (match_header_name(h.name, "Content-Length"))
+    int known = classify_header(h.name);
+    if (known == H_CONTENT_LENGTH)
         return;
     
-    if (match_header_name(h.name, "Connection")) {
+    if (known == H_CONNECTION) {
 
         if (match_header_value(h.value, "Keep-Alive")) {
             c->connheader = 1;
@@ -727,24 +2197,44 @@ void http_server_append_header(struct server *s, uint32_t handle, char *text)
         }
 
     } else {
-        if (!append_output(c, text, text_len))
+        if (!append_output(s, c, text, text_len))
             return;
-        if (!append_output_string(c, "\r\n")) {
+        if (!append_output_string(s, c, "\r\n")) {
             close_client(s, c);
             return;
         }
     }
 }
 
+/*
+ * Appends a block of complete header lines, each ending
+ * with \r\n, as it is. Unlike http_server_append_header
+ * the headers aren't inspected, so the block must not
+ * contain Content-Length or Connection. It's meant for
+ * headers that are built once and sent many times.
+ */
+void http_server_append_headers(struct server *s, uint32_t handle, char *block, size_t size)
+{
+    struct client *c = client_from_handle(s, handle);
+    if (c == NULL)
+        return;
+
+    if (c->state != C_HEADER)
+        return;
+
+    if (!append_output(s, c, block, size))
+        close_client(s, c);
+}
+
 bool append_special_headers(struct server *s, struct client *c)
 {
     if (c->minor == 1) {
         bool ok;
-        if (c->connheader != 0 && c->num_served < 5 && s->ncs < 0.7 * MAX_CLIENTS) {
-            ok = append_output_string(c, "Connection: Keep-Alive\r\n");
+        if (c->connheader != 0 && c->num_served < KEEPALIVE_MAX_REQUESTS-1 && s->ncs < s->keepalive_limit) {
+            ok = append_output_string(s, c, "Connection: Keep-Alive\r\n");
             c->keepalive = true;
         } else {
-            ok = append_output_string(c, "Connection: Close\r\n");
+            ok = append_output_string(s, c, "Connection: Close\r\n");
             c->keepalive = false;
         }
         if (!ok) {
@@ -753,16 +2243,27 @@ bool append_special_headers(struct server *s, struct client *c)
         }
     }
 
-    if (!append_output_string(c, "Content-Length: ")) {
-        close_client(s, c);
-        return false;
-    }
-    c->content_length_offset = c->output.used;
-    if (!append_output_string(c, "         \r\n")) {
-        close_client(s, c);
-        return false;
+    if (c->streaming) {
+        // HTTP/1.0 clients get the content as it is and
+        // the end of the connection marks its end.
+        if (c->minor == 0)
+            c->keepalive = false;
+        else if (!append_output_string(s, c, "Transfer-Encoding: chunked\r\n")) {
+            close_client(s, c);
+            return false;
+        }
+    } else if (!c->no_content) {
+        if (!append_output_string(s, c, "Content-Length: ")) {
+            close_client(s, c);
+            return false;
+        }
+        c->content_length_offset = c->output.used;
+        if (!append_output_string(s, c, "                    \r\n")) {
+            close_client(s, c);
+            return false;
+        }
     }
-    if (!append_output_string(c, "\r\n")) {
+    if (!append_output_string(s, c, "\r\n")) {
         close_client(s, c);
         return false;
     }
@@ -771,6 +2272,67 @@ bool append_special_headers(struct server *s, struct client *c)
     return true;
 }
 
+/*
+ * Sends what was appended to a streamed response so far,
+ * once there is enough of it to be worth a system call.
+ * Whatever the socket doesn't take is sent by the event
+ * loop.
+ */
+static void flush_stream(struct server *s, struct client *c)
+{
+    if (c->output.used - c->output_head < STREAM_FLUSH_SIZE && c->num_refs == 0)
+        return;
+
+#ifdef HTTP_ASYNCIO
+    if (s->backend == HTTP_BACKEND_ASYNCIO) {
+        if (!start_send(s, c))
+            close_client(s, c);
+        else
+            io_submit(&s->ioc);
+        return;
+    }
+#endif
+
+    if (!socket_output(s, c))
+        close_client(s, c);
+}
+
+/*
+ * In chunked responses the data of each append is framed
+ * as a chunk. Chunks of formatted content are given a size
+ * of fixed width that is patched once the content is in
+ * the buffer. An empty chunk would end the response, so
+ * it's dropped.
+ */
+#define CHUNK_SIZE_PLACEHOLDER "00000000\r\n"
+
+static bool begin_chunk(struct server *s, struct client *c, size_t *offset)
+{
+    // Relative to the head since the output may be
+    // moved to make room for the content.
+    *offset = c->output.used - c->output_head;
+    return append_output_string(s, c, CHUNK_SIZE_PLACEHOLDER);
+}
+
+static bool end_chunk(struct server *s, struct client *c, size_t offset)
+{
+    offset += c->output_head;
+
+    size_t header_len = sizeof(CHUNK_SIZE_PLACEHOLDER)-1;
+    size_t size = c->output.used - offset - header_len;
+    if (size == 0) {
+        c->output.used = offset;
+        return true;
+    }
+    if (size > 0xFFFFFFFF)
+        return false;
+
+    char buf[9];
+    snprintf(buf, sizeof(buf), "%08zx", size);
+    memcpy(c->output.data + offset, buf, 8);
+    return append_output_string(s, c, "\r\n");
+}
+
 void http_server_append_content(struct server *s, uint32_t handle, void *data, size_t size)
 {
     struct client *c = client_from_handle(s, handle);
@@ -783,17 +2345,101 @@ void http_server_append_content(struct server *s, uint32_t handle, void *data, s
     if (c->state != C_CONTENT)
         return;
 
-    if (!append_output(c, data, size)) {
+    bool chunked = c->streaming && c->minor == 1;
+
+    if (chunked && size > 0 && !append_output_format(s, c, "%zx\r\n", size)) {
+        close_client(s, c);
+        return;
+    }
+
+    if (!append_output(s, c, data, size)) {
+        close_client(s, c);
+        return;
+    }
+
+    if (chunked && size > 0 && !append_output_string(s, c, "\r\n")) {
+        close_client(s, c);
+        return;
+    }
+
+    if (c->streaming)
+        flush_stream(s, c);
+}
+
+/*
+ * Appends content without copying it. The buffer is written
+ * to the socket from where it is, so it must not change
+ * until release is called with userp, which happens once
+ * it was sent or the client went away. With no release
+ * function the buffer must outlive the server.
+ *
+ * Buffers under OUTPUT_REF_MIN_SIZE are copied since it's
+ * cheaper, and so is any buffer once the client references
+ * OUTPUT_REFS of them or with the asyncio backend. Then
+ * release is called before returning.
+ */
+void http_server_append_content_ref(struct server *s, uint32_t handle,
+                                    void *data, size_t size,
+                                    void (*release)(void*), void *userp)
+{
+    struct client *c = client_from_handle(s, handle);
+    if (c == NULL) {
+        if (release) release(userp);
+        return;
+    }
+
+    if (size < OUTPUT_REF_MIN_SIZE
+        || c->num_refs == OUTPUT_REFS
+        || s->backend == HTTP_BACKEND_ASYNCIO) {
+        http_server_append_content(s, handle, data, size);
+        if (release) release(userp);
+        return;
+    }
+
+    if (c->state == C_HEADER)
+        if (!append_special_headers(s, c)) {
+            if (release) release(userp);
+            return;
+        }
+
+    if (c->state != C_CONTENT) {
+        if (release) release(userp);
+        return;
+    }
+
+    bool chunked = c->streaming && c->minor == 1;
+
+    if (chunked && !append_output_format(s, c, "%zx\r\n", size)) {
+        close_client(s, c);
+        if (release) release(userp);
+        return;
+    }
+
+    c->refs[c->num_refs++] = (struct output_ref) {
+        .at      = c->output.used,
+        .data    = data,
+        .size    = size,
+        .release = release,
+        .userp   = userp,
+    };
+    c->content_refs += size;
+    watch_output(s, c);
+
+    // From here on, closing the client releases the buffer
+    if (chunked && !append_output_string(s, c, "\r\n")) {
         close_client(s, c);
         return;
     }
+
+    if (c->streaming)
+        flush_stream(s, c);
 }
 
 void http_server_append_content_format(struct server *s, uint32_t handle, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
-    append_content_format_2(s, handle, format, args);
+    http_server_append_content_format_2(s, handle, format, args);
     va_end(args);
 }
 
@@ -809,70 +2455,116 @@ void http_server_append_content_format_2(struct server *s, uint32_t handle, cons
     if (c->state != C_CONTENT)
         return;
 
-    if (!append_output_format_2(c, format, args)) {
+    bool chunked = c->streaming && c->minor == 1;
+
+    size_t offset;
+    if (chunked && !begin_chunk(s, c, &offset)) {
+        close_client(s, c);
+        return;
+    }
+
+    if (!append_output_format_2(s, c, format, args)) {
+        close_client(s, c);
+        return;
+    }
+
+    if (chunked && !end_chunk(s, c, offset)) {
         close_client(s, c);
         return;
     }
+
+    if (c->streaming)
+        flush_stream(s, c);
 }
 
 void http_server_append_content_string(struct server *s, uint32_t handle, char *text)
 {
-    append_content(s, handle, text, strlen(text));
+    http_server_append_content(s, handle, text, strlen(text));
 }
 
-void http_server_send_response(struct server *s, uint32_t handle)
+/*
+ * Completes the response. If fd isn't negative, size
+ * bytes of the file starting from offset are sent after
+ * the content that was appended. Returns false if the
+ * client was closed, in which case the file wasn't taken.
+ */
+static bool complete_response(struct server *s, uint32_t handle,
+                              int fd, size_t offset, size_t size)
 {
     struct client *c = client_from_handle(s, handle);
-    if (c == NULL) return;
+    if (c == NULL) return false;
 
     if (c->state == C_STATUS) {
-        set_status(s, handle, 200);
+        http_server_set_status(s, handle, 200);
         c = client_from_handle(s, handle);
-        if (c == NULL) return;
+        if (c == NULL) return false;
     }
 
     if (c->state == C_HEADER) {
-        append_content(s, handle, NULL, 0);
+        http_server_append_content(s, handle, NULL, 0);
         c = client_from_handle(s, handle);
-        if (c == NULL) return;
+        if (c == NULL) return false;
     }
 
     if (c->state != C_CONTENT) {
         close_client(s, c);
-        return;
+        return false;
     }
 
-    {
-        size_t content_length = c->output.used - c->content_offset;
+    // Responses that are pipelined after one that wasn't
+    // sent yet are written along with it.
+    uint64_t complete_ns = metrics_time_ns();
+    record_phase(s, PHASE_HANDLER, c->handler_start_ns, complete_ns);
+    count_event(s, COUNTER_RESPONSES);
+    if (c->write_start_ns == 0)
+        c->write_start_ns = complete_ns;
+
+    if (c->streaming) {
+        if (c->minor == 1 && !append_output_string(s, c, "0\r\n\r\n")) {
+            close_client(s, c);
+            return false;
+        }
+        watch_output(s, c);
+    } else if (c->no_content) {
+        watch_output(s, c);
+    } else {
+        size_t content_length = c->output.used - c->content_offset + c->content_refs + size;
 
-        char buf[16];
-        int n = snprintf(buf, sizeof(buf), "%ld", content_length);
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "%zu", content_length);
         if (n < 1) {
             close_client(s, c);
-            return;
+            return false;
         }
-        assert(n < 10);
+        assert(n <= 20);
         memcpy(c->output.data + c->content_length_offset, buf, n);
-        c->pitem->events |= POLLOUT;
+        watch_output(s, c);
     }
 
-    if (c->input.used == c->request_length) {
-        free(c->input.data);
-        c->input.data = NULL;
-        c->input.used = 0;
-        c->input.size = 0;
-    } else {
-        memmove(c->input.data,
-                c->input.data + c->request_length,
-                c->input.used - c->request_length);
-        c->input.used -= c->request_length;
+    if (fd >= 0) {
+        c->file_fd   = fd;
+        c->file_at   = c->output.used;
+        c->file_pos  = offset;
+        c->file_left = size;
+    }
+
+    // Pipelined requests that follow are served in order
+    // since the client is only queued again once this
+    // response is complete, and responses are appended
+    // to the output one after the other.
+    c->input_head += c->request_length;
+    if (c->input_head == c->input.used) {
+        release_iobuf(s, &c->input);
+        c->input_head = 0;
     }
     c->request_length = 0;
+    c->head_length = 0;
+    c->head_scanned = 0;
 
     c->num_served++;
     if (c->keepalive) {
 
-        if (find(&c->input, "\r\n\r\n") != (size_t) -1) {
+        if (request_head_ready(c)) {
             push_client(s, c);
             c->state = C_QUEUED;
         } else {
@@ -885,4 +2577,222 @@ void http_server_send_response(struct server *s, uint32_t handle)
     }
 
     invalidate_handles(c);
+    return true;
+}
+
+void http_server_send_response(struct server *s, uint32_t handle)
+{
+    complete_response(s, handle, -1, 0, 0);
+}
+
+/*
+ * Copies a region of a file into the response content.
+ * It's used when the file can't be streamed.
+ */
+static bool append_file_content(struct server *s, uint32_t handle,
+                                int fd, off_t offset, size_t size)
+{
+    struct client *c = client_from_handle(s, handle);
+    if (c && c->state == C_STATUS)
+        http_server_set_status(s, handle, 200);
+
+    while (size > 0) {
+        char mem[1<<13]; // 8K
+        size_t max = size < sizeof(mem) ? size : sizeof(mem);
+        ssize_t num = pread(fd, mem, max, offset);
+        if (num < 0 && errno == EINTR)
+            continue;
+        if (num <= 0)
+            return false;
+        http_server_append_content(s, handle, mem, num);
+        offset += num;
+        size   -= num;
+    }
+    return true;
+}
+
+/*
+ * Switches the response to streaming mode. Its content
+ * isn't buffered until the response is complete, but is
+ * sent as it's appended using the chunked transfer coding,
+ * so that the client starts receiving a large or slowly
+ * generated response early and the server doesn't need
+ * to hold all of it. HTTP/1.0 clients receive the content
+ * as it is and the connection is closed at the end.
+ *
+ * It must be called before any content is appended.
+ * http_server_send_response ends the stream.
+ */
+void http_server_stream_response(struct server *s, uint32_t handle)
+{
+    struct client *c = client_from_handle(s, handle);
+    if (c == NULL) return;
+
+    if (c->state != C_STATUS && c->state != C_HEADER) {
+        fprintf(stderr, "Warning: Can't stream the response at this time\n");
+        return;
+    }
+    c->streaming = true;
+}
+
+/*
+ * Like http_server_send_response, but size bytes of the
+ * file starting from offset are added to the content. The
+ * file isn't read into memory. It's sent straight from the
+ * page cache while the event loop runs, so the memory used
+ * by a download doesn't depend on the file's size. The
+ * descriptor is owned by the server from then on and is
+ * closed when the file was sent or the client went away.
+ */
+void http_server_send_response_file(struct server *s, uint32_t handle,
+                                    int fd, size_t offset, size_t size)
+{
+    struct client *c = client_from_handle(s, handle);
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+
+    // One file per client can be streamed at the time. If
+    // the previous response's file is still in progress,
+    // this one is copied. So is the file of a response in
+    // streaming mode, which needs it framed in chunks.
+    bool stream = c->file_fd < 0 && !c->streaming;
+
+#ifdef HTTP_ASYNCIO
+    if (stream && s->backend == HTTP_BACKEND_ASYNCIO) {
+        io_handle file_handle = io_attach_file(&s->ioc, fd);
+        if (file_handle == IO_INVALID)
+            stream = false;
+        else {
+            c->file_handle = file_handle;
+            if (!complete_response(s, handle, fd, offset, size))
+                io_close(&s->ioc, file_handle);
+            return;
+        }
+    }
+#endif
+
+    if (stream) {
+        if (!complete_response(s, handle, fd, offset, size))
+            close(fd);
+        return;
+    }
+
+    bool ok = append_file_content(s, handle, fd, offset, size);
+    close(fd);
+
+    if (!ok) {
+        // The status line can't be taken back
+        c = client_from_handle(s, handle);
+        if (c) close_client(s, c);
+        return;
+    }
+    http_server_send_response(s, handle);
+}
+
+static const char *counter_names[COUNTER_COUNT] = {
+    [COUNTER_ACCEPTED]  = "http_connections_accepted_total",
+    [COUNTER_CLOSED]    = "http_connections_closed_total",
+    [COUNTER_TIMEOUTS]  = "http_connections_timed_out_total",
+    [COUNTER_REQUESTS]  = "http_requests_total",
+    [COUNTER_REJECTED]  = "http_requests_rejected_total",
+    [COUNTER_RESPONSES] = "http_responses_total",
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_ACCEPT]    = "accept",
+    [PHASE_READ_HEAD] = "read_head",
+    [PHASE_QUEUE]     = "queue",
+    [PHASE_PARSE]     = "parse",
+    [PHASE_HANDLER]   = "handler",
+    [PHASE_WRITE]     = "write",
+    [PHASE_CLOSE]     = "close",
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+
+/*
+ * Responds with the metrics in the Prometheus text format.
+ * Servers started by http_server_run_shards report the sum
+ * of all shards, which are read while their threads keep
+ * running. The phases are summaries with the quantiles in
+ * seconds, rounded up to the bucket of the value.
+ */
+void http_server_send_metrics(struct server *s, uint32_t handle)
+{
+    struct server_metrics *own = &s->metrics;
+    struct server_metrics **group = &own;
+    int group_size = 1;
+    if (s->metrics_group) {
+        group = s->metrics_group;
+        group_size = s->metrics_group_size;
+    }
+
+    // The gauges of this server would be as old as the
+    // last wait otherwise.
+    update_gauges(s);
+
+    http_server_set_status(s, handle, 200);
+    http_server_append_header(s, handle, "Content-Type: text/plain; version=0.0.4");
+
+    for (int k = 0; k < COUNTER_COUNT; k++) {
+        uint64_t total = 0;
+        for (int i = 0; i < group_size; i++)
+            total += atomic_load_explicit(&group[i]->counters[k], memory_order_relaxed);
+        http_server_append_content_format(s, handle,
+            "# TYPE %s counter\n%s %llu\n",
+            counter_names[k], counter_names[k], (unsigned long long) total);
+    }
+
+    int64_t connections = 0;
+    int64_t queued = 0;
+    for (int i = 0; i < group_size; i++) {
+        connections += atomic_load_explicit(&group[i]->connections, memory_order_relaxed);
+        queued      += atomic_load_explicit(&group[i]->queued, memory_order_relaxed);
+    }
+    http_server_append_content_format(s, handle,
+        "# TYPE http_connections gauge\nhttp_connections %lld\n"
+        "# TYPE http_queued_requests gauge\nhttp_queued_requests %lld\n",
+        (long long) connections, (long long) queued);
+
+    http_server_append_content_string(s, handle, "# TYPE http_phase_seconds summary\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+
+        uint64_t buckets[HISTOGRAM_BUCKETS] = {0};
+        uint64_t sum = 0;
+        for (int i = 0; i < group_size; i++) {
+            struct histogram *h = &group[i]->phases[p];
+            for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+                buckets[j] += atomic_load_explicit(&h->buckets[j], memory_order_relaxed);
+            sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+        }
+
+        // The count is taken from the buckets so that the
+        // quantiles agree with it while values are added.
+        uint64_t count = 0;
+        for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+            count += buckets[j];
+
+        int j = 0;
+        uint64_t seen = 0;
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            uint64_t rank = (uint64_t) (quantiles[q] * count + 0.5);
+            if (rank == 0)
+                rank = 1;
+            while (j < HISTOGRAM_BUCKETS && seen + buckets[j] < rank)
+                seen += buckets[j++];
+            double value = (count == 0 || j == HISTOGRAM_BUCKETS) ? 0 : histogram_bucket_max(j) / 1e9;
+            http_server_append_content_format(s, handle,
+                "http_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                phase_names[p], quantiles[q], value);
+        }
+        http_server_append_content_format(s, handle,
+            "http_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+            "http_phase_seconds_count{phase=\"%s\"} %llu\n",
+            phase_names[p], sum / 1e9,
+            phase_names[p], (unsigned long long) count);
+    }
+
+    http_server_send_response(s, handle);
 }
@@ -4,13 +4,155 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <poll.h>
+#include <sys/types.h>
 #include "parse.h"
 
+#ifdef HTTP_ASYNCIO
+#include "../asyncio/io.h"
+#endif
+
+// Default limit of concurrent connections. The client table
+// starts empty and grows up to the limit as clients connect.
 #ifndef MAX_CLIENTS
 #define MAX_CLIENTS 512
 #endif
 
+// Most clients a server can be configured for, with any
+// backend. Client handles have room for this many.
+#define MAX_CLIENTS_LIMIT (1 << 16)
+
+// Clients are allocated in chunks of this many, which are
+// never moved so that pointers to clients stay valid.
+#ifndef CLIENT_CHUNK
+#define CLIENT_CHUNK 256
+#endif
+
+#ifndef EPOLL_BATCH
+#define EPOLL_BATCH 128
+#endif
+
+// Requests served on a connection before it's closed.
+// Pipelining clients send many requests per connection.
+#ifndef KEEPALIVE_MAX_REQUESTS
+#define KEEPALIVE_MAX_REQUESTS 100
+#endif
+
+// Bytes of a streamed response that are buffered
+// before trying to send them.
+#ifndef STREAM_FLUSH_SIZE
+#define STREAM_FLUSH_SIZE (1<<14)
+#endif
+
+// Buffers that each client's output can reference instead
+// of holding a copy (poll and epoll backends only), and the
+// size under which they are copied anyway.
+#ifndef OUTPUT_REFS
+#define OUTPUT_REFS 8
+#endif
+
+#ifndef OUTPUT_REF_MIN_SIZE
+#define OUTPUT_REF_MIN_SIZE 1024
+#endif
+
+#ifndef RECV_CHUNK
+#define RECV_CHUNK 4096
+#endif
+
+// Number of buffers shared by all clients for receiving
+// (asyncio backend only). Must be a power of 2.
+#ifndef RECV_BUFFERS
+#define RECV_BUFFERS 256
+#endif
+
+// Released I/O buffers of up to BUFFER_POOL_MAX_SIZE bytes
+// are kept for reuse, up to BUFFER_POOL_DEPTH of each size.
+#ifndef BUFFER_POOL_DEPTH
+#define BUFFER_POOL_DEPTH 64
+#endif
+#define BUFFER_POOL_MIN_SIZE 512
+#define BUFFER_POOL_CLASSES  8
+#define BUFFER_POOL_MAX_SIZE (BUFFER_POOL_MIN_SIZE << (BUFFER_POOL_CLASSES-1))
+
+// Granularity of the connection timeouts in milliseconds.
+// The timer wheel has TIMER_WHEEL_LEVELS levels of 2^BITS
+// slots each, which covers 2^(BITS*LEVELS) ticks.
+#ifndef TIMER_TICK_MS
+#define TIMER_TICK_MS 100
+#endif
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+// Latency histograms have 2^HISTOGRAM_SUB_BITS buckets for
+// each power of 2 nanoseconds, which keeps the error within
+// 1/2^HISTOGRAM_SUB_BITS of the value, up to 2^HISTOGRAM_MAX_BITS
+// ns (about 69 seconds). Longer times go in the last bucket.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+enum {
+    HTTP_BACKEND_POLL,
+    HTTP_BACKEND_EPOLL,
+    HTTP_BACKEND_ASYNCIO, // Requires HTTP_ASYNCIO
+};
+
+enum {
+    PHASE_ACCEPT,    // Setting up an accepted connection
+    PHASE_READ_HEAD, // From the first bytes of a request head to the last ones
+    PHASE_QUEUE,     // From the head being received to wait_request picking it
+    PHASE_PARSE,     // Parsing the head and framing the body
+    PHASE_HANDLER,   // From wait_request returning to the response being complete
+    PHASE_WRITE,     // From the response being complete to the output being sent
+    PHASE_CLOSE,     // Closing a connection
+    PHASE_COUNT,
+};
+
+enum {
+    COUNTER_ACCEPTED,
+    COUNTER_CLOSED,
+    COUNTER_TIMEOUTS,
+    COUNTER_REQUESTS,
+    COUNTER_REJECTED, // Requests answered with an error by the server
+    COUNTER_RESPONSES,
+    COUNTER_COUNT,
+};
+
+struct histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum; // In ns
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Only the thread that drives the server writes them, with
+ * relaxed loads and stores instead of read-modify-writes,
+ * so other threads can read them at any time without locks.
+ * Compiled out with HTTP_NO_METRICS.
+ */
+struct server_metrics {
+    _Atomic uint64_t counters[COUNTER_COUNT];
+    _Atomic int64_t  connections; // Last value of ncs
+    _Atomic int64_t  queued;      // Last value of qused
+    struct histogram phases[PHASE_COUNT];
+};
+
+struct server_config {
+    int  backend; // HTTP_BACKEND_*
+    bool reuse_port;
+    int  max_clients;     // Zero means MAX_CLIENTS. At most MAX_CLIENTS_LIMIT
+    int  keepalive_limit; // Connections over which keep-alive is disabled. Zero means 70% of max_clients
+    int  backlog;         // Zero means 32
+
+    // Zero means the default, negative disables the timeout
+    int  header_timeout_ms;    // Receiving a request head. Default 10s
+    int  body_timeout_ms;      // Between parts of a request body. Default 30s
+    int  keepalive_timeout_ms; // Waiting for the next request. Default 5s
+    int  write_timeout_ms;     // Between parts of a response. Default 30s
+};
+
 struct iobuf {
     char  *data;
     size_t size;
@@ -26,49 +168,173 @@ enum {
     C_HEADER,
     C_CONTENT,
     C_CLOSE,
+    C_DRAINING, // Closed but with pending operations (asyncio backend only)
+};
+
+enum {
+    TIMER_NONE,
+    TIMER_HEADER,
+    TIMER_BODY,
+    TIMER_KEEPALIVE,
+    TIMER_WRITE,
+    TIMER_KINDS,
+};
+
+struct client_timer {
+    struct client_timer *prev;
+    struct client_timer *next;
+    uint64_t expire; // In ticks
+    int      kind;   // TIMER_*
+};
+
+struct timer_wheel {
+    uint64_t tick;
+    int      count; // Armed timers
+    struct client_timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // List heads
+};
+
+// Buffer owned by the caller that is sent after the first
+// "at" bytes of the client's output
+struct output_ref {
+    size_t at;
+    char  *data;
+    size_t size;
+    void (*release)(void*);
+    void  *userp;
 };
 
 struct client {
     uint16_t gen;
+    int index; // In the client table
     int state;
-    struct pollfd *pitem;
+    int fd;
+    struct pollfd *pitem; // Only used by the poll backend
+    int flush_index;      // Only used by the epoll and asyncio backends
+    struct client_timer timer;
+
+#ifdef HTTP_ASYNCIO
+    io_handle handle;
+    char *recv_buffer; // Without a shared receive pool or when it ran out
+    bool  recving;
+    struct iobuf sending;
+    size_t sent;
+    io_handle file_handle; // Owns file_fd
+    bool sending_file;
+#endif
     struct iobuf   input;
     struct iobuf   output;
+    size_t input_head;  // Bytes of input that belong to served requests
+    size_t head_scanned; // Bytes after input_head searched for the end of the head
+    size_t head_length;  // Of the next request if it was received, else 0
+    size_t output_head; // Bytes of output that were sent (poll and epoll backends)
+
+    struct output_ref refs[OUTPUT_REFS]; // By offset
+    int    num_refs;
+    size_t ref_sent;     // Bytes of the first reference that were sent
+    size_t content_refs; // Referenced bytes of the response's content
+
+    // File content streamed to the socket once the first
+    // file_at bytes of the output were sent, or -1.
+    int    file_fd;
+    size_t file_at;
+    off_t  file_pos;
+    size_t file_left;
 
     int num_served;
 
+    // Start of the phases the client is in, in ns, or zero
+    uint64_t head_start_ns;
+    uint64_t queued_ns;
+    uint64_t handler_start_ns;
+    uint64_t write_start_ns;
+
     int minor;
     int connheader; // -1 unspecified, 1 Keep-Alive, 0 Close
     size_t content_length_offset;
     size_t content_offset;
     size_t request_length;
     bool keepalive;
+    bool streaming; // The content is sent as it's appended
+    bool no_content; // The status doesn't allow content (1xx, 204 and 304)
+};
+
+struct pooled_buffer;
+
+struct buffer_pool {
+    struct pooled_buffer *lists[BUFFER_POOL_CLASSES]; // By size
+    int                  counts[BUFFER_POOL_CLASSES];
 };
 
 struct server {
 
     int fd;
+    int backend;
+    int epfd;
+    bool listener_paused; // The table is full (poll and epoll backends)
 
+    int max_clients;
+    int keepalive_limit;
+
+    // Client table. The arrays indexed by client have room
+    // for "capacity" entries and are reallocated as it grows.
     int ncs;
-    struct client cs[MAX_CLIENTS];
-    struct pollfd ps[MAX_CLIENTS+1];
-    int          pis[MAX_CLIENTS];
-    int         free[MAX_CLIENTS];
+    int num_slots; // Allocated clients
+    int capacity;
+    struct client **chunks; // CLIENT_CHUNK clients each
+    struct pollfd *ps;  // Listener and clients (poll backend only)
+    int           *pis;
+    int           *free;
+    int           nfree;
 
     size_t qhead;
     size_t qused;
-    struct client *qdata[MAX_CLIENTS];
+    struct client **qdata;
+
+#ifdef HTTP_ASYNCIO
+    struct io_context    ioc;
+    io_handle            listener;
+    char                *recv_pool;
+    struct io_resource  *res; // Listener, sockets and files
+    struct io_operation *ops;
+#endif
+
+    struct buffer_pool pool;
+
+    struct timer_wheel wheel;
+    uint64_t now_ms; // When the last wait returned
+    int  timeouts[TIMER_KINDS];
+    bool timer_pending; // Only used by the asyncio backend
+
+    uint64_t now_ns; // When the last wait returned, for the metrics
+    struct server_metrics metrics;
+
+    // Metrics of all the shards started with this server
+    // by http_server_run_shards, or NULL
+    struct server_metrics **metrics_group;
+    int metrics_group_size;
+
+    // Clients with output that was produced outside
+    // of the event loop (epoll and asyncio backends)
+    int nflush;
+    struct client **flush;
 };
 bool     http_server_init(struct server *s, const char *addr, uint16_t port);
+bool     http_server_init_ex(struct server *s, const char *addr, uint16_t port, struct server_config config);
+bool     http_server_init_shard(struct server *s, const char *addr, uint16_t port);
 void     http_server_free(struct server *s);
 uint32_t http_server_wait_request(struct server *s, struct request *r);
 void     http_server_set_status(struct server *s, uint32_t handle, int status);
 void     http_server_append_header(struct server *s, uint32_t handle, char *text);
 void     http_server_append_header_format(struct server *s, uint32_t handle, char *format, ...);
+void     http_server_append_headers(struct server *s, uint32_t handle, char *block, size_t size);
 void     http_server_append_content(struct server *s, uint32_t handle, void *data, size_t size);
+void     http_server_append_content_ref(struct server *s, uint32_t handle, void *data, size_t size, void (*release)(void*), void *userp);
 void     http_server_append_content_string(struct server *s, uint32_t handle, char *text);
 void     http_server_append_content_format(struct server *s, uint32_t handle, const char *format, ...);
 void     http_server_append_content_format_2(struct server *s, uint32_t handle, const char *format, va_list args);
+void     http_server_stream_response(struct server *s, uint32_t handle);
 void     http_server_send_response(struct server *s, uint32_t handle);
+void     http_server_send_response_file(struct server *s, uint32_t handle, int fd, size_t offset, size_t size);
+void     http_server_send_metrics(struct server *s, uint32_t handle);
 
 #endif /* SERVER_H */
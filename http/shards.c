@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../thread/thread.h"
+#include "shards.h"
+
+struct shard {
+    struct server server;
+    http_handler  handler;
+    void         *userp;
+    os_thread     thread;
+};
+
+static os_threadreturn shard_routine(void *arg)
+{
+    struct shard *sh = arg;
+    for (;;) {
+        struct request r;
+        uint32_t handle = http_server_wait_request(&sh->server, &r);
+        sh->handler(&sh->server, &r, handle, sh->userp);
+    }
+    return 0;
+}
+
+/*
+ * Starts one server per shard, each bound to the same
+ * address through SO_REUSEPORT and driven by its own
+ * thread. The handler is called from the shard's thread
+ * with that shard's server, so it must not share state
+ * between calls without synchronization.
+ *
+ * If num_shards is less than 1, one shard per online
+ * CPU is started. Returns false if the shards couldn't
+ * be started, else it doesn't return.
+ */
+bool http_server_run_shards(const char *addr, uint16_t port, int num_shards,
+                            http_handler handler, void *userp)
+{
+    if (num_shards < 1) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        num_shards = n < 1 ? 1 : n;
+    }
+
+    struct shard *shards = malloc(num_shards * sizeof(struct shard));
+    struct server_metrics **group = malloc(num_shards * sizeof(struct server_metrics*));
+    if (shards == NULL || group == NULL) {
+        free(shards);
+        free(group);
+        return false;
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        if (!http_server_init_shard(&shards[i].server, addr, port)) {
+            fprintf(stderr, "Couldn't start shard %d\n", i);
+            for (int j = 0; j < i; j++)
+                http_server_free(&shards[j].server);
+            free(shards);
+            free(group);
+            return false;
+        }
+        shards[i].handler = handler;
+        shards[i].userp = userp;
+        group[i] = &shards[i].server.metrics;
+    }
+
+    // Any shard can respond with the metrics of all of them
+    for (int i = 0; i < num_shards; i++) {
+        shards[i].server.metrics_group = group;
+        shards[i].server.metrics_group_size = num_shards;
+    }
+
+    for (int i = 0; i < num_shards; i++)
+        os_thread_create(&shards[i].thread, &shards[i], shard_routine);
+
+    for (int i = 0; i < num_shards; i++)
+        os_thread_join(shards[i].thread);
+
+    for (int i = 0; i < num_shards; i++)
+        http_server_free(&shards[i].server);
+    free(shards);
+    free(group);
+    return true;
+}
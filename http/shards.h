@@ -0,0 +1,11 @@
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include "server.h"
+
+typedef void (*http_handler)(struct server *s, struct request *r, uint32_t handle, void *userp);
+
+bool http_server_run_shards(const char *addr, uint16_t port, int num_shards,
+                            http_handler handler, void *userp);
+
+#endif /* SHARDS_H */
@@ -0,0 +1,155 @@
+/*
+ * Checks that serving keep-alive requests doesn't touch
+ * the heap once the server warmed up. The allocator is
+ * wrapped to count the calls made by the server thread.
+ *
+ *   gcc test_alloc.c server.c parse.c ../thread/thread.c \
+ *       -o test_alloc -Wall -Wextra -ggdb -DKEEPALIVE_MAX_REQUESTS=1000000 -lpthread
+ *   ./test_alloc epoll
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "server.h"
+#include "../thread/thread.h"
+
+#define PORT 8092
+#define NUM_WARMUP 1000
+#define NUM_REQUESTS 10000
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t num, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void  __libc_free(void *ptr);
+
+static _Atomic(uint64_t) num_allocs = 0;
+static _Thread_local bool counting = false;
+
+void *malloc(size_t size)
+{
+    if (counting) num_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size)
+{
+    if (counting) num_allocs++;
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (counting) num_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (counting && ptr) num_allocs++;
+    __libc_free(ptr);
+}
+
+static struct server server;
+
+static os_threadreturn server_routine(void *arg)
+{
+    (void) arg;
+    counting = true;
+    for (;;) {
+        struct request r;
+        uint32_t h = http_server_wait_request(&server, &r);
+        http_server_set_status(&server, h, 200);
+        http_server_append_header(&server, h, "Content-Type: text/plain");
+        http_server_append_content_format(&server, h, "Hello, %.*s!\n", (int) r.path.size, r.path.data);
+        http_server_send_response(&server, h);
+    }
+    return 0;
+}
+
+static int connect_to_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends a request and reads the response
+static bool roundtrip(int fd)
+{
+    static const char req[] = "GET /world HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (send(fd, req, sizeof(req)-1, 0) != sizeof(req)-1)
+        return false;
+
+    char buf[1<<10];
+    size_t used = 0;
+    for (;;) {
+        int n = recv(fd, buf + used, sizeof(buf) - used - 1, 0);
+        if (n <= 0)
+            return false;
+        used += n;
+        buf[used] = '\0';
+        if (strstr(buf, "Hello, /world!\n"))
+            break;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int backend = HTTP_BACKEND_EPOLL;
+    if (argc > 1 && !strcmp(argv[1], "poll"))
+        backend = HTTP_BACKEND_POLL;
+#ifdef HTTP_ASYNCIO
+    if (argc > 1 && !strcmp(argv[1], "asyncio"))
+        backend = HTTP_BACKEND_ASYNCIO;
+#endif
+
+    if (!http_server_init_ex(&server, "127.0.0.1", PORT, (struct server_config) {.backend=backend})) {
+        fprintf(stderr, "Couldn't start the server\n");
+        return -1;
+    }
+
+    os_thread thread;
+    os_thread_create(&thread, NULL, server_routine);
+
+    int fd = connect_to_server();
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't connect\n");
+        return -1;
+    }
+
+    for (int i = 0; i < NUM_WARMUP; i++)
+        if (!roundtrip(fd)) {
+            fprintf(stderr, "Connection lost\n");
+            return -1;
+        }
+
+    uint64_t before = num_allocs;
+    for (int i = 0; i < NUM_REQUESTS; i++)
+        if (!roundtrip(fd)) {
+            fprintf(stderr, "Connection lost\n");
+            return -1;
+        }
+    uint64_t after = num_allocs;
+
+    if (after != before) {
+        fprintf(stderr, "FAILED (%llu allocator calls for %d requests)\n",
+                (unsigned long long) (after - before), NUM_REQUESTS);
+        abort();
+    }
+    fprintf(stderr, "PASSED\n");
+    return 0;
+}
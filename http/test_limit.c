@@ -0,0 +1,122 @@
+/*
+ * Checks that a server configured for MAX_CLIENTS_LIMIT
+ * clients accepts and serves connections with any backend,
+ * and that one more client than that is refused at
+ * initialization instead of silently shrinking the table.
+ *
+ *   gcc test_limit.c server.c parse.c ../thread/thread.c ../asyncio/io.c \
+ *       -o test_limit -Wall -Wextra -ggdb -DHTTP_ASYNCIO -lpthread
+ *   ./test_limit asyncio
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "server.h"
+#include "../thread/thread.h"
+
+#define PORT 8093
+#define NUM_CLIENTS 64
+
+static struct server server;
+
+static os_threadreturn server_routine(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        struct request r;
+        uint32_t h = http_server_wait_request(&server, &r);
+        http_server_set_status(&server, h, 200);
+        http_server_append_header(&server, h, "Content-Type: text/plain");
+        http_server_append_content_format(&server, h, "Hello, %.*s!\n", (int) r.path.size, r.path.data);
+        http_server_send_response(&server, h);
+    }
+    return 0;
+}
+
+static int connect_to_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends a request and reads the response
+static bool roundtrip(int fd)
+{
+    static const char req[] = "GET /world HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (send(fd, req, sizeof(req)-1, 0) != sizeof(req)-1)
+        return false;
+
+    char buf[1<<10];
+    size_t used = 0;
+    for (;;) {
+        int n = recv(fd, buf + used, sizeof(buf) - used - 1, 0);
+        if (n <= 0)
+            return false;
+        used += n;
+        buf[used] = '\0';
+        if (strstr(buf, "Hello, /world!\n"))
+            break;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int backend = HTTP_BACKEND_EPOLL;
+    if (argc > 1 && !strcmp(argv[1], "poll"))
+        backend = HTTP_BACKEND_POLL;
+#ifdef HTTP_ASYNCIO
+    if (argc > 1 && !strcmp(argv[1], "asyncio"))
+        backend = HTTP_BACKEND_ASYNCIO;
+#endif
+
+    int max_clients = MAX_CLIENTS_LIMIT;
+
+    if (http_server_init_ex(&server, "127.0.0.1", PORT,
+            (struct server_config) {.backend=backend, .max_clients=max_clients+1})) {
+        fprintf(stderr, "FAILED (%d clients were accepted)\n", max_clients+1);
+        abort();
+    }
+
+    if (!http_server_init_ex(&server, "127.0.0.1", PORT,
+            (struct server_config) {.backend=backend, .max_clients=max_clients})) {
+        fprintf(stderr, "FAILED (%d clients were refused)\n", max_clients);
+        abort();
+    }
+
+    os_thread thread;
+    os_thread_create(&thread, NULL, server_routine);
+
+    // Connected at once so that they all hold a slot
+    int fds[NUM_CLIENTS];
+    for (int i = 0; i < NUM_CLIENTS; i++) {
+        fds[i] = connect_to_server();
+        if (fds[i] < 0) {
+            fprintf(stderr, "Couldn't connect\n");
+            return -1;
+        }
+    }
+
+    for (int k = 0; k < 2; k++)
+        for (int i = 0; i < NUM_CLIENTS; i++)
+            if (!roundtrip(fds[i])) {
+                fprintf(stderr, "FAILED (connection %d lost)\n", i);
+                abort();
+            }
+
+    fprintf(stderr, "PASSED\n");
+    return 0;
+}